@@ -0,0 +1,447 @@
+#include "CSE.h"
+#include "IRMutator.h"
+#include "IREquality.h"
+#include "IROperator.h"
+#include "IRPrinter.h"
+#include "Util.h"
+#include <map>
+#include <set>
+#include <sstream>
+#include <iostream>
+
+namespace Halide {
+namespace Internal {
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+using std::pair;
+using std::make_pair;
+using std::ostringstream;
+
+namespace {
+
+// Makes up names for the new variables that don't clash with any name
+// already in the IR. The names are numbered per call to
+// common_subexpression_elimination rather than taken from
+// unique_name, so that lowering the same pipeline twice produces the
+// same statement (which the jit cache depends on).
+class NameGenerator : public IRMutator {
+    set<string> names;
+    set<string> generated;
+    set<const IRNode *> visited;
+    int counter;
+
+    using IRMutator::visit;
+
+    void visit(const Variable *op) {
+        names.insert(op->name);
+        expr = op;
+    }
+
+    void visit(const Let *op) {
+        names.insert(op->name);
+        IRMutator::visit(op);
+    }
+
+    void visit(const Load *op) {
+        names.insert(op->name);
+        IRMutator::visit(op);
+    }
+
+    void visit(const LetStmt *op) {
+        names.insert(op->name);
+        IRMutator::visit(op);
+    }
+
+    void visit(const For *op) {
+        names.insert(op->name);
+        IRMutator::visit(op);
+    }
+
+    void visit(const Store *op) {
+        names.insert(op->name);
+        IRMutator::visit(op);
+    }
+
+    void visit(const Allocate *op) {
+        names.insert(op->name);
+        IRMutator::visit(op);
+    }
+
+public:
+    NameGenerator() : counter(0) {}
+
+    using IRMutator::mutate;
+
+    // Expressions may be DAGs, so only look inside each node once.
+    Expr mutate(Expr e) {
+        if (e.defined() && visited.insert(e.ptr).second) {
+            IRMutator::mutate(e);
+        }
+        return e;
+    }
+
+    void add_names_in(Expr e) {
+        mutate(e);
+    }
+
+    void add_names_in(Stmt s) {
+        mutate(s);
+    }
+
+    string make() {
+        while (1) {
+            ostringstream oss;
+            oss << "t" << counter++;
+            if (!names.count(oss.str())) {
+                generated.insert(oss.str());
+                return oss.str();
+            }
+        }
+    }
+
+    bool is_generated(const string &name) const {
+        return generated.count(name) != 0;
+    }
+};
+
+// Calls that have side-effects, or that codegen needs to see in place
+// (e.g. the names of functions passed to the tracing and memory
+// tracking calls).
+bool must_stay_in_place(const Call *op) {
+    if (op->call_type != Call::Extern) return false;
+    if (op->args.empty() || starts_with(op->name, "halide_")) return true;
+    return (op->name.find(' ') != string::npos &&
+            op->name != "shuffle vector" &&
+            op->name != "interleave vectors");
+}
+
+// Get the direct children of an expression node
+class GetChildren : public IRMutator {
+public:
+    vector<Expr> children;
+
+    using IRMutator::mutate;
+
+    Expr mutate(Expr e) {
+        children.push_back(e);
+        return e;
+    }
+};
+
+Expr cse(Expr e, NameGenerator *names);
+
+class CSE : public IRMutator {
+    struct Info {
+        vector<Expr> children;
+        // How many times the node would be evaluated, saturating at
+        // two. We only care whether it's more than one.
+        int uses;
+        // Does the node contain a call that must stay in place?
+        bool impure;
+        // Is the node part of a vector pattern that codegen
+        // recognizes?
+        bool pattern;
+        bool lift;
+        bool visited;
+        Info() : uses(0), impure(false), pattern(false), lift(false), visited(false) {}
+    };
+
+    map<const IRNode *, Info> info;
+
+    // The nodes in post-order. Reversed, every node comes before its
+    // children.
+    vector<Expr> order;
+
+    // The replacement for each node we've already rebuilt
+    map<const IRNode *, Expr> replacement;
+
+    NameGenerator *names;
+
+    void add_uses(const Expr &e, int uses) {
+        Info &i = info[e.ptr];
+        i.uses = std::min(2, i.uses + uses);
+    }
+
+    // Mark the top few levels of the expression as part of a
+    // pattern. Three levels is deep enough for the patterns rooted at
+    // narrowing casts in CodeGen_X86 and CodeGen_ARM.
+    void mark_pattern(const Expr &e, int depth) {
+        Info &i = info[e.ptr];
+        i.pattern = true;
+        if (depth > 1) {
+            for (size_t j = 0; j < i.children.size(); j++) {
+                mark_pattern(i.children[j], depth - 1);
+            }
+        }
+    }
+
+    void find_vector_patterns(const Expr &e, const vector<Expr> &children) {
+        if (const Cast *op = e.as<Cast>()) {
+            if (op->value.type().bits < op->type.bits) {
+                // Widening casts are the leaves of most patterns
+                // (e.g. saturating adds).
+                info[e.ptr].pattern = true;
+            } else if (op->value.type().bits > op->type.bits) {
+                mark_pattern(op->value, 3);
+            }
+        } else if (e.as<Div>() || e.as<Select>()) {
+            // Averaging, reciprocal square roots, and absolute
+            // differences.
+            for (size_t j = 0; j < children.size(); j++) {
+                info[children[j].ptr].pattern = true;
+            }
+        } else if (const Sub *op = e.as<Sub>()) {
+            // Saturating negation
+            if (op->b.as<Max>()) info[op->b.ptr].pattern = true;
+        }
+    }
+
+    void analyze(const Expr &e) {
+        if (info[e.ptr].visited) return;
+        info[e.ptr].visited = true;
+
+        // Let expressions are barriers. Their value and body are
+        // handled separately.
+        if (e.as<Let>()) {
+            order.push_back(e);
+            return;
+        }
+
+        GetChildren get_children;
+        e.accept(&get_children);
+
+        const Call *call = e.as<Call>();
+        bool impure = call && must_stay_in_place(call);
+        for (size_t j = 0; j < get_children.children.size(); j++) {
+            const Expr &child = get_children.children[j];
+            analyze(child);
+            impure = impure || info[child.ptr].impure;
+        }
+
+        Info &i = info[e.ptr];
+        i.children = get_children.children;
+        i.impure = impure;
+
+        if (e.type().is_vector()) {
+            find_vector_patterns(e, i.children);
+        }
+
+        order.push_back(e);
+    }
+
+    bool can_lift(const Expr &e, const Info &i) {
+        if (i.impure || i.pattern) return false;
+        // Constants and variables are as cheap as the new variable
+        // would be. Codegen looks for ramps in load and store
+        // indices, and broadcasts in the arguments of some
+        // patterns. Both are cheap anyway.
+        return !(e.as<IntImm>() || e.as<FloatImm>() || e.as<Variable>() ||
+                 e.as<Ramp>() || e.as<Broadcast>() || e.as<Let>());
+    }
+
+    using IRMutator::visit;
+
+    Expr rebuild(Expr e) {
+        e.accept(this);
+        return expr;
+    }
+
+public:
+    CSE(NameGenerator *n) : names(n) {}
+
+    using IRMutator::mutate;
+
+    Expr mutate(Expr e) {
+        map<const IRNode *, Expr>::iterator iter = replacement.find(e.ptr);
+        if (iter != replacement.end()) return iter->second;
+
+        Expr result;
+        if (const Let *op = e.as<Let>()) {
+            result = Let::make(op->name, cse(op->value, names), cse(op->body, names));
+        } else {
+            result = rebuild(e);
+        }
+        replacement[e.ptr] = result;
+        return result;
+    }
+
+    Expr go(Expr e) {
+        analyze(e);
+
+        // Count the uses of each node, parents first. A node we
+        // lift is evaluated once, no matter how often it's used.
+        add_uses(e, 1);
+        for (size_t j = order.size(); j > 0; j--) {
+            const Expr &node = order[j-1];
+            Info &i = info[node.ptr];
+            i.lift = i.uses > 1 && can_lift(node, i);
+            int uses = i.lift ? 1 : i.uses;
+            for (size_t k = 0; k < i.children.size(); k++) {
+                add_uses(i.children[k], uses);
+            }
+        }
+
+        // Make the values of the lets, children first, and replace
+        // the lifted nodes with variables.
+        vector<pair<string, Expr> > lets;
+        for (size_t j = 0; j < order.size(); j++) {
+            const Expr &node = order[j];
+            if (!info[node.ptr].lift) continue;
+            string name = names->make();
+            lets.push_back(make_pair(name, rebuild(node)));
+            replacement[node.ptr] = Variable::make(node.type(), name);
+        }
+
+        Expr result = mutate(e);
+        for (size_t j = lets.size(); j > 0; j--) {
+            result = Let::make(lets[j-1].first, lets[j-1].second, result);
+        }
+        return result;
+    }
+};
+
+Expr cse(Expr e, NameGenerator *names) {
+    if (!e.defined()) return e;
+    // Make equal subexpressions the same object, so that we can find
+    // them by address.
+    ExprCache cache;
+    e = cache.canonical(e);
+    return CSE(names).go(e);
+}
+
+class CSEEveryExpr : public IRMutator {
+    NameGenerator *names;
+
+    using IRMutator::visit;
+
+    void visit(const Store *op) {
+        Expr value = mutate(op->value);
+        Expr index = mutate(op->index);
+
+        // Codegen only recognizes dense vector stores if the index
+        // is a ramp, so move the new lets out of the index and into
+        // let statements around the store.
+        vector<pair<string, Expr> > lets;
+        while (const Let *let = index.as<Let>()) {
+            if (!names->is_generated(let->name)) break;
+            lets.push_back(make_pair(let->name, let->value));
+            index = let->body;
+        }
+
+        if (value.same_as(op->value) && index.same_as(op->index)) {
+            stmt = op;
+        } else {
+            stmt = Store::make(op->name, value, index);
+        }
+
+        for (size_t i = lets.size(); i > 0; i--) {
+            stmt = LetStmt::make(lets[i-1].first, lets[i-1].second, stmt);
+        }
+    }
+
+public:
+    CSEEveryExpr(NameGenerator *n) : names(n) {}
+
+    using IRMutator::mutate;
+
+    Expr mutate(Expr e) {
+        return cse(e, names);
+    }
+};
+
+}
+
+Expr common_subexpression_elimination(Expr e) {
+    NameGenerator names;
+    names.add_names_in(e);
+    return cse(e, &names);
+}
+
+Stmt common_subexpression_elimination(Stmt s) {
+    NameGenerator names;
+    names.add_names_in(s);
+    return CSEEveryExpr(&names).mutate(s);
+}
+
+namespace {
+
+void check(Expr in, Expr correct) {
+    Expr result = common_subexpression_elimination(in);
+    if (!equal(result, correct)) {
+        std::cout << "Incorrect CSE:\n" << in
+                  << "\nbecame:\n" << result
+                  << "\ninstead of:\n" << correct << "\n";
+        assert(false);
+    }
+}
+
+}
+
+void cse_test() {
+    Expr x = Variable::make(Int(32), "x");
+    Expr y = Variable::make(Int(32), "y");
+    Expr t0 = Variable::make(Int(32), "t0");
+    Expr t1 = Variable::make(Int(32), "t1");
+    Expr t2 = Variable::make(Int(32), "t2");
+
+    // Nothing to do
+    check(x * y + 3, x * y + 3);
+
+    // The common subexpression is computed once. Its subexpressions
+    // aren't lifted too, because they're only used by it.
+    Expr e = x * y + 1;
+    check(e * e, Let::make("t0", e, t0 * t0));
+
+    // Separately-built equal expressions count as common
+    check((x * y + 1) * (x * y + 1), Let::make("t0", e, t0 * t0));
+
+    // Nested common subexpressions
+    e = x * y;
+    e = e + e;
+    check(e * e, Let::make("t0", x * y, Let::make("t1", t0 + t0, t1 * t1)));
+
+    // The new variables don't clash with existing ones
+    e = t0 * y + t1;
+    check(e * e, Let::make("t2", e, t2 * t2));
+
+    // Constants, variables, ramps, and broadcasts stay in place
+    e = Ramp::make(x, 1, 4) * Broadcast::make(y, 4);
+    check(e + Ramp::make(x, 1, 4), e + Ramp::make(x, 1, 4));
+    check(x * 17 + x * 17, Let::make("t0", x * 17, t0 + t0));
+
+    // Calls with side-effects stay in place too, but their arguments
+    // can still be lifted.
+    Expr call = Call::make(Int(32), "halide_trace", vec(x * y));
+    Expr call_t0 = Call::make(Int(32), "halide_trace", vec(t0));
+    check(call + call, Let::make("t0", x * y, call_t0 + call_t0));
+
+    // Let expressions are barriers
+    Expr z = Variable::make(Int(32), "z");
+    e = Let::make("z", x * y, (z + 1) * (z + 1)) + x * y;
+    check(e, Let::make("z", x * y, Let::make("t0", z + 1, t0 * t0)) + x * y);
+
+    // Common subexpressions are found across vector lanes
+    e = Broadcast::make(x * y + 1, 4) + Ramp::make(x * y + 1, 2, 4);
+    check(e, Let::make("t0", x * y + 1,
+                       Broadcast::make(t0, 4) + Ramp::make(t0, 2, 4)));
+
+    // The parts of vector patterns that codegen recognizes stay in
+    // place, but the loads inside them are lifted.
+    Type u8 = UInt(8, 16), u16 = UInt(16, 16);
+    Expr a = Load::make(u8, "a", Ramp::make(x, 1, 16), Buffer(), Parameter());
+    Expr b = Load::make(u8, "b", Ramp::make(x, 1, 16), Buffer(), Parameter());
+    Expr va = Variable::make(u8, "t0"), vavg = Variable::make(u8, "t1");
+    Expr one = Broadcast::make(Cast::make(UInt(16), 1), 16);
+    Expr two = Broadcast::make(Cast::make(UInt(16), 2), 16);
+    Expr avg = Cast::make(u8, (Cast::make(u16, a) + Cast::make(u16, b) + one) / two);
+    Expr avg_lifted = Cast::make(u8, (Cast::make(u16, va) + Cast::make(u16, b) + one) / two);
+    check(avg + avg * a, Let::make("t0", a, Let::make("t1", avg_lifted, vavg + vavg * va)));
+
+    std::cout << "CSE test passed" << std::endl;
+}
+
+}
+}
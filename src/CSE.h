@@ -0,0 +1,32 @@
+#ifndef HALIDE_CSE_H
+#define HALIDE_CSE_H
+
+/** \file
+ * Defines a pass for introducing let expressions to wrap common sub-expressions. */
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Replace each common sub-expression in the argument with a
+ * variable, and wrap the resulting expr in a let expression giving a
+ * value to that variable. Constants, variables, ramps, broadcasts,
+ * and calls with side-effects are left in place, as are the pieces of
+ * vector expressions that the backends pattern-match to special
+ * instructions (e.g. saturating adds and averaging). Let expressions
+ * already in the argument act as barriers: their values and bodies
+ * are processed separately. */
+Expr common_subexpression_elimination(Expr);
+
+/** Do common-subexpression-elimination on each expression in a
+ * statement. Does not introduce let statements, except to keep the
+ * index of a store a ramp. Done as the last pass of lowering. */
+Stmt common_subexpression_elimination(Stmt);
+
+void cse_test();
+
+}
+}
+
+#endif
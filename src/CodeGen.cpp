@@ -9,6 +9,7 @@
 #include "Simplify.h"
 #include "JITCompiledModule.h"
 #include "CodeGen_Internal.h"
+#include "CompileProfiling.h"
 
 #include <sstream>
 
@@ -56,6 +57,8 @@ CodeGen::CodeGen() :
     f16(NULL), f32(NULL), f64(NULL),
     buffer_t(NULL) {
 
+    stack_allocation_threshold = default_stack_allocation_threshold();
+
     // Initialize the targets we want to generate code for which are enabled
     // in llvm configuration
     if (!llvm_initialized) {            
@@ -121,6 +124,8 @@ void CodeGen::compile(Stmt stmt, string name, const vector<Argument> &args) {
     assert(module && context && builder && "The CodeGen subclass should have made an initial module before calling CodeGen::compile");
     owns_module = true;
 
+    CompileTimer timer("code generation for " + name);
+
     // Start the module off with a definition of a buffer_t
     define_buffer_t();
 
@@ -213,9 +218,11 @@ void CodeGen::compile(Stmt stmt, string name, const vector<Argument> &args) {
     // Finally, verify the module is ok
     verifyModule(*module);
     log(2) << "Done generating llvm bitcode\n";
+    timer.lap("llvm ir generation", count_llvm_instructions(module));
 
     // Optimize it
     optimize_module();
+    timer.lap("llvm optimization", count_llvm_instructions(module));
 
     if (log::debug_level >= 2) {
         module->dump();
@@ -274,9 +281,38 @@ void CodeGen::compile_to_bitcode(const string &filename) {
     WriteBitcodeToFile(module, out);
 }
 
+bool CodeGen::compile_from_bitcode(const string &filename, const string &name) {
+    init_module();
+
+    OwningPtr<MemoryBuffer> bitcode_buffer;
+    if (MemoryBuffer::getFile(filename, bitcode_buffer)) {
+        log(1) << "Could not read " << filename << "\n";
+        return false;
+    }
+
+    string errstr;
+    module = ParseBitcodeFile(bitcode_buffer.get(), *context, &errstr);
+    if (!module) {
+        log(1) << "Error parsing " << filename << ": " << errstr << "\n";
+        return false;
+    }
+    owns_module = true;
+
+    function_name = name;
+    function = module->getFunction(name);
+    if (!function || !module->getFunction(name + "_jit_wrapper")) {
+        log(1) << filename << " does not contain " << name << "\n";
+        return false;
+    }
+
+    return true;
+}
+
 void CodeGen::compile_to_native(const string &filename, bool assembly) {
     assert(module && "No module defined. Must call compile before calling compile_to_native");
 
+    CompileTimer timer("native code generation for " + function_name);
+
     // Get the target specific parser.
     string error_string;
     log(1) << "Compiling to native code...\n";
@@ -359,6 +395,7 @@ void CodeGen::compile_to_native(const string &filename, bool assembly) {
     target_machine->addPassesToEmitFile(pass_manager, out, file_type);
 
     pass_manager.run(*module);
+    timer.lap("instruction selection and emission", count_llvm_instructions(module));
 
     delete target_machine;
 }
@@ -1058,6 +1095,41 @@ void CodeGen::visit(const Call *op) {
         return;
     }
 
+    if (op->name == "trace func name") {
+        assert(op->args.size() == 2);
+        const Call *name = op->args[1].as<Call>();
+        assert(name && "Malformed trace func name node");
+        llvm::Function *trace_func_name = module->getFunction("halide_trace_func_name");
+        assert(trace_func_name && "Could not find halide_trace_func_name function in initial module");
+
+        Value *char_ptr = create_string_constant(name->name);
+        value = builder->CreateCall(trace_func_name, vec(codegen(op->args[0]), char_ptr));
+        return;
+    }
+
+    if (op->name == "trace start") {
+        assert(op->args.size() == 1);
+        const Call *name = op->args[0].as<Call>();
+        assert(name && "Malformed trace start node");
+        llvm::Function *trace_start = module->getFunction("halide_trace_start");
+        assert(trace_start && "Could not find halide_trace_start function in initial module");
+
+        value = builder->CreateCall(trace_start, vec(create_string_constant(name->name)));
+        return;
+    }
+
+    if (op->name == "memory allocation name") {
+        assert(op->args.size() == 2);
+        const Call *name = op->args[1].as<Call>();
+        assert(name && "Malformed memory allocation name node");
+        llvm::Function *allocation_name = module->getFunction("halide_memory_allocation_name");
+        assert(allocation_name && "Could not find halide_memory_allocation_name function in initial module");
+
+        Value *char_ptr = create_string_constant(name->name);
+        value = builder->CreateCall(allocation_name, vec(codegen(op->args[0]), char_ptr));
+        return;
+    }
+
     // Now, codegen the args
     vector<Value *> args(op->args.size());
     for (size_t i = 0; i < op->args.size(); i++) {
@@ -1147,6 +1219,11 @@ void CodeGen::visit(const PrintStmt *op) {
     fmt_of_type[Halide::Type::UInt] = "%u";
     fmt_of_type[Halide::Type::Int] = "%d";
     fmt_of_type[Halide::Type::Float] = "%3.3f";
+    // 64-bit integers (e.g. timestamps) are printed in full
+    string fmt_of_64_bit_type[3];
+    fmt_of_64_bit_type[Halide::Type::UInt] = "%llu";
+    fmt_of_64_bit_type[Halide::Type::Int] = "%lld";
+    fmt_of_64_bit_type[Halide::Type::Float] = "%3.3f";
 
     vector<Value *> args;
     vector<Halide::Type> dst_types;
@@ -1162,13 +1239,13 @@ void CodeGen::visit(const PrintStmt *op) {
                 Value *ll_arg_lane = builder->CreateExtractElement(ll_arg, idx);
                 args.push_back(ll_arg_lane);
                 dst_types.push_back(arg.type().element_of());
-                format_string << fmt_of_type[arg.type().t];
+                format_string << (arg.type().bits == 64 ? fmt_of_64_bit_type : fmt_of_type)[arg.type().t];
             }
             format_string << ']';
         } else {
             args.push_back(ll_arg);
             dst_types.push_back(arg.type());
-            format_string << fmt_of_type[arg.type().t];
+            format_string << (arg.type().bits == 64 ? fmt_of_64_bit_type : fmt_of_type)[arg.type().t];
         }
     }
 
@@ -1176,10 +1253,11 @@ void CodeGen::visit(const PrintStmt *op) {
 
     // Now cast all the args to the appropriate types
     for (size_t i = 0; i < args.size(); i++) {
+        bool wide = dst_types[i].bits == 64;
         if (dst_types[i].is_int()) {
-            args[i] = builder->CreateIntCast(args[i], i32, true);                
+            args[i] = builder->CreateIntCast(args[i], wide ? i64 : i32, true);
         } else if (dst_types[i].is_uint()) {
-            args[i] = builder->CreateIntCast(args[i], i32, false);
+            args[i] = builder->CreateIntCast(args[i], wide ? i64 : i32, false);
         } else {
             args[i] = builder->CreateFPCast(args[i], f64);
         }            
@@ -1205,7 +1283,26 @@ void CodeGen::visit(const PrintStmt *op) {
 }
 
 void CodeGen::visit(const AssertStmt *op) {
-    create_assertion(codegen(op->condition), op->message);
+    Value *cond = codegen(op->condition);
+    // A vectorized assertion (e.g. one that traces each lane of a
+    // vectorized provide) must hold in every lane.
+    if (op->condition.type().is_vector()) {
+        Value *all_lanes = builder->CreateExtractElement(cond, ConstantInt::get(i32, 0));
+        for (int i = 1; i < op->condition.type().width; i++) {
+            Value *lane = builder->CreateExtractElement(cond, ConstantInt::get(i32, i));
+            all_lanes = builder->CreateAnd(all_lanes, lane);
+        }
+        cond = all_lanes;
+    }
+    create_assertion(cond, op->message);
+}
+
+Value *CodeGen::create_string_constant(const string &str) {
+    llvm::Type *type = ArrayType::get(i8, str.size()+1);
+    GlobalVariable *global = new GlobalVariable(*module, type,
+                                                true, GlobalValue::PrivateLinkage, 0);
+    global->setInitializer(ConstantDataArray::getString(*context, str));
+    return builder->CreateConstInBoundsGEP2_32(global, 0, 0);
 }
 
 void CodeGen::create_assertion(Value *cond, const string &message) {
@@ -1346,14 +1443,26 @@ void CodeGen::visit(const For *op) {
 
         // Move the builder back to the main function and call do_par_for
         builder->SetInsertPoint(call_site);
-        llvm::Function *do_par_for = module->getFunction("halide_do_par_for");
-        assert(do_par_for && "Could not find halide_do_par_for in initial module");
-        do_par_for->setDoesNotAlias(4);
-        //do_par_for->setDoesNotCapture(4);
         ptr = builder->CreatePointerCast(ptr, i8->getPointerTo());
-        vector<Value *> args = vec<Value *>(function, min, extent, ptr);
-        log(4) << "Creating call to do_par_for\n";
-        builder->CreateCall(do_par_for, args);
+        if (op->grain > 1) {
+            // Workers should claim several consecutive iterations at
+            // a time.
+            llvm::Function *do_par_for = module->getFunction("halide_do_par_for_chunked");
+            assert(do_par_for && "Could not find halide_do_par_for_chunked in initial module");
+            do_par_for->setDoesNotAlias(5);
+            Value *grain = ConstantInt::get(i32, op->grain);
+            vector<Value *> args = vec<Value *>(function, min, extent, grain, ptr);
+            log(4) << "Creating call to do_par_for_chunked with grain " << op->grain << "\n";
+            builder->CreateCall(do_par_for, args);
+        } else {
+            llvm::Function *do_par_for = module->getFunction("halide_do_par_for");
+            assert(do_par_for && "Could not find halide_do_par_for in initial module");
+            do_par_for->setDoesNotAlias(4);
+            //do_par_for->setDoesNotCapture(4);
+            vector<Value *> args = vec<Value *>(function, min, extent, ptr);
+            log(4) << "Creating call to do_par_for\n";
+            builder->CreateCall(do_par_for, args);
+        }
 
         log(3) << "Leaving parallel for loop over " << op->name << "\n";
 
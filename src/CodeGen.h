@@ -59,6 +59,12 @@ public:
      * after calling compile. */
     void compile_to_bitcode(const std::string &filename);
 
+    /** Load a module written by compile_to_bitcode (after a call to
+     * compile for the same target) instead of calling compile. name
+     * is the name that was passed to compile. Returns false if the
+     * file can't be read or doesn't contain that function. */
+    bool compile_from_bitcode(const std::string &filename, const std::string &name);
+
     /** Emit a compiled halide statement as either an object file, or
      * as raw assembly, depending on the value of the second
      * argument. Call this after calling compile. */
@@ -89,8 +95,19 @@ public:
      * module cleanup routines. */
     virtual void jit_finalize(llvm::ExecutionEngine *ee, llvm::Module *module, std::vector<void (*)()> *cleanup_routines) {}
 
+    /** Put constant-sized allocations of less than this many bytes on
+     * the stack instead of the heap. Defaults to
+     * default_stack_allocation_threshold(). */
+    void set_stack_allocation_threshold(int bytes) {
+        stack_allocation_threshold = bytes;
+    }
+
 protected:
 
+    /** Constant-sized allocations smaller than this many bytes go on
+     * the stack, for targets that support it. */
+    int stack_allocation_threshold;
+
     /** State needed by llvm for code generation, including the
      * current module, function, context, builder, and most recently
      * generated llvm value. */
@@ -159,6 +176,10 @@ protected:
 
     /** Codegen an assertion. If false, it bails out and calls the error handler. */
     void create_assertion(llvm::Value *condition, const std::string &message);
+
+    /** Make a global string constant, and return a pointer to its
+     * first character. */
+    llvm::Value *create_string_constant(const std::string &str);
        
     /** Given an llvm value representing a pointer to a buffer_t, extract various subfields.
      * The *_ptr variants return a pointer to the struct element, while the basic variants 
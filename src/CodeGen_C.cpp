@@ -119,7 +119,23 @@ const string preamble =
     "extern \"C\" int halide_debug_to_file(const char *filename, void *data, int, int, int, int, int, int);\n"
     "extern \"C\" int halide_start_clock();\n"
     "extern \"C\" int halide_current_time();\n"
+    "extern \"C\" int64_t halide_current_time_ns();\n"
     "extern \"C\" int halide_printf(const char *fmt, ...);\n"
+    "extern \"C\" int halide_profiler_pipeline_start(int);\n"
+    "extern \"C\" int halide_profiler_pipeline_end();\n"
+    "extern \"C\" int halide_profiler_set_current(int);\n"
+    "extern \"C\" int64_t halide_profiler_time_ns(int);\n"
+    "extern \"C\" int halide_profiler_counters_start(int);\n"
+    "extern \"C\" int64_t halide_profiler_counter(int, int);\n"
+    "extern \"C\" int halide_trace_start(const char *);\n"
+    "extern \"C\" int halide_trace_end();\n"
+    "extern \"C\" int halide_trace(int, int, int, int, int, int, int);\n"
+    "extern \"C\" int halide_trace_func_name(int, const char *);\n"
+    "extern \"C\" int halide_memory_tracking_start(int);\n"
+    "extern \"C\" int halide_memory_allocation_name(int, const char *);\n"
+    "extern \"C\" int halide_memory_allocate(int, int64_t);\n"
+    "extern \"C\" int halide_memory_free(int, int64_t);\n"
+    "extern \"C\" int64_t halide_memory_stat(int, int);\n"
     "extern \"C\" inline float pow_f32(float x, float y) {return powf(x, y);}\n"
     "extern \"C\" inline float round_f32(float x) {return roundf(x);}\n"
     "\n"
@@ -368,6 +384,20 @@ void CodeGen_C::visit(const Call *op) {
             rhs << ", " << args[i];
         }
         rhs << ")";
+    } else if (op->name == "trace func name") {
+        assert(op->args.size() == 2);
+        string id = print_expr(op->args[0]);
+        string name = op->args[1].as<Call>()->name;
+        rhs << "halide_trace_func_name(" << id << ", \"" << name << "\")";
+    } else if (op->name == "trace start") {
+        assert(op->args.size() == 1);
+        string name = op->args[0].as<Call>()->name;
+        rhs << "halide_trace_start(\"" << name << "\")";
+    } else if (op->name == "memory allocation name") {
+        assert(op->args.size() == 2);
+        string id = print_expr(op->args[0]);
+        string name = op->args[1].as<Call>()->name;
+        rhs << "halide_memory_allocation_name(" << id << ", \"" << name << "\")";
     } else {
         // Generic calls
         vector<string> args(op->args.size());
@@ -467,7 +497,10 @@ void CodeGen_C::visit(const PrintStmt *op) {
     string format_string;
     stream << "halide_printf(\"" << op->prefix;
     for (size_t i = 0; i < op->args.size(); i++) {
-        if (op->args[i].type().is_int() || 
+        if (op->args[i].type().bits == 64 &&
+            (op->args[i].type().is_int() || op->args[i].type().is_uint())) {
+            stream << " %lld";
+        } else if (op->args[i].type().is_int() || 
             op->args[i].type().is_uint()) {
             stream << " %d";
         } else {
@@ -476,7 +509,11 @@ void CodeGen_C::visit(const PrintStmt *op) {
     }
     stream << "\"";
     for (size_t i = 0; i < op->args.size(); i++) {
-        stream << ", " << args[i];
+        if (op->args[i].type().bits == 64 && !op->args[i].type().is_float()) {
+            stream << ", (long long)" << args[i];
+        } else {
+            stream << ", " << args[i];
+        }
     }
     stream << ");\n";
 }
@@ -190,5 +190,15 @@ llvm::Type *llvm_type_of(LLVMContext *c, Halide::Type t) {
     }
 }
 
+size_t count_llvm_instructions(llvm::Module *m) {
+    size_t count = 0;
+    for (llvm::Module::iterator f = m->begin(); f != m->end(); ++f) {
+        for (llvm::Function::iterator b = f->begin(); b != f->end(); ++b) {
+            count += b->size();
+        }
+    }
+    return count;
+}
+
 }
 }
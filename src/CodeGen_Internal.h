@@ -88,6 +88,9 @@ public:
 /** Get the llvm type equivalent to a given halide type */
 llvm::Type *llvm_type_of(llvm::LLVMContext *context, Halide::Type t);
 
+/** Count the instructions in an llvm module */
+size_t count_llvm_instructions(llvm::Module *m);
+
 }}
 
 #endif
@@ -569,13 +569,14 @@ void CodeGen_PTX_Host::visit(const Allocate *alloc) {
     WhereIsBufferUsed usage(alloc->name);
     alloc->accept(&usage);
 
-    Value *saved_stack = NULL, *host;
+    Value *saved_stack = NULL, *host_saved_stack = NULL, *host;
 
     if (usage.used_on_host) {
         log(2) << alloc->name << " is used on the host\n";
-        host = malloc_buffer(alloc, &saved_stack);
+        bool on_stack;
+        host = malloc_buffer(alloc, &on_stack, &host_saved_stack);
         sym_push(alloc->name + ".host", host);
-        if (!saved_stack) {
+        if (!on_stack) {
             heap_allocations.push(alloc->name, host);
         }
     } else {
@@ -586,10 +587,7 @@ void CodeGen_PTX_Host::visit(const Allocate *alloc) {
     if (usage.used_on_device) {
         log(2) << alloc->name << " is used on the device\n";
         // create a buffer_t to track this allocation
-        if (!saved_stack) {
-            // Save the stack pointer if we haven't already
-            saved_stack = save_stack();
-        }
+        saved_stack = save_stack();
         buf = builder->CreateAlloca(buffer_t);
         Value *zero32 = ConstantInt::get(i32, 0),
             *one32  = ConstantInt::get(i32, 1),
@@ -635,7 +633,11 @@ void CodeGen_PTX_Host::visit(const Allocate *alloc) {
 
     codegen(alloc->body);
    
-    if (saved_stack) {
+    // The host allocation (if it's on the stack) was made first, so
+    // restoring to before it frees both.
+    if (host_saved_stack) {
+        restore_stack(host_saved_stack);
+    } else if (saved_stack) {
         restore_stack(saved_stack);
     }
 }
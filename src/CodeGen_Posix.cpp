@@ -103,13 +103,18 @@ CodeGen_Posix::CodeGen_Posix() :
     max_f32(Float(32).max()),
 
     min_f64(Float(64).min()),
-    max_f64(Float(64).max()) {
+    max_f64(Float(64).max()),
+
+    loop_depth(0) {
 
 }
 
 void CodeGen_Posix::init_module() {
     CodeGen::init_module();
 
+    loop_depth = 0;
+    hoisted_stack_bytes.clear();
+
     i8x8 = VectorType::get(i8, 8);
     i8x16 = VectorType::get(i8, 16);
     i8x32 = VectorType::get(i8, 32);
@@ -142,37 +147,54 @@ void CodeGen_Posix::restore_stack(llvm::Value *saved_stack) {
     builder->CreateCall(stackrestore, saved_stack);
 }
 
-Value *CodeGen_Posix::malloc_buffer(const Allocate *alloc, Value **saved_stack) {
+Value *CodeGen_Posix::malloc_buffer(const Allocate *alloc, bool *on_stack, Value **saved_stack) {
 
-    // Allocate anything less than 8k on the stack
+    // Allocate small constant-sized things on the stack
     int bytes_per_element = alloc->type.bits / 8;
-    int stack_size = 0;
-    bool on_stack = false;
-    if (const IntImm *size = alloc->size.as<IntImm>()) {            
-        stack_size = size->value;
-        on_stack = (saved_stack != NULL) && stack_size < 8*1024;
+    int64_t stack_bytes = 0;
+    bool use_stack = false;
+    if (const IntImm *size = alloc->size.as<IntImm>()) {
+        stack_bytes = (int64_t)size->value * bytes_per_element;
+        use_stack = (on_stack != NULL) && stack_bytes < stack_allocation_threshold;
     }
 
-    Value *size = codegen(alloc->size * bytes_per_element);
     llvm::Type *llvm_type = llvm_type_of(alloc->type);
-    Value *ptr;                
-    *saved_stack = NULL;
-
-    if (on_stack) {
-        // TODO: Optimize to do only one stack pointer save per loop scope.
-        *saved_stack = save_stack();
-
-        // Do a 32-byte aligned alloca
-        int total_bytes = stack_size * bytes_per_element;            
-        int chunks = (total_bytes + 31)/32;
-        ptr = builder->CreateAlloca(i32x8, ConstantInt::get(i32, chunks)); 
+    Value *ptr;
+    if (on_stack) *on_stack = use_stack;
+    if (saved_stack) *saved_stack = NULL;
+
+    if (use_stack) {
+        int chunks = (int)((stack_bytes + 31)/32);
+        llvm::Function *f = builder->GetInsertBlock()->getParent();
+        int64_t &hoisted = hoisted_stack_bytes[f];
+        if (loop_depth > 0 && hoisted + stack_bytes < stack_allocation_threshold) {
+            // Do the alloca at the top of the entry block of the
+            // current function, so that the stack is only adjusted
+            // once per call, rather than every time around the loops
+            // we're inside. The total hoisted is capped, because
+            // hoisted allocations never share stack space with each
+            // other.
+            hoisted += chunks * 32;
+            BasicBlock *entry = &(f->getEntryBlock());
+            IRBuilderBase::InsertPoint here = builder->saveIP();
+            builder->SetInsertPoint(entry, entry->getFirstInsertionPt());
+            ptr = builder->CreateAlloca(i32x8, ConstantInt::get(i32, chunks));
+            builder->restoreIP(here);
+        } else {
+            // Do a 32-byte aligned alloca here, and give the stack
+            // back once the allocation goes out of scope.
+            Value *saved = save_stack();
+            if (saved_stack) *saved_stack = saved;
+            ptr = builder->CreateAlloca(i32x8, ConstantInt::get(i32, chunks));
+        }
         ptr = builder->CreatePointerCast(ptr, llvm_type->getPointerTo());
     } else {
         // call malloc
+        Value *size = codegen(alloc->size * bytes_per_element);
         llvm::Function *malloc_fn = module->getFunction("halide_malloc");
+        assert(malloc_fn && "Could not find halide_malloc in module");
         // Make the return value as noalias
         malloc_fn->setDoesNotAlias(0);
-        assert(malloc_fn && "Could not find halide_malloc in module");
         Value *sz = builder->CreateIntCast(size, malloc_fn->arg_begin()->getType(), false);
         log(4) << "Creating call to halide_malloc\n";
         CallInst *call = builder->CreateCall(malloc_fn, sz);
@@ -191,15 +213,16 @@ void CodeGen_Posix::free_buffer(Value *ptr) {
 }
 
 void CodeGen_Posix::visit(const Allocate *alloc) {
+    bool on_stack;
     Value *saved_stack;
-    Value *ptr = malloc_buffer(alloc, &saved_stack);
+    Value *ptr = malloc_buffer(alloc, &on_stack, &saved_stack);
 
     // In the future, we may want to construct an entire buffer_t here
     string allocation_name = alloc->name + ".host";
     log(3) << "Pushing allocation called " << allocation_name << " onto the symbol table\n";
 
     sym_push(allocation_name, ptr);
-    if (!saved_stack) {
+    if (!on_stack) {
         heap_allocations.push(alloc->name, ptr);
     }
 
@@ -230,6 +253,15 @@ void CodeGen_Posix::visit(const Free *stmt) {
 
 }
 
+void CodeGen_Posix::visit(const For *op) {
+    // The body of a parallel for loop becomes a function of its own,
+    // which isn't inside any loop.
+    int old_loop_depth = loop_depth;
+    loop_depth = (op->for_type == For::Parallel) ? 0 : loop_depth + 1;
+    CodeGen::visit(op);
+    loop_depth = old_loop_depth;
+}
+
 void CodeGen_Posix::prepare_for_early_exit() {
     for (map<string, stack<pair<Value *, int> > >::const_iterator iter = heap_allocations.get_table().begin();
          iter != heap_allocations.get_table().end(); ++iter) {
@@ -51,26 +51,36 @@ protected:
 
     using CodeGen::visit;
 
-    /** Posix implementation of Allocate. Small constant-sized allocations go
-     * on the stack. The rest go on the heap by calling "halide_malloc"
-     * and "halide_free" in the standard library. */
+    /** Posix implementation of Allocate. Small constant-sized
+     * allocations go on the stack. The rest go on the heap by
+     * calling "halide_malloc" and "halide_free" in the standard
+     * library. */
     // @{
     void visit(const Allocate *);        
     void visit(const Free *);
     // @}
 
+    /** Tracks how many loops deep the code being generated is. */
+    void visit(const For *);
+
     /** Direct implementation of Posix allocation logic. The returned
      * `Value` is a pointer to the allocated memory. If you wish to
-     * allow stack allocation, also pass in a pointer to the
-     * llvm::Value you wish to store the saved stack in. If heap
-     * allocation is performed, `*saved_stack` is set to `NULL`;
-     * otherwise, it holds the saved stack pointer for later use with
-     * the `stackrestore` intrinsic. */
-    llvm::Value* malloc_buffer(const Allocate *alloc, llvm::Value **saved_stack = NULL);
+     * allow stack allocation, also pass in pointers to a bool, which
+     * is set to whether the allocation went on the stack, and to a
+     * Value, which is set to the stack pointer to restore (using
+     * restore_stack) once the allocation goes out of scope, or to
+     * NULL if there's nothing to restore. Stack allocations inside a
+     * loop are made once in the entry block of the current function
+     * (which may be the body of a parallel for loop), so that they
+     * don't adjust the stack pointer on every iteration, as long as
+     * the total hoisted this way stays under the stack allocation
+     * threshold. The others are made in place, so that sibling
+     * scopes share stack space. */
+    llvm::Value* malloc_buffer(const Allocate *alloc, bool *on_stack = NULL,
+                               llvm::Value **saved_stack = NULL);
 
     /** Calls `halide_free` in the standard library. You should only
-     * call this if saved_stack was NULL when you allocated this
-     * buffer. */
+     * call this if the buffer was allocated on the heap. */
     void free_buffer(llvm::Value *ptr);
 
     /** Restores the stack pointer to the given value. Call this to
@@ -84,6 +94,14 @@ protected:
     /** The allocations currently in scope */
     Scope<llvm::Value *> heap_allocations;
 
+    /** The number of loops around the code being generated, within
+     * the current function. */
+    int loop_depth;
+
+    /** The bytes of stack allocations already hoisted to the entry
+     * block of each function. */
+    std::map<llvm::Function *, int64_t> hoisted_stack_bytes;
+
     /** Free all heap allocations in scope */
     void prepare_for_early_exit();
 
@@ -0,0 +1,152 @@
+#include "CompileProfiling.h"
+#include "IRVisitor.h"
+#include "IROperator.h"
+#include <set>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+namespace Halide {
+namespace Internal {
+
+using std::string;
+
+int compile_profiling_level() {
+    char *profile = getenv("HL_COMPILE_PROFILE");
+    return profile ? atoi(profile) : 0;
+}
+
+namespace {
+class CountNodes : public IRVisitor {
+public:
+    size_t count;
+    CountNodes() : count(0) {}
+
+private:
+    using IRVisitor::visit;
+
+    // Expressions may be DAGs, and walking every path through one can
+    // take exponential time, so only look inside each node once.
+    std::set<const IRNode *> visited;
+
+#define COUNT_NODE(T)                           \
+    void visit(const T *op) {                   \
+        if (!visited.insert(op).second) return; \
+        count++;                                \
+        IRVisitor::visit(op);                   \
+    }
+
+    COUNT_NODE(IntImm)
+    COUNT_NODE(FloatImm)
+    COUNT_NODE(Cast)
+    COUNT_NODE(Variable)
+    COUNT_NODE(Add)
+    COUNT_NODE(Sub)
+    COUNT_NODE(Mul)
+    COUNT_NODE(Div)
+    COUNT_NODE(Mod)
+    COUNT_NODE(Min)
+    COUNT_NODE(Max)
+    COUNT_NODE(EQ)
+    COUNT_NODE(NE)
+    COUNT_NODE(LT)
+    COUNT_NODE(LE)
+    COUNT_NODE(GT)
+    COUNT_NODE(GE)
+    COUNT_NODE(And)
+    COUNT_NODE(Or)
+    COUNT_NODE(Not)
+    COUNT_NODE(Select)
+    COUNT_NODE(Load)
+    COUNT_NODE(Ramp)
+    COUNT_NODE(Broadcast)
+    COUNT_NODE(Call)
+    COUNT_NODE(Let)
+    COUNT_NODE(LetStmt)
+    COUNT_NODE(PrintStmt)
+    COUNT_NODE(AssertStmt)
+    COUNT_NODE(Pipeline)
+    COUNT_NODE(For)
+    COUNT_NODE(Store)
+    COUNT_NODE(Provide)
+    COUNT_NODE(Allocate)
+    COUNT_NODE(Free)
+    COUNT_NODE(Realize)
+    COUNT_NODE(Block)
+
+#undef COUNT_NODE
+};
+
+double current_time_ms() {
+    timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+}
+
+size_t count_ir_nodes(Stmt s) {
+    CountNodes counter;
+    if (s.defined()) s.accept(&counter);
+    return counter.count;
+}
+
+CompileTimer::CompileTimer(const string &s) : stage(s), enabled(compile_profiling_level() > 0) {
+    if (enabled) {
+        last = current_time_ms();
+    }
+}
+
+void CompileTimer::add_lap(const string &pass, size_t size, const string &units) {
+    double now = current_time_ms();
+    Lap l;
+    l.pass = pass;
+    l.ms = now - last;
+    l.size = size;
+    l.units = units;
+    laps.push_back(l);
+    // Don't charge the next pass for counting the IR
+    last = current_time_ms();
+}
+
+void CompileTimer::lap(const string &pass, Stmt result) {
+    if (!enabled) return;
+    add_lap(pass, count_ir_nodes(result), "IR nodes");
+}
+
+void CompileTimer::lap(const string &pass, size_t llvm_instructions) {
+    if (!enabled) return;
+    add_lap(pass, llvm_instructions, "llvm instructions");
+}
+
+CompileTimer::~CompileTimer() {
+    if (!enabled) return;
+    double total = 0;
+    for (size_t i = 0; i < laps.size(); i++) {
+        total += laps[i].ms;
+    }
+    fprintf(stderr, "Compile profile of %s:\n", stage.c_str());
+    for (size_t i = 0; i < laps.size(); i++) {
+        fprintf(stderr, "    %-36s %10.3f ms %10llu %s\n",
+                (laps[i].pass + ":").c_str(), laps[i].ms,
+                (unsigned long long)laps[i].size, laps[i].units.c_str());
+    }
+    fprintf(stderr, "    %-36s %10.3f ms\n", "total:", total);
+}
+
+void compile_profiling_test() {
+    // A DAG with 2^64 paths through it, but only 65 distinct nodes in
+    // the expression.
+    Expr e = Variable::make(Int(32), "x");
+    for (int i = 0; i < 64; i++) {
+        e = e + e;
+    }
+    Stmt s = Store::make("f", e, 0);
+    size_t count = count_ir_nodes(s);
+    assert(count == 67);
+
+    std::cout << "compile_profiling test passed" << std::endl;
+}
+
+}
+}
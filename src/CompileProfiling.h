@@ -0,0 +1,63 @@
+#ifndef HALIDE_COMPILE_PROFILING_H
+#define HALIDE_COMPILE_PROFILING_H
+
+/** \file
+ * Defines a timer for reporting how long each pass of compilation
+ * takes when compile profiling is turned on
+ */
+
+#include "IR.h"
+#include <string>
+#include <vector>
+
+namespace Halide {
+namespace Internal {
+
+/** Gets the compile profiling level (by reading HL_COMPILE_PROFILE) */
+int compile_profiling_level();
+
+/** Count the distinct IR nodes in a statement. Shared subexpressions
+ * only count once. */
+size_t count_ir_nodes(Stmt s);
+
+/** Times the passes of one stage of compilation (e.g. lowering a
+ * function), if the environment variable HL_COMPILE_PROFILE is
+ * set. Call lap after each pass. Once the timer is destroyed, it
+ * prints the wall-clock time each pass took and the size of the IR
+ * it produced to stderr, followed by the total. Time spent counting
+ * the IR isn't charged to any pass. Does nothing otherwise. */
+class CompileTimer {
+    struct Lap {
+        std::string pass;
+        double ms;
+        size_t size;
+        std::string units;
+    };
+
+    std::string stage;
+    bool enabled;
+    double last;
+    std::vector<Lap> laps;
+
+    void add_lap(const std::string &pass, size_t size, const std::string &units);
+public:
+    CompileTimer(const std::string &stage);
+    ~CompileTimer();
+
+    /** Record the time since the previous lap (or since the timer
+     * was made) as spent in the given pass, which produced the given
+     * statement. */
+    void lap(const std::string &pass, Stmt result);
+
+    /** Record the time since the previous lap as spent in a pass that
+     * works on llvm IR, which left the given number of llvm
+     * instructions. */
+    void lap(const std::string &pass, size_t llvm_instructions);
+};
+
+void compile_profiling_test();
+
+}
+}
+
+#endif
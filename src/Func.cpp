@@ -11,8 +11,12 @@
 #include "Image.h"
 #include "Param.h"
 #include "Log.h"
+#include "ScratchSize.h"
+#include "JITCache.h"
 #include <iostream>
 #include <fstream>
+#include <pthread.h>
+#include <stdlib.h>
 
 namespace Halide {
 
@@ -31,7 +35,11 @@ Func::Func(const string &name) : func(unique_name(name)),
                                  custom_malloc(NULL), 
                                  custom_free(NULL), 
                                  custom_do_par_for(NULL), 
-                                 custom_do_task(NULL) {
+                                 custom_do_task(NULL), 
+                                 num_threads(-1),
+                                 thread_spin_us(-1),
+                                 thread_affinity(-1),
+                                 stack_threshold(-1) {
 }
 
 Func::Func() : func(unique_name('f')), 
@@ -39,7 +47,11 @@ Func::Func() : func(unique_name('f')),
                custom_malloc(NULL), 
                custom_free(NULL), 
                custom_do_par_for(NULL), 
-               custom_do_task(NULL) {
+               custom_do_task(NULL), 
+               num_threads(-1),
+               thread_spin_us(-1),
+               thread_affinity(-1),
+               stack_threshold(-1) {
 }
 
 Func::Func(Expr e) : func(unique_name('f')),
@@ -47,7 +59,11 @@ Func::Func(Expr e) : func(unique_name('f')),
                      custom_malloc(NULL), 
                      custom_free(NULL), 
                      custom_do_par_for(NULL), 
-                     custom_do_task(NULL) {
+                     custom_do_task(NULL), 
+                     num_threads(-1),
+                     thread_spin_us(-1),
+                     thread_affinity(-1),
+                     stack_threshold(-1) {
     (*this)() = e;
 }
 
@@ -57,7 +73,11 @@ Func::Func(Buffer b) : func(unique_name('f')),
                        custom_malloc(NULL), 
                        custom_free(NULL), 
                        custom_do_par_for(NULL), 
-                       custom_do_task(NULL) {
+                       custom_do_task(NULL), 
+                       num_threads(-1),
+                       thread_spin_us(-1),
+                       thread_affinity(-1),
+                       stack_threshold(-1) {
     vector<Expr> args;
     for (int i = 0; i < b.dimensions(); i++) {
         args.push_back(Var::implicit(i));
@@ -193,13 +213,14 @@ bool var_name_match(string candidate, string var) {
 }
 }
 
-void ScheduleHandle::set_dim_type(Var var, For::ForType t) {
+void ScheduleHandle::set_dim_type(Var var, For::ForType t, int grain) {
     bool found = false;
     vector<Schedule::Dim> &dims = schedule.dims;
     for (size_t i = 0; i < dims.size(); i++) {
         if (var_name_match(dims[i].var, var.name())) {
             found = true;
             dims[i].for_type = t;
+            dims[i].grain = grain;
         } else if (t == For::Vectorized) {
             assert(dims[i].for_type != For::Vectorized && 
                    "Can't vectorize across more than one variable");
@@ -289,6 +310,12 @@ ScheduleHandle &ScheduleHandle::parallel(Var var) {
     return *this;
 }
 
+ScheduleHandle &ScheduleHandle::parallel(Var var, int grain) {
+    assert(grain > 0 && "Grain of a parallel loop must be positive");
+    set_dim_type(var, For::Parallel, grain);
+    return *this;
+}
+
 ScheduleHandle &ScheduleHandle::vectorize(Var var) {
     set_dim_type(var, For::Vectorized);
     return *this;
@@ -484,6 +511,11 @@ Func &Func::parallel(Var var) {
     return *this;
 }
 
+Func &Func::parallel(Var var, int grain) {
+    ScheduleHandle(func.schedule()).parallel(var, grain);
+    return *this;
+}
+
 Func &Func::vectorize(Var var) {
     ScheduleHandle(func.schedule()).vectorize(var);
     return *this;
@@ -968,6 +1000,21 @@ void validate_arguments(const vector<Argument> &args, Stmt lowered) {
         }
     }
 }
+
+// llvm can't be relied upon to compile on several threads at once, so
+// every use of it here holds this lock, including compilations
+// running in the background.
+pthread_mutex_t llvm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+class LLVMLock {
+public:
+    LLVMLock() {
+        pthread_mutex_lock(&llvm_mutex);
+    }
+    ~LLVMLock() {
+        pthread_mutex_unlock(&llvm_mutex);
+    }
+};
 };
 
 
@@ -983,7 +1030,9 @@ void Func::compile_to_bitcode(const string &filename, vector<Argument> args, con
     Argument me(name(), true, value().type());
     args.push_back(me);
 
+    LLVMLock lock;
     StmtCompiler cg;
+    cg.set_stack_allocation_threshold(get_stack_threshold());
     cg.compile(lowered, fn_name.empty() ? name() : fn_name, args);
     cg.compile_to_bitcode(filename);
 }
@@ -1000,7 +1049,9 @@ void Func::compile_to_object(const string &filename, vector<Argument> args, cons
     Argument me(name(), true, value().type());
     args.push_back(me);
 
+    LLVMLock lock;
     StmtCompiler cg;
+    cg.set_stack_allocation_threshold(get_stack_threshold());
     cg.compile(lowered, fn_name.empty() ? name() : fn_name, args);
     cg.compile_to_native(filename, false);
 }
@@ -1065,7 +1116,9 @@ void Func::compile_to_assembly(const string &filename, vector<Argument> args, co
     Argument me(name(), true, value().type());
     args.push_back(me);
 
+    LLVMLock lock;
     StmtCompiler cg;
+    cg.set_stack_allocation_threshold(get_stack_threshold());
     cg.compile(lowered, fn_name.empty() ? name() : fn_name, args);
     cg.compile_to_native(filename, true);
 }
@@ -1099,7 +1152,182 @@ void Func::set_custom_do_task(void (*cust_do_task)(void (*)(int, uint8_t *), int
     }
 }
 
-void Func::realize(Buffer dst) {
+void Func::set_thread_pool(ThreadPool pool) {
+    thread_pool = pool;
+    if (compiled_module.set_custom_thread_pool) {
+        compiled_module.set_custom_thread_pool(pool.defined() ? &ThreadPool::runtime_do_par_for : NULL,
+                                               pool.runtime_handle());
+    }
+}
+
+void Func::set_num_threads(int threads) {
+    assert(threads >= 0 && "The number of threads can't be negative");
+    num_threads = threads;
+    apply_thread_pool_settings();
+}
+
+void Func::set_thread_spin_us(int us) {
+    assert(us >= 0 && "The spin time can't be negative");
+    thread_spin_us = us;
+    apply_thread_pool_settings();
+}
+
+void Func::set_thread_affinity(ThreadAffinity mode) {
+    thread_affinity = (int)mode;
+    apply_thread_pool_settings();
+}
+
+void Func::apply_thread_pool_settings() {
+    if (num_threads >= 0 && compiled_module.set_num_threads) {
+        if (compiled_module.set_num_threads(num_threads) < 0) {
+            Internal::log(1) << "Not resizing the thread pool of " << name()
+                             << " while it's running parallel loops\n";
+        }
+    }
+    if (thread_spin_us >= 0 && compiled_module.set_thread_spin_us) {
+        compiled_module.set_thread_spin_us(thread_spin_us);
+    }
+    if (thread_affinity >= 0 && compiled_module.set_thread_affinity) {
+        if (compiled_module.set_thread_affinity(thread_affinity) < 0) {
+            Internal::log(1) << "Not changing the thread affinity of " << name()
+                             << " while it's running parallel loops\n";
+        }
+    }
+}
+
+ThreadPool Func::get_thread_pool() const {
+    return thread_pool;
+}
+
+void Func::set_stack_allocation_threshold(int bytes) {
+    assert(bytes >= 0 && "The stack allocation threshold can't be negative");
+    stack_threshold = bytes;
+}
+
+int Func::get_stack_threshold() const {
+    return stack_threshold >= 0 ? stack_threshold : default_stack_allocation_threshold();
+}
+
+namespace Internal {
+
+namespace {
+// The pool used by asynchronous realizations of Funcs that don't
+// have their own, and by background compilations.
+ThreadPool *default_async_pool = NULL;
+pthread_once_t default_async_pool_once = PTHREAD_ONCE_INIT;
+
+// Lets the queued work finish and joins the workers, so that they
+// aren't still running while the process tears down its statics.
+void destroy_default_async_pool() {
+    delete default_async_pool;
+    default_async_pool = NULL;
+}
+
+void make_default_async_pool() {
+    default_async_pool = new ThreadPool(0);
+    atexit(destroy_default_async_pool);
+}
+
+// Generate code for a lowered pipeline, and jit compile it. Can run
+// on any thread.
+JITCompiledModule compile_lowered(Stmt lowered, const string &name, const vector<Argument> &args,
+                                  int stack_threshold, const string &cache_key) {
+    JITCompiledModule module;
+    {
+        LLVMLock lock;
+        StmtCompiler cg;
+        cg.set_stack_allocation_threshold(stack_threshold);
+        if (!jit_disk_cache_load(cache_key, &cg)) {
+            cg.compile(lowered, name, args);
+            jit_disk_cache_store(cache_key, &cg, name);
+        }
+
+        if (log::debug_level >= 3) {
+            cg.compile_to_native(name + ".s", true);
+            cg.compile_to_bitcode(name + ".bc");
+            ofstream stmt_debug((name + ".stmt").c_str());
+            stmt_debug << lowered;
+        }
+
+        module = cg.compile_to_function_pointers();
+    }
+    jit_cache_add(cache_key, module);
+    return module;
+}
+}
+
+struct AsyncCompileContents {
+    mutable RefCount ref_count;
+
+    // What to compile
+    Stmt lowered;
+    string name;
+    vector<Argument> args;
+    int stack_threshold;
+    string cache_key;
+
+    // What to realize until it's compiled. May be NULL.
+    Func *fallback;
+
+    // The result
+    JITCompiledModule module;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+
+    AsyncCompileContents() : stack_threshold(0), fallback(NULL), done(false) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    bool is_done() {
+        pthread_mutex_lock(&mutex);
+        bool result = done;
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+
+    void wait() {
+        pthread_mutex_lock(&mutex);
+        while (!done) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    ~AsyncCompileContents() {
+        // The worker still needs us until it's done
+        wait();
+        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&cond);
+        delete fallback;
+    }
+
+    // Runs on a worker thread
+    static void run(void *arg) {
+        AsyncCompileContents *c = (AsyncCompileContents *)arg;
+        log(1) << "Compiling " << c->name << " in the background\n";
+        JITCompiledModule module = compile_lowered(c->lowered, c->name, c->args,
+                                                   c->stack_threshold, c->cache_key);
+        // Once done is set, the contents may be destroyed at any time.
+        pthread_mutex_lock(&c->mutex);
+        c->module = module;
+        c->done = true;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+    }
+};
+
+template<>
+EXPORT RefCount &ref_count<AsyncCompileContents>(const AsyncCompileContents *p) {return p->ref_count;}
+
+template<>
+EXPORT void destroy<AsyncCompileContents>(const AsyncCompileContents *p) {delete p;}
+
+}
+
+void Func::prepare_to_realize(Buffer dst) {
     if (!compiled_module.wrapped_function) compile_jit();
 
     assert(compiled_module.wrapped_function);
@@ -1113,6 +1341,9 @@ void Func::realize(Buffer dst) {
     compiled_module.set_custom_allocator(custom_malloc, custom_free);   
     compiled_module.set_custom_do_par_for(custom_do_par_for);
     compiled_module.set_custom_do_task(custom_do_task);
+    compiled_module.set_custom_thread_pool(thread_pool.defined() ? &ThreadPool::runtime_do_par_for : NULL,
+                                           thread_pool.runtime_handle());
+    apply_thread_pool_settings();
 
     // Update the address of the buffer we're realizing into
     arg_values[arg_values.size()-1] = dst.raw_buffer();
@@ -1130,6 +1361,30 @@ void Func::realize(Buffer dst) {
         Internal::log(2) << "Arg " << i << " = " << arg_values[i] << "\n";
         assert(arg_values[i] != NULL && "An argument to a jitted function is null\n");
     }
+}
+
+void Func::realize(Buffer dst) {
+    // Until a background compilation finishes, realize the fallback
+    // instead, if there is one.
+    if (pending_compile.defined() && pending_compile.ptr->fallback && !finish_compile_jit(false)) {
+        Func &fallback = *pending_compile.ptr->fallback;
+        assert(fallback.dimensions() == dimensions() && fallback.value().type() == value().type() &&
+               "The fallback of a Func must have the same dimensionality and type");
+        fallback.error_handler = error_handler;
+        fallback.custom_malloc = custom_malloc;
+        fallback.custom_free = custom_free;
+        fallback.custom_do_par_for = custom_do_par_for;
+        fallback.custom_do_task = custom_do_task;
+        fallback.thread_pool = thread_pool;
+        fallback.num_threads = num_threads;
+        fallback.thread_spin_us = thread_spin_us;
+        fallback.thread_affinity = thread_affinity;
+        Internal::log(2) << "Realizing the fallback of " << name() << " while it compiles\n";
+        fallback.realize(dst);
+        return;
+    }
+
+    prepare_to_realize(dst);
 
     Internal::log(2) << "Calling jitted function\n";
     compiled_module.wrapped_function(&(arg_values[0]));    
@@ -1138,7 +1393,172 @@ void Func::realize(Buffer dst) {
     dst.set_source_module(compiled_module);
 }
 
-void *Func::compile_jit() {
+void Func::realize(Buffer dst, void *scratch, size_t scratch_size) {
+    prepare_to_realize(dst);
+
+    compiled_module.set_scratch_arena(scratch, scratch_size);
+    Internal::log(2) << "Calling jitted function with a scratch arena of " << scratch_size << " bytes\n";
+    compiled_module.wrapped_function(&(arg_values[0]));
+    Internal::log(2) << "Back from jitted function\n";
+    compiled_module.set_scratch_arena(NULL, 0);
+
+    dst.set_source_module(compiled_module);
+}
+
+size_t Func::scratch_size(int x_size, int y_size, int z_size, int w_size) {
+    assert(value().defined() && "Can't compute the scratch size of an undefined function");
+
+    if (!lowered.defined()) {
+        lowered = Halide::Internal::lower(func);
+    }
+
+    int sizes[] = {x_size, y_size, z_size, w_size};
+    vector<int> extents;
+    for (int i = 0; i < dimensions(); i++) {
+        assert(sizes[i] > 0 && "Domain sizes must be positive");
+        extents.push_back(sizes[i]);
+    }
+
+    return Internal::scratch_size(lowered, name(), extents, value().type().bits / 8, get_stack_threshold());
+}
+
+vector<AllocationStats> Func::memory_stats() {
+    vector<AllocationStats> result;
+    if (!compiled_module.memory_stats) return result;
+    for (int i = 0; ; i++) {
+        const char *name;
+        AllocationStats stats;
+        if (compiled_module.memory_stats(i, &name, &stats.current_bytes,
+                                         &stats.peak_bytes, &stats.allocations)) break;
+        // Pipelines compiled without memory tracking never name
+        // anything.
+        if (!name) break;
+        stats.name = name;
+        result.push_back(stats);
+    }
+    return result;
+}
+
+void Func::release_cached_memory() {
+    if (compiled_module.release_cached_memory) {
+        compiled_module.release_cached_memory();
+    }
+}
+
+namespace Internal {
+
+struct AsyncRealizationContents {
+    mutable RefCount ref_count;
+
+    // Hang onto the compiled module and the output buffer until
+    // we're done with them.
+    JITCompiledModule module;
+    Buffer dst;
+
+    // A snapshot of the arguments at the time realize_async was
+    // called.
+    vector<const void *> args;
+
+    void (*callback)(void *);
+    void *user;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+
+    AsyncRealizationContents() : callback(NULL), user(NULL), done(false) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    void wait() {
+        pthread_mutex_lock(&mutex);
+        while (!done) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    ~AsyncRealizationContents() {
+        // The worker still needs us until it's done
+        wait();
+        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&cond);
+    }
+
+    // Runs on a worker thread. Doesn't need a reference of its own,
+    // because the destructor waits for it to finish.
+    static void run(void *arg) {
+        AsyncRealizationContents *c = (AsyncRealizationContents *)arg;
+        log(2) << "Calling jitted function asynchronously\n";
+        c->module.wrapped_function(&(c->args[0]));
+        log(2) << "Back from asynchronous jitted function\n";
+        if (c->callback) {
+            c->callback(c->user);
+        }
+        // Once this is set, the contents may be destroyed at any time.
+        pthread_mutex_lock(&c->mutex);
+        c->done = true;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+    }
+};
+
+template<>
+EXPORT RefCount &ref_count<AsyncRealizationContents>(const AsyncRealizationContents *p) {return p->ref_count;}
+
+template<>
+EXPORT void destroy<AsyncRealizationContents>(const AsyncRealizationContents *p) {delete p;}
+
+}
+
+AsyncRealization::AsyncRealization(AsyncRealizationContents *c) : contents(c) {
+}
+
+bool AsyncRealization::done() const {
+    assert(defined() && "Can't poll an undefined AsyncRealization");
+    pthread_mutex_lock(&contents.ptr->mutex);
+    bool result = contents.ptr->done;
+    pthread_mutex_unlock(&contents.ptr->mutex);
+    return result;
+}
+
+void AsyncRealization::wait() const {
+    assert(defined() && "Can't wait on an undefined AsyncRealization");
+    contents.ptr->wait();
+}
+
+Buffer AsyncRealization::buffer() const {
+    assert(defined() && "Can't get the buffer of an undefined AsyncRealization");
+    return contents.ptr->dst;
+}
+
+AsyncRealization Func::realize_async(Buffer dst, void (*callback)(void *), void *user) {
+    prepare_to_realize(dst);
+
+    AsyncRealizationContents *c = new AsyncRealizationContents;
+    c->module = compiled_module;
+    c->dst = dst;
+    c->args = arg_values;
+    c->callback = callback;
+    c->user = user;
+    AsyncRealization handle(c);
+
+    dst.set_source_module(compiled_module);
+
+    // The default pool lives until exit, so there's no need to hold
+    // a reference to it here.
+    if (thread_pool.defined()) {
+        thread_pool.enqueue(&AsyncRealizationContents::run, c);
+    } else {
+        pthread_once(&default_async_pool_once, make_default_async_pool);
+        default_async_pool->enqueue(&AsyncRealizationContents::run, c);
+    }
+
+    return handle;
+}
+
+vector<Argument> Func::infer_jit_arguments() {
     assert(value().defined() && "Can't realize undefined function");
     
     if (!lowered.defined()) lowered = Halide::Internal::lower(func);
@@ -1159,22 +1579,86 @@ void *Func::compile_jit() {
                          << infer_args.arg_types[i].type << ", " 
                          << infer_args.arg_types[i].is_buffer << "\n";
     }
-    
-    StmtCompiler cg;
-    cg.compile(lowered, name(), infer_args.arg_types);
-    
-    if (log::debug_level >= 3) {
-        cg.compile_to_native(name() + ".s", true);
-        cg.compile_to_bitcode(name() + ".bc");
-        ofstream stmt_debug((name() + ".stmt").c_str());
-        stmt_debug << lowered;
+
+    return infer_args.arg_types;
+}
+
+void *Func::compile_jit() {
+    if (pending_compile.defined()) {
+        finish_compile_jit(true);
+        return compiled_module.function;
     }
+
+    vector<Argument> args = infer_jit_arguments();
     
-    compiled_module = cg.compile_to_function_pointers();    
+    // An identical pipeline may have been compiled before, perhaps
+    // by another Func.
+    string cache_key = Internal::jit_cache_key(lowered, args, get_stack_threshold());
+    if (Internal::jit_cache_lookup(cache_key, &compiled_module)) {
+        Internal::log(1) << "Found " << name() << " in the jit cache\n";
+        return compiled_module.function;
+    }
+
+    compiled_module = compile_lowered(lowered, name(), args, get_stack_threshold(), cache_key);
 
     return compiled_module.function;
 }
 
+void Func::compile_jit_async() {
+    start_compile_jit(NULL);
+}
+
+void Func::compile_jit_async(Func fallback) {
+    // Compile the fallback first, so it's ready to go.
+    fallback.compile_jit();
+    start_compile_jit(&fallback);
+}
+
+void Func::start_compile_jit(const Func *fallback) {
+    if (compiled_module.wrapped_function || pending_compile.defined()) return;
+
+    vector<Argument> args = infer_jit_arguments();
+
+    string cache_key = Internal::jit_cache_key(lowered, args, get_stack_threshold());
+    if (Internal::jit_cache_lookup(cache_key, &compiled_module)) {
+        Internal::log(1) << "Found " << name() << " in the jit cache\n";
+        return;
+    }
+
+    AsyncCompileContents *c = new AsyncCompileContents;
+    c->lowered = lowered;
+    c->name = name();
+    c->args = args;
+    c->stack_threshold = get_stack_threshold();
+    c->cache_key = cache_key;
+    if (fallback) {
+        c->fallback = new Func(*fallback);
+    }
+    pending_compile = c;
+
+    pthread_once(&default_async_pool_once, make_default_async_pool);
+    default_async_pool->enqueue(&AsyncCompileContents::run, c);
+}
+
+bool Func::finish_compile_jit(bool wait) {
+    AsyncCompileContents *c = pending_compile.ptr;
+    if (wait) {
+        c->wait();
+    } else if (!c->is_done()) {
+        return false;
+    }
+    compiled_module = c->module;
+    pending_compile = IntrusivePtr<AsyncCompileContents>();
+    return true;
+}
+
+bool Func::is_jit_compiled() {
+    if (pending_compile.defined()) {
+        return finish_compile_jit(false);
+    }
+    return compiled_module.wrapped_function != NULL;
+}
+
 void Func::test() {
 
     Image<int> input(7, 5);
@@ -15,6 +15,7 @@
 #include "RDom.h"
 #include "JITCompiledModule.h"
 #include "Image.h"
+#include "ThreadPool.h"
 #include "Util.h"
 
 namespace Halide {
@@ -132,7 +133,7 @@ public:
 /** A wrapper around a schedule used for common schedule manipulations */
 class ScheduleHandle {
     Internal::Schedule &schedule;
-    void set_dim_type(Var var, Internal::For::ForType t);
+    void set_dim_type(Var var, Internal::For::ForType t, int grain = 1);
     void dump_argument_list();
 public:
     ScheduleHandle(Internal::Schedule &s) : schedule(s) {}
@@ -147,6 +148,18 @@ public:
     /** Mark a dimension to be traversed in parallel */
     EXPORT ScheduleHandle &parallel(Var var);
 
+    /** Mark a dimension to be traversed in parallel, with each
+     * worker thread claiming the given number of consecutive
+     * iterations at a time and running them back-to-back. Use this
+     * when the individual iterations are too cheap to be worth
+     * scheduling one at a time, e.g. a parallel loop over the rows
+     * of a small image. If you supply your own halide_do_par_for
+     * (see \ref Func::set_custom_do_par_for), loops with a grain
+     * larger than one call halide_do_par_for_chunked instead. The
+     * default version of that calls a custom do_par_for if one is
+     * set, ignoring the grain. */
+    EXPORT ScheduleHandle &parallel(Var var, int grain);
+
     /** Mark a dimension to be computed all-at-once as a single
      * vector. The dimension should have constant extent -
      * e.g. because it is the inner dimension following a split by a
@@ -263,6 +276,66 @@ public:
 
 };
 
+namespace Internal {
+struct AsyncRealizationContents;
+struct AsyncCompileContents;
+}
+
+/** A handle on a realization running in the background, as returned
+ * by \ref Func::realize_async. Copies of the handle refer to the same
+ * realization. If the last copy goes away before the realization
+ * finishes, its destructor waits for it. */
+class AsyncRealization {
+    Internal::IntrusivePtr<Internal::AsyncRealizationContents> contents;
+public:
+    AsyncRealization() {}
+    EXPORT AsyncRealization(Internal::AsyncRealizationContents *c);
+
+    /** Is this handle pointing at an actual realization */
+    bool defined() const {
+        return contents.defined();
+    }
+
+    /** Has the realization (and its callback, if any) finished. Never
+     * blocks. */
+    EXPORT bool done() const;
+
+    /** Block until the realization (and its callback, if any) has
+     * finished. */
+    EXPORT void wait() const;
+
+    /** The buffer being realized into. Don't look inside it until the
+     * realization is done. */
+    EXPORT Buffer buffer() const;
+};
+
+/** Where the worker threads of the thread pool maintained by the
+ * halide runtime run. See \ref Func::set_thread_affinity */
+enum ThreadAffinity {
+    /** Let the operating system move them around freely */
+    NoAffinity = 0,
+    /** Pin each worker to its own cpu, filling up one NUMA node
+     * before moving on to the next */
+    CompactAffinity = 1,
+    /** Pin each worker to its own cpu, dealing them out round-robin
+     * across the NUMA nodes */
+    ScatterAffinity = 2
+};
+
+/** The memory used by one of the buffers a pipeline allocates, or
+ * by the pipeline as a whole, as returned by \ref Func::memory_stats */
+struct AllocationStats {
+    /** The name of the allocation, or of the pipeline */
+    std::string name;
+    /** The bytes still allocated. Zero once a realization completes,
+     * unless it bailed out early. */
+    int64_t current_bytes;
+    /** The most bytes allocated at once */
+    int64_t peak_bytes;
+    /** How many times the buffer was allocated */
+    int64_t allocations;
+};
+
 /** A halide function. This class represents one stage in a Halide
  * pipeline, and is the unit by which we schedule things. By default
  * they are aggressively inlined, so you are encouraged to make lots
@@ -291,6 +364,25 @@ class Func {
      * we don't have to rejit every time we want to evaluated it. */
     Internal::JITCompiledModule compiled_module;
 
+    /** A compilation of this function running in the background,
+     * as started by compile_jit_async. Undefined if there isn't
+     * one. Once it finishes, its module becomes compiled_module. */
+    Internal::IntrusivePtr<Internal::AsyncCompileContents> pending_compile;
+
+    /** Take the module from the pending background compilation, if
+     * it has finished. If wait is true, block until it has. Returns
+     * whether it had finished. */
+    bool finish_compile_jit(bool wait);
+
+    /** Start compiling in the background, unless it's compiled
+     * already or being compiled. The fallback may be NULL. */
+    void start_compile_jit(const Func *fallback);
+
+    /** Lower this function if necessary, and work out the arguments
+     * of the compiled pipeline. Sets up arg_values and
+     * image_param_args to match. */
+    std::vector<Argument> infer_jit_arguments();
+
     /** The current error handler used for realizing this
      * function. May be NULL. Only relevant when jitting. */
     void (*error_handler)(char *);
@@ -309,6 +401,29 @@ class Func {
     void (*custom_do_task)(void (*)(int, uint8_t *), int, uint8_t *);
     // @}
 
+    /** The thread pool that parallel loops run on when realizing
+     * this function. Undefined means the runtime's own pool. */
+    ThreadPool thread_pool;
+
+    /** Settings for the runtime's own thread pool. Negative means
+     * leave the runtime's setting alone. */
+    // @{
+    int num_threads;
+    int thread_spin_us;
+    int thread_affinity;
+    // @}
+
+    /** Constant-sized allocations smaller than this many bytes go on
+     * the stack. Negative means use the default. */
+    int stack_threshold;
+
+    /** The stack threshold actually in effect */
+    int get_stack_threshold() const;
+
+    /** Pass the settings for the runtime's thread pool on to the
+     * compiled module, if there is one. */
+    void apply_thread_pool_settings();
+
     /** Pointers to current values of the automatically inferred
      * arguments (buffers and scalars) used to realize this
      * function. Only relevant when jitting. We can hold these things
@@ -322,6 +437,11 @@ class Func {
      * still be valid though. */
     std::vector<std::pair<int, Internal::Parameter> > image_param_args;
 
+    /** Compile if necessary, and point the compiled module at the
+     * current handlers and arguments in preparation for realizing
+     * into the given buffer. */
+    void prepare_to_realize(Buffer dst);
+
 public:        
     static void test();
 
@@ -369,6 +489,63 @@ public:
      * safe to run in-place. */
     EXPORT void realize(Buffer dst);
 
+    /** Evaluate this function into an existing allocated buffer,
+     * placing the intermediate buffers it allocates in a
+     * caller-provided scratch arena instead of on the heap. The arena
+     * is reset when the realization completes, so the same memory
+     * may be reused for every call. If the arena is too small, the
+     * remaining allocations fall back to the heap. Use \ref
+     * Func::scratch_size to find out how much memory to provide. The
+     * arena belongs to the compiled module, so don't run other
+     * realizations of this Func concurrently with this one. */
+    EXPORT void realize(Buffer dst, void *scratch, size_t scratch_size);
+
+    /** Compute how many bytes of scratch memory realizing this
+     * function over a domain of the given size needs at peak, given
+     * the buffers and values currently bound to its ImageParams and
+     * Params. Allocations small enough to go on the stack aren't
+     * counted. Parallel loops are assumed to run all of their
+     * iterations at once, so this can be a generous bound for
+     * parallel schedules. */
+    EXPORT size_t scratch_size(int x_size = 0, int y_size = 0, int z_size = 0, int w_size = 0);
+
+    /** Get the memory used by the most recent realization of this
+     * function. Only available if it was compiled with the
+     * environment variable HL_TRACK_MEMORY set, or with tracing on;
+     * otherwise the result is empty. The first entry covers the
+     * whole pipeline, and the rest each of the buffers it allocates
+     * (including those small enough to go on the stack). Buffers that
+     * share memory are counted under the name of the one that owns
+     * it. Allocations made by parallel tasks are all counted, so the
+     * peak depends on how many of them ran at once. */
+    EXPORT std::vector<AllocationStats> memory_stats();
+
+    /** The default allocator of a jit-compiled function keeps the
+     * blocks it frees around for reuse, up to 32 MB in total. Call
+     * this to hand them back to the system, e.g. once a burst of
+     * realizations is over. They are also released when the compiled
+     * function is destroyed. Does nothing if the function hasn't been
+     * compiled. */
+    EXPORT void release_cached_memory();
+
+    /** Evaluate this function into an existing allocated buffer in
+     * the background, and return immediately. The realization runs on
+     * the thread pool set with \ref Func::set_thread_pool, or on a
+     * pool shared by all asynchronous realizations if there isn't
+     * one. If a callback is given, a worker thread calls it with the
+     * user pointer once the realization is complete. Compilation (if
+     * needed) happens before this returns.
+     *
+     * The handlers and inputs in effect at the time of the call are
+     * the ones used, but changing the values of Params or the images
+     * bound to ImageParams used by this function while the
+     * realization is running is not safe. Neither is setting a
+     * different custom allocator, error handler, do_par_for, or
+     * thread pool on this Func, because those are shared with the
+     * compiled module. Several realizations, of this Func or of others,
+     * may be in flight at once. */
+    EXPORT AsyncRealization realize_async(Buffer dst, void (*callback)(void *) = NULL, void *user = NULL);
+
     /** Statically compile this function to llvm bitcode, with the
      * given filename (which should probably end in .bc), type
      * signature, and C function name (which defaults to the same name
@@ -421,9 +598,48 @@ public:
      * running your halide pipeline inside time-sensitive code and
      * wish to avoid including the time taken to compile a pipeline,
      * then you can call this ahead of time. Returns the raw function
-     * pointer to the compiled pipeline. */
+     * pointer to the compiled pipeline.
+     *
+     * If the environment variable HL_JIT_CACHE_SIZE is set to a
+     * positive number, up to that many compiled pipelines are kept
+     * in a process-wide cache, so a pipeline built and scheduled the
+     * same way as one compiled earlier, even by a different Func
+     * object, reuses its machine code. Funcs that share a module
+     * also share its runtime state (custom allocator, error handler,
+     * thread pool, and so on), so don't turn the cache on if
+     * identical Funcs with different handlers are realized at the
+     * same time.
+     *
+     * If the environment variable HL_JIT_CACHE_DIR is set, optimized
+     * llvm modules are also stored in that directory, and later
+     * processes that compile the same pipeline for the same target
+     * load them from there instead of optimizing the pipeline
+     * again. Clear the directory when upgrading Halide. */
     EXPORT void *compile_jit();
 
+    /** Start jit compiling the function on a background thread, and
+     * return without waiting for it. Lowering happens before this
+     * returns, and so does looking in the process-wide cache; only
+     * generating code is left to the background. Until the
+     * compilation finishes, calls to realize wait for it, or realize
+     * the fallback instead if one is given. The fallback should be a
+     * cheap variant of this function (e.g. another Func with the same
+     * definition and a simple schedule) with the same type and
+     * dimensionality, and is compiled before this returns if it
+     * wasn't already. Realizations with a scratch arena, or via
+     * realize_async, always wait. Only one pipeline is compiled at a
+     * time, in the foreground or background, so jit compiling another
+     * function in the meantime may wait too. */
+    // @{
+    EXPORT void compile_jit_async();
+    EXPORT void compile_jit_async(Func fallback);
+    // @}
+
+    /** Check whether the function has been jit compiled, i.e. whether
+     * realizing it will use its own compiled code without waiting for
+     * a compilation. Never blocks. */
+    EXPORT bool is_jit_compiled();
+
     /** Set the error handler function that be called in the case of
      * runtime errors during halide pipelines. If you are compiling
      * statically, you can also just define your own function with
@@ -484,6 +700,55 @@ public:
      */
     EXPORT void set_custom_do_par_for(void (*custom_do_par_for)(void (*)(int, uint8_t *), int, int, uint8_t *));
 
+    /** Run the parallel loops of this function on the given thread
+     * pool instead of the one maintained by the halide runtime. Use
+     * this to keep pipelines with different latency requirements
+     * from competing for the same worker threads. Pass an undefined
+     * ThreadPool to go back to the runtime's pool. A custom
+     * do_par_for (see \ref Func::set_custom_do_par_for) takes
+     * precedence over this. Only relevant when jitting. */
+    EXPORT void set_thread_pool(ThreadPool pool);
+
+    /** Set the number of threads in the thread pool the halide
+     * runtime maintains for this function, counting the thread that
+     * calls realize. Zero means the default, which is the value of
+     * the environment variable HL_NUMTHREADS, or else one thread per
+     * cpu the process may run on. The pool can't be resized while
+     * realizations of this function are running (e.g. via
+     * realize_async), so in that case it's put off until the next
+     * realization that starts while none are. Only relevant when
+     * jitting. */
+    EXPORT void set_num_threads(int threads);
+
+    /** Set how long in microseconds the idle threads of the runtime's
+     * thread pool spin waiting for more work before going to
+     * sleep. Spinning makes back-to-back parallel loops start faster,
+     * at the cost of burning cpu. Zero means sleep right away. The
+     * default is 50, or the value of the environment variable
+     * HL_SPIN_US. Only relevant when jitting. */
+    EXPORT void set_thread_spin_us(int us);
+
+    /** Set where the worker threads of the runtime's thread pool
+     * run. The default is NoAffinity, or the value of the environment
+     * variable HL_AFFINITY (none, compact, or scatter). Like \ref
+     * Func::set_num_threads, this restarts the pool, so it's put off
+     * while realizations are running. Pinning is only done on
+     * linux. Only relevant when jitting. */
+    EXPORT void set_thread_affinity(ThreadAffinity mode);
+
+    /** Place intermediate buffers with a constant size of less than
+     * this many bytes on the stack, and larger ones on the heap. The
+     * default is 32k, or the value of the environment variable
+     * HL_STACK_THRESHOLD. Raise it for pipelines with large tiles
+     * that run on threads with big stacks, as stack allocation is
+     * nearly free. Zero puts everything on the heap. Takes effect
+     * the next time the function is compiled. */
+    EXPORT void set_stack_allocation_threshold(int bytes);
+
+    /** Get the thread pool set with \ref Func::set_thread_pool. May
+     * be undefined. */
+    EXPORT ThreadPool get_thread_pool() const;
+
     /** When this function is compiled, include code that dumps its values
      * to a file after it is realized, for the purpose of debugging. 
      * The file covers the realized extent at the point in the schedule that
@@ -558,6 +823,7 @@ public:
     // @{
     EXPORT Func &split(Var old, Var outer, Var inner, Expr factor);
     EXPORT Func &parallel(Var var);
+    EXPORT Func &parallel(Var var, int grain);
     EXPORT Func &vectorize(Var var);
     EXPORT Func &unroll(Var var);
     EXPORT Func &vectorize(Var var, int factor);
@@ -98,7 +98,7 @@ void Function::define(const vector<string> &args, Expr value) {
     contents.ptr->args = args;
         
     for (size_t i = 0; i < args.size(); i++) {
-        Schedule::Dim d = {args[i], For::Serial};
+        Schedule::Dim d = {args[i], For::Serial, 1};
         contents.ptr->schedule.dims.push_back(d);
         contents.ptr->schedule.storage_dims.push_back(args[i]);
     }        
@@ -169,13 +169,13 @@ void Function::define_reduction(const vector<Expr> &args, Expr value) {
 
     // First add the pure args in order
     for (size_t i = 0; i < pure_args.size(); i++) {
-        Schedule::Dim d = {pure_args[i], For::Serial};
+        Schedule::Dim d = {pure_args[i], For::Serial, 1};
         contents.ptr->reduction_schedule.dims.push_back(d);
     }
 
     // Then add the reduction domain outside of that
     for (size_t i = 0; i < check.reduction_domain.domain().size(); i++) {
-        Schedule::Dim d = {check.reduction_domain.domain()[i].var, For::Serial};
+        Schedule::Dim d = {check.reduction_domain.domain()[i].var, For::Serial, 1};
         contents.ptr->reduction_schedule.dims.push_back(d);
     }
 }
@@ -0,0 +1,239 @@
+#include "HoistAllocations.h"
+#include "IRVisitor.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "IRPrinter.h"
+#include "Bounds.h"
+#include "Scope.h"
+#include "Simplify.h"
+#include "Log.h"
+#include "IREquality.h"
+#include <iostream>
+
+namespace Halide {
+namespace Internal {
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Does an expression depend only on things that don't change within
+// a loop: no variables defined inside it, and no loads, as the loop
+// might store to the buffer loaded from.
+class IsLoopInvariant : public IRVisitor {
+    using IRVisitor::visit;
+
+    void visit(const Variable *op) {
+        if (inner_names.contains(op->name)) result = false;
+    }
+
+    void visit(const Load *op) {
+        result = false;
+    }
+
+public:
+    const Scope<int> &inner_names;
+    bool result;
+    IsLoopInvariant(const Scope<int> &n) : inner_names(n), result(true) {}
+};
+
+bool is_loop_invariant(Expr e, const Scope<int> &inner_names) {
+    IsLoopInvariant check(inner_names);
+    e.accept(&check);
+    return check.result;
+}
+
+struct HoistedAllocation {
+    string name;
+    Type type;
+    Expr size;
+};
+
+// Find the allocations in the body of a loop that could instead be
+// made just outside it. Doesn't look inside inner loops. Those have
+// already hoisted everything they can.
+class FindHoistableAllocations : public IRVisitor {
+public:
+    vector<HoistedAllocation> result;
+
+    FindHoistableAllocations(const For *loop) {
+        Expr max = loop->min + loop->extent - 1;
+        bounds.push(loop->name, Interval(loop->min, max));
+        inner_names.push(loop->name, 0);
+    }
+
+private:
+    // Bounds of the variables defined inside the loop, in terms of
+    // the variables defined outside it.
+    Scope<Interval> bounds;
+    Scope<int> inner_names;
+
+    using IRVisitor::visit;
+
+    void visit(const For *) {}
+
+    void visit(const LetStmt *op) {
+        // Allocation sizes are scalars, so they can't depend on
+        // vector lets, which we can't bound anyway.
+        Expr unbounded;
+        bounds.push(op->name, op->value.type().is_scalar() ?
+                    bounds_of_expr_in_scope(op->value, bounds) :
+                    Interval(unbounded, unbounded));
+        inner_names.push(op->name, 0);
+        op->body.accept(this);
+        inner_names.pop(op->name);
+        bounds.pop(op->name);
+    }
+
+    void visit(const Allocate *op) {
+        Expr size;
+        if (is_loop_invariant(op->size, inner_names)) {
+            size = op->size;
+        } else {
+            Interval i = bounds_of_expr_in_scope(op->size, bounds);
+            if (i.max.defined() && is_loop_invariant(i.max, inner_names)) {
+                // The loop might have no iterations, in which case
+                // the bound could be negative.
+                size = simplify(Max::make(i.max, 1));
+            }
+        }
+
+        if (size.defined()) {
+            log(3) << "Hoisting allocation of " << op->name << " with size " << size << "\n";
+            HoistedAllocation h = {op->name, op->type, size};
+            result.push_back(h);
+        } else {
+            log(3) << "Can't hoist allocation of " << op->name << "\n";
+        }
+
+        op->body.accept(this);
+    }
+};
+
+// Strip out the given allocations and their frees
+class RemoveAllocations : public IRMutator {
+public:
+    Scope<int> names;
+
+private:
+    using IRMutator::visit;
+
+    void visit(const For *op) {
+        stmt = op;
+    }
+
+    void visit(const Allocate *op) {
+        if (names.contains(op->name)) {
+            stmt = mutate(op->body);
+        } else {
+            IRMutator::visit(op);
+        }
+    }
+
+    void visit(const Free *op) {
+        if (names.contains(op->name)) {
+            stmt = Stmt();
+        } else {
+            stmt = op;
+        }
+    }
+
+    void visit(const Block *op) {
+        Stmt first = mutate(op->first);
+        Stmt rest = op->rest.defined() ? mutate(op->rest) : Stmt();
+        if (!first.defined()) {
+            stmt = rest;
+        } else if (!rest.defined()) {
+            stmt = first;
+        } else if (first.same_as(op->first) && rest.same_as(op->rest)) {
+            stmt = op;
+        } else {
+            stmt = Block::make(first, rest);
+        }
+    }
+};
+
+}
+
+class HoistAllocations : public IRMutator {
+    using IRMutator::visit;
+
+    void visit(const For *op) {
+        IRMutator::visit(op);
+
+        if (op->for_type != For::Serial) return;
+
+        op = stmt.as<For>();
+        assert(op);
+
+        FindHoistableAllocations find(op);
+        op->body.accept(&find);
+        if (find.result.empty()) return;
+
+        RemoveAllocations remove;
+        for (size_t i = 0; i < find.result.size(); i++) {
+            remove.names.push(find.result[i].name, 0);
+        }
+        Stmt body = remove.mutate(op->body);
+
+        stmt = For::make(op->name, op->min, op->extent, op->for_type, body, op->grain);
+        for (size_t i = find.result.size(); i > 0; i--) {
+            const HoistedAllocation &h = find.result[i-1];
+            stmt = Allocate::make(h.name, h.type, h.size, Block::make(stmt, Free::make(h.name)));
+        }
+    }
+};
+
+Stmt hoist_allocations(Stmt s) {
+    return HoistAllocations().mutate(s);
+}
+
+void hoist_allocations_test() {
+    Expr x = Variable::make(Int(32), "x");
+    Expr n = Variable::make(Int(32), "n");
+    Expr i = Variable::make(Int(32), "i");
+    Stmt store = Store::make("f", 3, x);
+
+    // A constant-sized allocation comes out of the loop, with its
+    // free moved to after the loop.
+    Stmt inner = Allocate::make("f", Int(32), 100, Block::make(store, Free::make("f")));
+    Stmt result = hoist_allocations(For::make("x", 0, n, For::Serial, inner));
+    const Allocate *a = result.as<Allocate>();
+    assert(a && a->name == "f" && equal(a->size, 100));
+    const Block *b = a->body.as<Block>();
+    assert(b && b->first.as<For>() && b->rest.as<Free>());
+    assert(b->first.as<For>()->body.same_as(store));
+
+    // Nested serial loops hoist it all the way out.
+    result = hoist_allocations(For::make("y", 0, n, For::Serial,
+                                         For::make("x", 0, n, For::Serial, inner)));
+    a = result.as<Allocate>();
+    assert(a && a->body.as<Block>());
+    const For *loop = a->body.as<Block>()->first.as<For>();
+    assert(loop && loop->name == "y" && loop->body.as<For>());
+
+    // One that depends on the loop variable through a let gets its
+    // largest size.
+    inner = Allocate::make("f", Int(32), i + 1, Block::make(store, Free::make("f")));
+    result = hoist_allocations(For::make("x", 0, 10, For::Serial, LetStmt::make("i", x*2, inner)));
+    a = result.as<Allocate>();
+    assert(a && equal(a->size, 19));
+
+    // One whose size is loaded from memory stays put.
+    Expr load = Load::make(Int(32), "g", 0, Buffer(), Parameter());
+    inner = Allocate::make("f", Int(32), load, Block::make(store, Free::make("f")));
+    result = hoist_allocations(For::make("x", 0, n, For::Serial, inner));
+    assert(result.as<For>());
+
+    // So do allocations inside parallel loops.
+    inner = Allocate::make("f", Int(32), 100, Block::make(store, Free::make("f")));
+    Stmt parallel = For::make("x", 0, n, For::Parallel, inner);
+    result = hoist_allocations(parallel);
+    assert(result.same_as(parallel));
+
+    std::cout << "hoist_allocations test passed" << std::endl;
+}
+
+}
+}
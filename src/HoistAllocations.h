@@ -0,0 +1,27 @@
+#ifndef HALIDE_HOIST_ALLOCATIONS_H
+#define HALIDE_HOIST_ALLOCATIONS_H
+
+/** \file
+ * Defines the lowering pass that moves allocations out of serial
+ * loops so that they're made once instead of once per iteration.
+ */
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Move each allocation inside a serial for loop to just outside it,
+ * when its size doesn't depend on the loop or can be bounded by
+ * something that doesn't. The buffer is then reused across
+ * iterations. Allocations inside parallel loops stay where they are,
+ * as each task needs its own. Expects the Free nodes injected by
+ * inject_early_frees, which are moved to just after the loop. */
+Stmt hoist_allocations(Stmt s);
+
+void hoist_allocations_test();
+
+}
+}
+
+#endif
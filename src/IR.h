@@ -682,20 +682,24 @@ struct Pipeline : public StmtNode<Pipeline> {
  * 16). An 'Unrolled' for loop compiles to a completely unrolled
  * version of the loop. Each iteration becomes its own
  * statement. Again in this case, 'extent' should be a small
- * integer constant. */
+ * integer constant. For a 'Parallel' for loop, 'grain' is the number
+ * of consecutive iterations a worker thread claims at a time. It is
+ * ignored for the other types of loop. */
 struct For : public StmtNode<For> {
     std::string name;
     Expr min, extent;
     typedef enum {Serial, Parallel, Vectorized, Unrolled} ForType;
     ForType for_type;
     Stmt body;
+    int grain;
 
-    static Stmt make(std::string name, Expr min, Expr extent, ForType for_type, Stmt body) {
+    static Stmt make(std::string name, Expr min, Expr extent, ForType for_type, Stmt body, int grain = 1) {
         assert(min.defined() && "For of undefined");
         assert(extent.defined() && "For of undefined");
         assert(min.type().is_scalar() && "For with vector min");
         assert(extent.type().is_scalar() && "For with vector extent");
         assert(body.defined() && "For of undefined");
+        assert(grain > 0 && "For with non-positive grain");
 
         For *node = new For;
         node->name = name;
@@ -703,6 +707,7 @@ struct For : public StmtNode<For> {
         node->extent = extent;
         node->for_type = for_type;
         node->body = body;
+        node->grain = grain;
         return node;
     }
 };
@@ -1,5 +1,11 @@
 
 #include "IR.h"
+#include "IREquality.h"
+#include "IRVisitor.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include <iostream>
+#include <string.h>
 
 namespace Halide { 
 namespace Internal {
@@ -16,6 +22,28 @@ public:
     IREquals(Stmt s) : result(true), stmt(s) {
     }
 
+    // Compare the corresponding children of the two nodes. Shared
+    // subtrees are equal without looking inside them.
+    void compare_expr(const Expr &theirs, const Expr &mine) {
+        if (!result || theirs.same_as(mine)) return;
+        if (!theirs.defined() || !mine.defined()) {
+            result = false;
+            return;
+        }
+        expr = theirs;
+        mine.accept(this);
+    }
+
+    void compare_stmt(const Stmt &theirs, const Stmt &mine) {
+        if (!result || theirs.same_as(mine)) return;
+        if (!theirs.defined() || !mine.defined()) {
+            result = false;
+            return;
+        }
+        stmt = theirs;
+        mine.accept(this);
+    }
+
     using IRVisitor::visit;
 
     void visit(const IntImm *op) {
@@ -35,8 +63,7 @@ public:
     void visit(const Cast *op) {
         const Cast *e = expr.as<Cast>();
         if (result && e && e->type == op->type) {
-            expr = e->value;
-            op->value.accept(this);
+            compare_expr(e->value, op->value);
         } else {
             result = false;
         }
@@ -53,10 +80,8 @@ public:
     void visit_binary_operator(const T *op) {
         const T *e = expr.as<T>();
         if (result && e) {
-            expr = e->a;
-            op->a.accept(this);
-            expr = e->b;
-            op->b.accept(this);
+            compare_expr(e->a, op->a);
+            compare_expr(e->b, op->b);
         } else {
             result = false;
         }
@@ -81,8 +106,7 @@ public:
     void visit(const Not *op) {
         const Not *e = expr.as<Not>();
         if (result && e) {
-            expr = e->a;
-            op->a.accept(this);
+            compare_expr(e->a, op->a);
         } else {
             result = false;
         }
@@ -91,12 +115,9 @@ public:
     void visit(const Select *op) {
         const Select *e = expr.as<Select>();
         if (result && e) {
-            expr = e->condition;
-            op->condition.accept(this);
-            expr = e->true_value;
-            op->true_value.accept(this);
-            expr = e->false_value;
-            op->false_value.accept(this);
+            compare_expr(e->condition, op->condition);
+            compare_expr(e->true_value, op->true_value);
+            compare_expr(e->false_value, op->false_value);
         } else {
             result = false;
         }            
@@ -105,8 +126,7 @@ public:
     void visit(const Load *op) {
         const Load *e = expr.as<Load>();
         if (result && e && e->type == op->type && e->name == op->name) {
-            expr = e->index;
-            op->index.accept(this);
+            compare_expr(e->index, op->index);
         } else {
             result = false;
         }
@@ -115,10 +135,8 @@ public:
     void visit(const Ramp *op) {
         const Ramp *e = expr.as<Ramp>();
         if (result && e && e->width == op->width) {
-            expr = e->base;
-            op->base.accept(this);
-            expr = e->stride;
-            op->stride.accept(this);
+            compare_expr(e->base, op->base);
+            compare_expr(e->stride, op->stride);
         } else {
             result = false;
         }
@@ -127,8 +145,7 @@ public:
     void visit(const Broadcast *op) {
         const Broadcast *e = expr.as<Broadcast>();
         if (result && e && e->width == op->width) {
-            expr = e->value;
-            op->value.accept(this);
+            compare_expr(e->value, op->value);
         } else {
             result = false;
         }
@@ -142,8 +159,7 @@ public:
             e->call_type == op->call_type &&
             e->args.size() == op->args.size()) {
             for (size_t i = 0; result && (i < e->args.size()); i++) {
-                expr = e->args[i];
-                op->args[i].accept(this);
+                compare_expr(e->args[i], op->args[i]);
             }
         } else {
             result = false;
@@ -153,10 +169,8 @@ public:
     void visit(const Let *op) {
         const Let *e = expr.as<Let>();
         if (result && e && e->name == op->name) {
-            expr = e->value;
-            op->value.accept(this);
-            expr = e->body;
-            op->body.accept(this);
+            compare_expr(e->value, op->value);
+            compare_expr(e->body, op->body);
         } else {
             result = false;
         }
@@ -165,10 +179,8 @@ public:
     void visit(const LetStmt *op) {
         const LetStmt *s = stmt.as<LetStmt>();
         if (result && s && s->name == op->name) {
-            expr = s->value;
-            op->value.accept(this);
-            stmt = s->body;
-            op->body.accept(this);
+            compare_expr(s->value, op->value);
+            compare_stmt(s->body, op->body);
         } else {
             result = false;
         }
@@ -178,8 +190,7 @@ public:
         const PrintStmt *s = stmt.as<PrintStmt>();
         if (result && s && s->prefix == op->prefix) {
             for (size_t i = 0; result && (i < s->args.size()); i++) {
-                expr = s->args[i];
-                op->args[i].accept(this);
+                compare_expr(s->args[i], op->args[i]);
             }                
         } else {
             result = false;
@@ -189,8 +200,7 @@ public:
     void visit(const AssertStmt *op) {
         const AssertStmt *s = stmt.as<AssertStmt>();
         if (result && s && s->message == op->message) {
-            expr = s->condition;
-            op->condition.accept(this);                
+            compare_expr(s->condition, op->condition);                
         } else {
             result = false;
         }
@@ -200,14 +210,11 @@ public:
         const Pipeline *s = stmt.as<Pipeline>();
         if (result && s && s->name == op->name && 
             (s->update.defined() == op->update.defined())) {
-            stmt = s->produce;
-            op->produce.accept(this);
+            compare_stmt(s->produce, op->produce);
             if (s->update.defined()) {
-                stmt = s->update;
-                op->update.accept(this);
+                compare_stmt(s->update, op->update);
             }
-            stmt = s->consume;
-            op->consume.accept(this);
+            compare_stmt(s->consume, op->consume);
         } else {
             result = false;
         }
@@ -215,13 +222,10 @@ public:
 
     void visit(const For *op) {
         const For *s = stmt.as<For>();
-        if (result && s && s->name == op->name && s->for_type == op->for_type) {
-            expr = s->min;
-            op->min.accept(this);
-            expr = s->extent;
-            op->extent.accept(this);
-            stmt = s->body;
-            op->body.accept(this);
+        if (result && s && s->name == op->name && s->for_type == op->for_type && s->grain == op->grain) {
+            compare_expr(s->min, op->min);
+            compare_expr(s->extent, op->extent);
+            compare_stmt(s->body, op->body);
         } else {
             result = false;
         }
@@ -230,10 +234,8 @@ public:
     void visit(const Store *op) {
         const Store *s = stmt.as<Store>();
         if (result && s && s->name == op->name) {
-            expr = s->value;
-            op->value.accept(this);
-            expr = s->index;
-            op->index.accept(this);
+            compare_expr(s->value, op->value);
+            compare_expr(s->index, op->index);
         } else {
             result = false;
         }
@@ -242,11 +244,9 @@ public:
     void visit(const Provide *op) {
         const Provide *s = stmt.as<Provide>();
         if (result && s && s->name == op->name) {
-            expr = s->value;
-            op->value.accept(this);
+            compare_expr(s->value, op->value);
             for (size_t i = 0; result && (i < s->args.size()); i++) {
-                expr = s->args[i];
-                op->args[i].accept(this);
+                compare_expr(s->args[i], op->args[i]);
             }                      
         } else {
             result = false;
@@ -256,8 +256,7 @@ public:
     void visit(const Allocate *op) {
         const Allocate *s = stmt.as<Allocate>();
         if (result && s && s->name == op->name && s->type == op->type) {
-            expr = s->size;
-            op->size.accept(this);
+            compare_expr(s->size, op->size);
         } else {
             result = false;
         }
@@ -268,10 +267,8 @@ public:
         const Realize *s = stmt.as<Realize>();
         if (result && s && s->name == op->name && s->type == op->type) {
             for (size_t i = 0; result && (i < s->bounds.size()); i++) {
-                expr = s->bounds[i].min;
-                op->bounds[i].min.accept(this);
-                expr = s->bounds[i].extent;
-                op->bounds[i].extent.accept(this);
+                compare_expr(s->bounds[i].min, op->bounds[i].min);
+                compare_expr(s->bounds[i].extent, op->bounds[i].extent);
             }                                      
         } else {
             result = false;
@@ -281,11 +278,9 @@ public:
     void visit(const Block *op) {
         const Block *s = stmt.as<Block>();
         if (result && s && (s->rest.defined() == op->rest.defined())) {
-            stmt = s->first;
-            op->first.accept(this);
+            compare_stmt(s->first, op->first);
             if (s->rest.defined()) {
-                stmt = s->rest;
-                op->rest.accept(this);
+                compare_stmt(s->rest, op->rest);
             }
         } else {
             result = false;
@@ -294,7 +289,7 @@ public:
 };
 
 bool equal(Expr a, Expr b) {
-    if (!a.defined() && !b.defined()) return true;
+    if (a.same_as(b)) return true;
     if (!a.defined() || !b.defined()) return false;
     IREquals eq(a);
     b.accept(&eq);
@@ -302,11 +297,250 @@ bool equal(Expr a, Expr b) {
 }
 
 bool equal(Stmt a, Stmt b) {
-    if (!a.defined() && !b.defined()) return true;
+    if (a.same_as(b)) return true;
     if (!a.defined() || !b.defined()) return false;
     IREquals eq(a);
     b.accept(&eq);
     return eq.result;
 }
 
+namespace {
+
+// Fills in the signature of a node whose children are canonical
+class GetSignature : public IRVisitor {
+public:
+    ExprCache::Signature sig;
+
+    GetSignature() {
+        sig.value = 0;
+    }
+
+private:
+    using IRVisitor::visit;
+
+    void child(const Expr &e) {
+        sig.children.push_back(e.ptr);
+    }
+
+    void visit(const IntImm *op) {
+        sig.value = op->value;
+    }
+
+    void visit(const FloatImm *op) {
+        memcpy(&sig.value, &op->value, sizeof(float));
+    }
+
+    void visit(const Cast *op) {
+        child(op->value);
+    }
+
+    void visit(const Variable *op) {
+        sig.name = op->name;
+    }
+
+    template<typename T>
+    void visit_binary_operator(const T *op) {
+        child(op->a);
+        child(op->b);
+    }
+
+    void visit(const Add *op) {visit_binary_operator(op);}
+    void visit(const Sub *op) {visit_binary_operator(op);}
+    void visit(const Mul *op) {visit_binary_operator(op);}
+    void visit(const Div *op) {visit_binary_operator(op);}
+    void visit(const Mod *op) {visit_binary_operator(op);}
+    void visit(const Min *op) {visit_binary_operator(op);}
+    void visit(const Max *op) {visit_binary_operator(op);}
+    void visit(const EQ *op) {visit_binary_operator(op);}
+    void visit(const NE *op) {visit_binary_operator(op);}
+    void visit(const LT *op) {visit_binary_operator(op);}
+    void visit(const LE *op) {visit_binary_operator(op);}
+    void visit(const GT *op) {visit_binary_operator(op);}
+    void visit(const GE *op) {visit_binary_operator(op);}
+    void visit(const And *op) {visit_binary_operator(op);}
+    void visit(const Or *op) {visit_binary_operator(op);}
+
+    void visit(const Not *op) {
+        child(op->a);
+    }
+
+    void visit(const Select *op) {
+        child(op->condition);
+        child(op->true_value);
+        child(op->false_value);
+    }
+
+    void visit(const Load *op) {
+        sig.name = op->name;
+        child(op->index);
+    }
+
+    void visit(const Ramp *op) {
+        sig.value = op->width;
+        child(op->base);
+        child(op->stride);
+    }
+
+    void visit(const Broadcast *op) {
+        sig.value = op->width;
+        child(op->value);
+    }
+
+    void visit(const Call *op) {
+        sig.name = op->name;
+        sig.value = (int)op->call_type;
+        for (size_t i = 0; i < op->args.size(); i++) {
+            child(op->args[i]);
+        }
+    }
+
+    void visit(const Let *op) {
+        sig.name = op->name;
+        child(op->value);
+        child(op->body);
+    }
+};
+
+// Rebuilds a node (if need be) so that its children are canonical
+class CanonicalChildren : public IRMutator {
+    ExprCache *cache;
+public:
+    CanonicalChildren(ExprCache *c) : cache(c) {}
+
+    using IRMutator::mutate;
+
+    Expr mutate(Expr e) {
+        return cache->canonical(e);
+    }
+
+    Expr rebuild(Expr e) {
+        e.accept(this);
+        return expr;
+    }
+};
+
+// Do two nodes with the same signature refer to the same parameters,
+// images, functions, and reduction domains?
+bool same_handles(const Expr &a, const Expr &b) {
+    if (const Variable *va = a.as<Variable>()) {
+        const Variable *vb = b.as<Variable>();
+        return (va->param.same_as(vb->param) &&
+                va->reduction_domain.same_as(vb->reduction_domain));
+    } else if (const Load *la = a.as<Load>()) {
+        const Load *lb = b.as<Load>();
+        return la->image.same_as(lb->image) && la->param.same_as(lb->param);
+    } else if (const Call *ca = a.as<Call>()) {
+        const Call *cb = b.as<Call>();
+        return (ca->func.same_as(cb->func) &&
+                ca->image.same_as(cb->image) &&
+                ca->param.same_as(cb->param));
+    }
+    return true;
+}
+
+size_t hash_signature(const ExprCache::Signature &sig) {
+    // FNV-1a over the fields
+    size_t h = 2166136261u;
+    #define HASH(x) h = (h ^ (size_t)(x)) * 16777619u
+    HASH(sig.node_type);
+    HASH(sig.type.t);
+    HASH(sig.type.bits);
+    HASH(sig.type.width);
+    HASH(sig.value);
+    for (size_t i = 0; i < sig.name.size(); i++) {
+        HASH((unsigned char)sig.name[i]);
+    }
+    for (size_t i = 0; i < sig.children.size(); i++) {
+        HASH(sig.children[i]);
+    }
+    #undef HASH
+    return h;
+}
+
+}
+
+bool ExprCache::Signature::operator==(const Signature &other) const {
+    return (node_type == other.node_type &&
+            type == other.type &&
+            value == other.value &&
+            name == other.name &&
+            children == other.children);
+}
+
+Expr ExprCache::canonical(Expr e) {
+    if (!e.defined()) return e;
+
+    std::map<const IRNode *, Entry>::iterator iter = seen.find(e.ptr);
+    if (iter != seen.end()) return iter->second.canonical;
+
+    Expr rebuilt = CanonicalChildren(this).rebuild(e);
+
+    GetSignature get_sig;
+    get_sig.sig.node_type = rebuilt.ptr->type_info();
+    get_sig.sig.type = rebuilt.type();
+    rebuilt.accept(&get_sig);
+    const Signature &sig = get_sig.sig;
+
+    Entry entry;
+
+    std::vector<std::pair<Signature, Expr> > &bucket = table[hash_signature(sig)];
+    for (size_t i = 0; i < bucket.size(); i++) {
+        if (bucket[i].first == sig && same_handles(bucket[i].second, e)) {
+            entry.canonical = bucket[i].second;
+            break;
+        }
+    }
+    if (!entry.canonical.defined()) {
+        entry.canonical = rebuilt;
+        bucket.push_back(std::make_pair(sig, rebuilt));
+        canonical_count++;
+    }
+
+    entry.original = e;
+    seen[e.ptr] = entry;
+    if (!rebuilt.same_as(e)) {
+        entry.original = rebuilt;
+        seen[rebuilt.ptr] = entry;
+    }
+    return entry.canonical;
+}
+
+void expr_cache_test() {
+    Expr x = Variable::make(Int(32), "x");
+    Expr y = Variable::make(Int(32), "y");
+    Expr z = Variable::make(Int(32), "z");
+
+    ExprCache cache;
+
+    // Equal expressions built separately become the same object, and
+    // so do their subexpressions.
+    Expr a = cache.canonical(x * 2 + max(y, 3));
+    Expr b = cache.canonical(x * 2 + max(y, 3));
+    assert(a.same_as(b));
+    Expr c = cache.canonical(max(y, 3) - x * 2);
+    assert(c.as<Sub>()->a.same_as(a.as<Add>()->b));
+    assert(c.as<Sub>()->b.same_as(a.as<Add>()->a));
+
+    // Unequal ones don't.
+    assert(!cache.canonical(x * 2 + max(z, 3)).same_as(a));
+    assert(!cache.canonical(x * 3 + max(y, 3)).same_as(a));
+    assert(!cache.canonical(Cast::make(Int(16), x)).same_as(cache.canonical(Cast::make(UInt(16), x))));
+    assert(!cache.canonical(Variable::make(Float(32), "x")).same_as(cache.canonical(x)));
+    assert(!cache.canonical(1.5f).same_as(cache.canonical(2.5f)));
+    assert(!cache.canonical(Ramp::make(x, 1, 4)).same_as(cache.canonical(Ramp::make(x, 1, 8))));
+    assert(cache.canonical(Ramp::make(x, 1, 4)).same_as(cache.canonical(Ramp::make(x, 1, 4))));
+
+    // Variables that refer to different parameters aren't equal
+    // either, even with the same name.
+    Parameter p1(Int(32), false), p2(Int(32), false);
+    assert(!cache.canonical(Variable::make(Int(32), "p", p1)).same_as(
+               cache.canonical(Variable::make(Int(32), "p", p2))));
+
+    // Comparing canonical expressions is then a pointer comparison
+    assert(equal(a, b));
+    assert(!equal(a, c));
+
+    std::cout << "expr_cache test passed" << std::endl;
+}
+
 }}
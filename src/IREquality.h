@@ -2,10 +2,13 @@
 #define HALIDE_IR_EQUALITY_H
 
 /** \file
- * Methods to test Exprs and Stmts for equality of value
+ * Methods to test Exprs and Stmts for equality of value, and a table
+ * for hash-consing expressions
  */
 
 #include "IR.h"
+#include <map>
+#include <vector>
 
 namespace Halide { 
 namespace Internal {
@@ -18,6 +21,59 @@ bool equal(Expr a, Expr b);
  * statement tree. For equality of reference, use Stmt::same_as */
 bool equal(Stmt a, Stmt b);
 
+/** A table for hash-consing expressions. It maps each expression to a
+ * canonical one that is equal in value, so that equal subexpressions
+ * seen by the same table become the same object. Equality can then
+ * be tested with Expr::same_as, and canonical expressions can be used
+ * as keys for memoizing work on expressions. The table keeps
+ * everything it has seen alive, so it should be short-lived (e.g. one
+ * per pass). */
+class ExprCache {
+public:
+    /** The shape of a single node: its kind and fields, and the
+     * canonical forms of its children. Nodes with the same signature
+     * are equal if they refer to the same parameters, images, and
+     * functions, too. */
+    struct Signature {
+        const IRNodeType *node_type;
+        Type type;
+        std::string name;
+        // The value of an IntImm, the bits of a FloatImm, the width
+        // of a Ramp or Broadcast, or the call type of a Call.
+        int value;
+        std::vector<const IRNode *> children;
+
+        bool operator==(const Signature &other) const;
+    };
+
+    /** Get the canonical expression equal in value to the given
+     * one. The first expression seen with a given value becomes the
+     * canonical one. */
+    Expr canonical(Expr e);
+
+    /** The number of distinct expressions in the table */
+    size_t size() const {return canonical_count;}
+
+    ExprCache() : canonical_count(0) {}
+
+private:
+    struct Entry {
+        // Keeps the address of the expression from being reused
+        Expr original;
+        Expr canonical;
+    };
+
+    // Every expression seen, by address
+    std::map<const IRNode *, Entry> seen;
+
+    // The canonical expressions, by the hash of their signature
+    std::map<size_t, std::vector<std::pair<Signature, Expr> > > table;
+
+    size_t canonical_count;
+};
+
+void expr_cache_test();
+
 }
 }
 
@@ -173,7 +173,7 @@ void IRMutator::visit(const For *op) {
         body.same_as(op->body)) {
         stmt = op;
     } else {
-        stmt = For::make(op->name, min, extent, op->for_type, body);
+        stmt = For::make(op->name, min, extent, op->for_type, body, op->grain);
     }
 }
 
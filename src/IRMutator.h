@@ -30,10 +30,11 @@ public:
 
     /** This is the main interface for using a mutator. Also call
      * these in your subclass to mutate sub-expressions and
-     * sub-statements.
+     * sub-statements. They're virtual so that a subclass can
+     * intercept every mutation (e.g. to memoize them).
      */
-    Expr mutate(Expr expr);
-    Stmt mutate(Stmt stmt);
+    virtual Expr mutate(Expr expr);
+    virtual Stmt mutate(Stmt stmt);
 
 protected:
 
@@ -385,6 +385,9 @@ void IRPrinter::visit(const For *op) {
     print(op->min);
     stream << ", ";
     print(op->extent);
+    if (op->grain != 1) {
+        stream << ", grain " << op->grain;
+    }
     stream << ") {" << endl;
         
     indent += 2;
@@ -11,16 +11,30 @@
 
 #include <stdlib.h>
 #include <iostream>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 namespace Halide { 
 namespace Internal {
 
-/** A class representing a reference count to be used with IntrusivePtr */
+/** A class representing a reference count to be used with
+ * IntrusivePtr. The count is changed atomically, so that objects
+ * shared between threads (e.g. compiled modules in the jit cache) can
+ * be safely referenced from all of them. */
 class RefCount {
-    int count;
+#ifdef _MSC_VER
+    volatile long count;
+public:
+    RefCount() : count(0) {}
+    void increment() {_InterlockedIncrement(&count);}
+    int decrement() {return (int)_InterlockedDecrement(&count);}
+#else
+    volatile int count;
 public:
     RefCount() : count(0) {}
-    void increment() {count++;}
-    void decrement() {count--;}
+    void increment() {__sync_add_and_fetch(&count, 1);}
+    int decrement() {return __sync_sub_and_fetch(&count, 1);}
+#endif
     bool is_zero() const {return count == 0;}
 };
 
@@ -64,8 +78,9 @@ private:
         
     void decref(T *ptr) {
         if (ptr) {
-            ref_count(ptr).decrement();
-            if (ref_count(ptr).is_zero()) {
+            // Only the thread that takes the count to zero destroys
+            // the object.
+            if (ref_count(ptr).decrement() == 0) {
                 //std::cout << "Destroying " << ptr << ", " << live_objects << "\n";
                 destroy(ptr);
             }
@@ -0,0 +1,519 @@
+#include "JITCache.h"
+#include "IRVisitor.h"
+#include "IROperator.h"
+#include "Log.h"
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// For the version of llvm, which decides how cached bitcode is read back
+#include <llvm/Config/config.h>
+
+namespace Halide {
+namespace Internal {
+
+using std::ifstream;
+using std::map;
+using std::ofstream;
+using std::ostringstream;
+using std::string;
+using std::vector;
+
+namespace {
+
+// Serializes a statement, renaming everything consistently so that
+// the result doesn't depend on the names chosen. A name that refers
+// to an enclosing Let, LetStmt, For, or Allocate is numbered by the
+// order in which names are first bound. Any other name refers to an
+// argument (e.g. "p3.extent.0"), so only its first component is
+// renumbered, and the rest is kept as is.
+class BuildKey : public IRVisitor {
+public:
+    ostringstream key;
+
+    void include(const Expr &e) {
+        if (e.defined()) {
+            e.accept(this);
+        } else {
+            key << '_';
+        }
+    }
+
+    void include(const Stmt &s) {
+        if (s.defined()) {
+            s.accept(this);
+        } else {
+            key << '_';
+        }
+    }
+
+    void include(Type t) {
+        key << (int)t.t << '.' << t.bits << '.' << t.width << ' ';
+    }
+
+    void include_name(const string &name) {
+        map<string, int>::iterator iter = in_scope.find(name);
+        if (iter != in_scope.end() && iter->second > 0) {
+            key << '%' << bound_ids[name] << ' ';
+        } else {
+            size_t dot = name.find('.');
+            string first = name.substr(0, dot);
+            map<string, int>::iterator id = free_ids.find(first);
+            if (id == free_ids.end()) {
+                int next = (int)free_ids.size();
+                id = free_ids.insert(std::make_pair(first, next)).first;
+            }
+            key << '@' << id->second;
+            if (dot != string::npos) key << name.substr(dot);
+            key << ' ';
+        }
+    }
+
+private:
+    using IRVisitor::visit;
+
+    map<string, int> bound_ids, free_ids;
+
+    // How many binders of each name enclose the current node
+    map<string, int> in_scope;
+
+    void bind(const string &name) {
+        if (!bound_ids.count(name)) {
+            int next = (int)bound_ids.size();
+            bound_ids[name] = next;
+        }
+        in_scope[name]++;
+        key << '%' << bound_ids[name] << ' ';
+    }
+
+    void unbind(const string &name) {
+        in_scope[name]--;
+    }
+
+    void visit(const IntImm *op) {
+        key << 'i' << op->value << ' ';
+    }
+
+    void visit(const FloatImm *op) {
+        // Use the exact bits, so that no precision is lost
+        int32_t bits;
+        memcpy(&bits, &op->value, sizeof(bits));
+        key << 'f' << bits << ' ';
+    }
+
+    void visit(const Cast *op) {
+        key << 'c';
+        include(op->type);
+        include(op->value);
+    }
+
+    void visit(const Variable *op) {
+        key << 'v';
+        include(op->type);
+        include_name(op->name);
+    }
+
+    template<typename T>
+    void visit_binary(char tag, const T *op) {
+        key << tag;
+        include(op->type);
+        include(op->a);
+        include(op->b);
+    }
+
+    void visit(const Add *op) {visit_binary('+', op);}
+    void visit(const Sub *op) {visit_binary('-', op);}
+    void visit(const Mul *op) {visit_binary('*', op);}
+    void visit(const Div *op) {visit_binary('/', op);}
+    void visit(const Mod *op) {visit_binary('%', op);}
+    void visit(const Min *op) {visit_binary('m', op);}
+    void visit(const Max *op) {visit_binary('M', op);}
+    void visit(const EQ *op) {visit_binary('=', op);}
+    void visit(const NE *op) {visit_binary('!', op);}
+    void visit(const LT *op) {visit_binary('<', op);}
+    void visit(const LE *op) {visit_binary('l', op);}
+    void visit(const GT *op) {visit_binary('>', op);}
+    void visit(const GE *op) {visit_binary('g', op);}
+    void visit(const And *op) {visit_binary('&', op);}
+    void visit(const Or *op) {visit_binary('|', op);}
+
+    void visit(const Not *op) {
+        key << '~';
+        include(op->a);
+    }
+
+    void visit(const Select *op) {
+        key << '?';
+        include(op->type);
+        include(op->condition);
+        include(op->true_value);
+        include(op->false_value);
+    }
+
+    void visit(const Load *op) {
+        key << 'L';
+        include(op->type);
+        include_name(op->name);
+        key << op->image.defined() << op->param.defined();
+        include(op->index);
+    }
+
+    void visit(const Ramp *op) {
+        key << 'r' << op->width << ' ';
+        include(op->base);
+        include(op->stride);
+    }
+
+    void visit(const Broadcast *op) {
+        key << 'b' << op->width << ' ';
+        include(op->value);
+    }
+
+    void visit(const Call *op) {
+        key << 'C';
+        include(op->type);
+        key << (int)op->call_type << ' ';
+        if (op->call_type == Call::Extern) {
+            // The names of extern functions and intrinsics matter
+            // (and string constants are calls too)
+            key << op->name.size() << ':' << op->name << ' ';
+        } else {
+            include_name(op->name);
+        }
+        key << op->args.size() << ' ';
+        for (size_t i = 0; i < op->args.size(); i++) {
+            include(op->args[i]);
+        }
+    }
+
+    void visit(const Let *op) {
+        key << 'e';
+        include(op->value);
+        bind(op->name);
+        include(op->body);
+        unbind(op->name);
+    }
+
+    void visit(const LetStmt *op) {
+        key << 'E';
+        include(op->value);
+        bind(op->name);
+        include(op->body);
+        unbind(op->name);
+    }
+
+    void visit(const PrintStmt *op) {
+        key << 'P' << op->prefix.size() << ':' << op->prefix << ' ' << op->args.size() << ' ';
+        for (size_t i = 0; i < op->args.size(); i++) {
+            include(op->args[i]);
+        }
+    }
+
+    void visit(const AssertStmt *op) {
+        // The message only matters if the assertion fails
+        key << 'A';
+        include(op->condition);
+    }
+
+    void visit(const Pipeline *op) {
+        key << 'p';
+        include_name(op->name);
+        include(op->produce);
+        include(op->update);
+        include(op->consume);
+    }
+
+    void visit(const For *op) {
+        key << 'F' << (int)op->for_type << ' ' << op->grain << ' ';
+        include(op->min);
+        include(op->extent);
+        bind(op->name);
+        include(op->body);
+        unbind(op->name);
+    }
+
+    void visit(const Store *op) {
+        key << 'S';
+        include_name(op->name);
+        include(op->value);
+        include(op->index);
+    }
+
+    void visit(const Provide *op) {
+        key << 'V';
+        include_name(op->name);
+        include(op->value);
+        key << op->args.size() << ' ';
+        for (size_t i = 0; i < op->args.size(); i++) {
+            include(op->args[i]);
+        }
+    }
+
+    void visit(const Allocate *op) {
+        key << 'a';
+        include(op->type);
+        include(op->size);
+        bind(op->name);
+        include(op->body);
+        unbind(op->name);
+    }
+
+    void visit(const Free *op) {
+        key << 'x';
+        include_name(op->name);
+    }
+
+    void visit(const Realize *op) {
+        key << 'R';
+        include(op->type);
+        key << op->bounds.size() << ' ';
+        for (size_t i = 0; i < op->bounds.size(); i++) {
+            include(op->bounds[i].min);
+            include(op->bounds[i].extent);
+        }
+        bind(op->name);
+        include(op->body);
+        unbind(op->name);
+    }
+
+    void visit(const Block *op) {
+        key << 'B';
+        include(op->first);
+        include(op->rest);
+    }
+};
+
+struct CacheEntry {
+    JITCompiledModule module;
+    // When the entry was last used, according to cache_clock
+    uint64_t last_used;
+};
+
+map<string, CacheEntry> cache;
+uint64_t cache_clock = 0;
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The cache is off unless asked for, because Funcs that share a
+// module also share its runtime state (see JITCache.h).
+int cache_size() {
+    char *size = getenv("HL_JIT_CACHE_SIZE");
+    return size ? atoi(size) : 0;
+}
+
+// Returns the directory to keep compiled pipelines in, creating it if
+// need be, or the empty string if there isn't one.
+string disk_cache_dir() {
+    char *dir = getenv("HL_JIT_CACHE_DIR");
+    if (!dir || !dir[0]) return "";
+    // Fails harmlessly if the directory exists already
+    mkdir(dir, 0755);
+    return string(dir) + "/";
+}
+
+// The name of the files a pipeline is stored under. Keys are long, so
+// they're hashed (using 64-bit FNV-1a), and the full key is stored
+// alongside the module to rule out collisions.
+string disk_cache_name(const string &key) {
+    uint64_t hash = 14695981039346656037ULL;
+    string versioned = key + " | llvm " + PACKAGE_VERSION;
+    for (size_t i = 0; i < versioned.size(); i++) {
+        hash ^= (unsigned char)versioned[i];
+        hash *= 1099511628211ULL;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+    return buf;
+}
+
+// Files are written under a name no other thread or process would
+// use, and then renamed into place, so that nobody can read one that's
+// half-written.
+string temporary_name(const string &filename) {
+    static int counter = 0;
+    ostringstream name;
+    name << filename << ".tmp." << getpid() << "." << __sync_add_and_fetch(&counter, 1);
+    return name.str();
+}
+
+}
+
+string jit_cache_key(Stmt s, const vector<Argument> &args, int stack_threshold) {
+    BuildKey builder;
+    s.accept(&builder);
+    builder.key << "| ";
+    for (size_t i = 0; i < args.size(); i++) {
+        builder.include_name(args[i].name);
+        builder.key << args[i].is_buffer;
+        builder.include(args[i].type);
+    }
+    char *target = getenv("HL_TARGET");
+    builder.key << "| " << (target ? target : "") << " | " << stack_threshold;
+    return builder.key.str();
+}
+
+bool jit_cache_lookup(const string &key, JITCompiledModule *module) {
+    pthread_mutex_lock(&cache_mutex);
+    map<string, CacheEntry>::iterator iter = cache.find(key);
+    bool found = iter != cache.end();
+    if (found) {
+        iter->second.last_used = ++cache_clock;
+        *module = iter->second.module;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return found;
+}
+
+void jit_cache_add(const string &key, const JITCompiledModule &module) {
+    int size = cache_size();
+    if (size <= 0) return;
+
+    // Modules evicted from the cache may take a while to destroy, so
+    // do it after letting go of the lock.
+    vector<JITCompiledModule> evicted;
+
+    pthread_mutex_lock(&cache_mutex);
+    while (cache.size() >= (size_t)size) {
+        map<string, CacheEntry>::iterator oldest = cache.begin();
+        for (map<string, CacheEntry>::iterator iter = cache.begin(); iter != cache.end(); ++iter) {
+            if (iter->second.last_used < oldest->second.last_used) {
+                oldest = iter;
+            }
+        }
+        log(2) << "Evicting a module from the jit cache\n";
+        evicted.push_back(oldest->second.module);
+        cache.erase(oldest);
+    }
+    CacheEntry &entry = cache[key];
+    entry.module = module;
+    entry.last_used = ++cache_clock;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+bool jit_disk_cache_load(const string &key, StmtCompiler *compiler) {
+    string dir = disk_cache_dir();
+    if (dir.empty()) return false;
+
+    string filename = dir + disk_cache_name(key);
+
+    // The first line of the key file is the name of the function in
+    // the module, and the rest is the key.
+    ifstream key_file((filename + ".key").c_str(), std::ios::binary);
+    if (!key_file) return false;
+    string function_name;
+    std::getline(key_file, function_name);
+    ostringstream stored_key;
+    stored_key << key_file.rdbuf();
+    if (stored_key.str() != key) {
+        log(1) << "Ignoring " << filename << ".key, which is for a different pipeline\n";
+        return false;
+    }
+
+    if (!compiler->compile_from_bitcode(filename + ".bc", function_name)) {
+        return false;
+    }
+
+    log(1) << "Loaded a compiled pipeline from " << filename << ".bc\n";
+    return true;
+}
+
+void jit_disk_cache_store(const string &key, StmtCompiler *compiler, const string &function_name) {
+    string dir = disk_cache_dir();
+    if (dir.empty()) return;
+
+    string filename = dir + disk_cache_name(key);
+
+    // Check that we can write to the directory before handing the file
+    // over to llvm.
+    string tmp_bitcode = temporary_name(filename + ".bc");
+    FILE *f = fopen(tmp_bitcode.c_str(), "wb");
+    if (!f) {
+        log(1) << "Could not write to " << dir << ", so not storing the pipeline there\n";
+        return;
+    }
+    fclose(f);
+    compiler->compile_to_bitcode(tmp_bitcode);
+
+    string tmp_key = temporary_name(filename + ".key");
+    {
+        ofstream key_file(tmp_key.c_str(), std::ios::binary);
+        key_file << function_name << "\n" << key;
+    }
+
+    // The key file goes last, so a reader that finds it also finds the
+    // bitcode.
+    if (rename(tmp_bitcode.c_str(), (filename + ".bc").c_str()) ||
+        rename(tmp_key.c_str(), (filename + ".key").c_str())) {
+        log(1) << "Could not store the pipeline in " << filename << ".bc\n";
+        unlink(tmp_bitcode.c_str());
+        unlink(tmp_key.c_str());
+        return;
+    }
+
+    log(1) << "Stored the compiled pipeline in " << filename << ".bc\n";
+}
+
+void jit_cache_test() {
+    // Two copies of the same pipeline that use different names
+    Expr x = Variable::make(Int(32), "x");
+    Expr y = Variable::make(Int(32), "y");
+    Expr out_min = Variable::make(Int(32), "out.min.0");
+    Expr out_extent = Variable::make(Int(32), "out.extent.0");
+    Stmt a = For::make("x", out_min, out_extent, For::Serial,
+                       Store::make("out", x * 2 + 1, x - out_min), 1);
+
+    Expr out2_min = Variable::make(Int(32), "out2.min.0");
+    Expr out2_extent = Variable::make(Int(32), "out2.extent.0");
+    Stmt b = For::make("y", out2_min, out2_extent, For::Serial,
+                       Store::make("out2", y * 2 + 1, y - out2_min), 1);
+
+    vector<Argument> args_a = vec(Argument("out", true, Int(32)));
+    vector<Argument> args_b = vec(Argument("out2", true, Int(32)));
+    string key_a = jit_cache_key(a, args_a, 1024);
+    assert(key_a == jit_cache_key(b, args_b, 1024));
+
+    // Other assertion messages are fine
+    assert(jit_cache_key(Block::make(AssertStmt::make(out_min > 0, "out is bad"), a), args_a, 1024) ==
+           jit_cache_key(Block::make(AssertStmt::make(out2_min > 0, "out2 is bad"), b), args_b, 1024));
+
+    // Different constants, loop types, fields, argument types, and
+    // stack thresholds aren't.
+    Stmt c = For::make("x", out_min, out_extent, For::Serial,
+                       Store::make("out", x * 3 + 1, x - out_min), 1);
+    assert(key_a != jit_cache_key(c, args_a, 1024));
+
+    Stmt d = For::make("x", out_min, out_extent, For::Parallel,
+                       Store::make("out", x * 2 + 1, x - out_min), 1);
+    assert(key_a != jit_cache_key(d, args_a, 1024));
+
+    Stmt e = For::make("x", out_min, out_min + out_extent, For::Serial,
+                       Store::make("out", x * 2 + 1, x - out_min), 1);
+    Stmt f = For::make("x", out_min, out_extent + out_min, For::Serial,
+                       Store::make("out", x * 2 + 1, x - out_min), 1);
+    assert(jit_cache_key(e, args_a, 1024) != jit_cache_key(f, args_a, 1024));
+
+    Stmt g = For::make("x", Variable::make(Int(32), "out.min.1"), out_extent, For::Serial,
+                       Store::make("out", x * 2 + 1, x - out_min), 1);
+    assert(key_a != jit_cache_key(g, args_a, 1024));
+
+    assert(key_a != jit_cache_key(a, vec(Argument("out", true, UInt(32))), 1024));
+    assert(key_a != jit_cache_key(a, args_a, 0));
+
+    // A loop variable that shadows an argument is still told apart
+    // from the argument.
+    Stmt h = For::make("out.min.0", out_min, out_extent, For::Serial,
+                       Store::make("out", out_min * 2 + 1, out_min - out_min), 1);
+    Stmt i = For::make("x", out_min, out_extent, For::Serial,
+                       Store::make("out", x * 2 + 1, out_min - out_min), 1);
+    assert(jit_cache_key(h, args_a, 1024) != jit_cache_key(i, args_a, 1024));
+
+    std::cout << "jit_cache test passed" << std::endl;
+}
+
+}
+}
@@ -0,0 +1,69 @@
+#ifndef HALIDE_JIT_CACHE_H
+#define HALIDE_JIT_CACHE_H
+
+/** \file
+ * Defines a process-wide cache of jit-compiled pipelines, so that
+ * rebuilding a pipeline that was compiled before doesn't compile it
+ * again, and an optional on-disk cache that does the same across
+ * processes.
+ */
+
+#include "IR.h"
+#include "Argument.h"
+#include "JITCompiledModule.h"
+#include "StmtCompiler.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Compute the key of a lowered pipeline in the cache. The key
+ * captures the structure of the statement, the types and order of
+ * the arguments, the target (from HL_TARGET), and the stack
+ * allocation threshold. It does not depend on the names of the
+ * functions, variables, and parameters involved, so two pipelines
+ * built the same way by separate Func objects get the same key. The
+ * messages of assertions are ignored too, which means a module taken
+ * from the cache reports errors using the names of the pipeline it
+ * was first compiled for. */
+std::string jit_cache_key(Stmt s, const std::vector<Argument> &args, int stack_threshold);
+
+/** Look up a compiled module in the cache. Returns false if it's not
+ * there. Thread-safe. */
+bool jit_cache_lookup(const std::string &key, JITCompiledModule *module);
+
+/** Add a compiled module to the cache. The cache holds at most
+ * HL_JIT_CACHE_SIZE modules, and evicts the least recently used one
+ * to make room. It's zero by default, which disables the cache:
+ * Funcs that share a module also share its runtime state (the error
+ * handler, custom allocator, do_par_for, thread pool, scratch arena,
+ * and memory stats), which each realization resets, so identical
+ * Funcs with different handlers can't safely be realized at the same
+ * time. Cached modules are also kept alive (along with their worker
+ * threads and allocator caches) until they're evicted. Thread-safe. */
+void jit_cache_add(const std::string &key, const JITCompiledModule &module);
+
+/** If the environment variable HL_JIT_CACHE_DIR names a directory,
+ * look in it for the optimized llvm module of a pipeline with the
+ * given key, stored there by jit_disk_cache_store (possibly by another
+ * process), and load it into the compiler in place of calling
+ * compile. Returns false if it's not there. Loading the module skips
+ * lowering to llvm and optimizing it, but not generating machine code
+ * from it. */
+bool jit_disk_cache_load(const std::string &key, StmtCompiler *compiler);
+
+/** If the environment variable HL_JIT_CACHE_DIR names a directory
+ * (which gets created if need be), store the module most recently
+ * compiled by the compiler in it under the given key. Call this after
+ * compile and before compile_to_function_pointers. The files are named
+ * by a hash of the key and of the version of llvm. The modules contain
+ * Halide's runtime, so the directory should be cleared when upgrading
+ * Halide. */
+void jit_disk_cache_store(const std::string &key, StmtCompiler *compiler,
+                          const std::string &function_name);
+
+void jit_cache_test();
+
+}
+}
+
+#endif
@@ -3,6 +3,8 @@
 #include "CodeGen.h"
 #include "LLVM_Headers.h"
 #include "Log.h"
+#include "CodeGen_Internal.h"
+#include "CompileProfiling.h"
 
 #include <string>
 
@@ -92,6 +94,8 @@ void JITCompiledModule::compile_module(CodeGen *cg, llvm::Module *m, const strin
 
     // Make the execution engine
     log(2) << "Creating new execution engine\n";
+    CompileTimer timer("jit compilation of " + function_name);
+
     string error_string;
     
     TargetOptions options;
@@ -155,13 +159,43 @@ void JITCompiledModule::compile_module(CodeGen *cg, llvm::Module *m, const strin
     hook_up_function_pointer(ee, m, "halide_set_custom_allocator", true, &set_custom_allocator);
     hook_up_function_pointer(ee, m, "halide_set_custom_do_par_for", true, &set_custom_do_par_for);
     hook_up_function_pointer(ee, m, "halide_set_custom_do_task", true, &set_custom_do_task);
+    hook_up_function_pointer(ee, m, "halide_set_custom_thread_pool", true, &set_custom_thread_pool);
+    hook_up_function_pointer(ee, m, "halide_set_scratch_arena", true, &set_scratch_arena);
     hook_up_function_pointer(ee, m, "halide_shutdown_thread_pool", true, &shutdown_thread_pool);
+    hook_up_function_pointer(ee, m, "halide_set_num_threads", false, &set_num_threads);
+    hook_up_function_pointer(ee, m, "halide_set_spin_us", false, &set_thread_spin_us);
+    hook_up_function_pointer(ee, m, "halide_set_thread_affinity", false, &set_thread_affinity);
+    hook_up_function_pointer(ee, m, "halide_memory_stats", false, &memory_stats);
+    hook_up_function_pointer(ee, m, "halide_release_cached_memory", false, &release_cached_memory);
+
+    void (*profiler_shutdown)() = NULL;
+    hook_up_function_pointer(ee, m, "halide_profiler_shutdown", false, &profiler_shutdown);
+
+    void (*trace_shutdown)() = NULL;
+    hook_up_function_pointer(ee, m, "halide_trace_shutdown", false, &trace_shutdown);
 
     ee->finalizeObject();
+    timer.lap("instruction selection and emission", count_llvm_instructions(m));
 
     // Stash the various objects that need to stay alive behind a reference-counted pointer.
     module = new JITModuleHolder(ee, m, shutdown_thread_pool);
 
+    // Any memory the runtime allocator is holding onto goes away with the module.
+    if (release_cached_memory) {
+        module.ptr->cleanup_routines.push_back(release_cached_memory);
+    }
+
+    // So does the profiler's sampling thread, in case a profiled
+    // pipeline bailed out before stopping it.
+    if (profiler_shutdown) {
+        module.ptr->cleanup_routines.push_back(profiler_shutdown);
+    }
+
+    // Flush and close the binary trace file, if there is one.
+    if (trace_shutdown) {
+        module.ptr->cleanup_routines.push_back(trace_shutdown);
+    }
+
     // Do any target-specific post-compilation module meddling
     cg->jit_finalize(ee, m, &module.ptr->cleanup_routines);
 
@@ -6,6 +6,7 @@
  */
 
 #include "IntrusivePtr.h"
+#include <stdint.h>
 
 namespace llvm {
 class Module;
@@ -60,11 +61,42 @@ struct JITCompiledModule {
      * \ref Func::set_custom_do_task */
     void (*set_custom_do_task)(void (*custom_do_task)(void (*)(int, unsigned char *), int, unsigned char *));
 
+    /** Run parallel loops on a thread pool external to this
+     * module. See \ref Func::set_thread_pool */
+    void (*set_custom_thread_pool)(void (*custom_do_par_for)(void *, void (*)(int, unsigned char *), int, int, int, unsigned char *), void *user);
+
+    /** Hand allocations to a caller-provided scratch arena until it's
+     * set back to NULL. See \ref Func::realize */
+    void (*set_scratch_arena)(void *base, size_t size);
+
+    /** Get the memory used by an allocation during the last run of a
+     * pipeline compiled with memory tracking. Entry zero is the whole
+     * pipeline. Returns nonzero if there's no such entry. See \ref
+     * Func::memory_stats. May be NULL. */
+    int (*memory_stats)(int id, const char **name, int64_t *current, int64_t *peak, int64_t *count);
+
+    /** Hand the freed blocks the runtime allocator is caching back to
+     * the system. This is also done automatically when the last
+     * reference to this module is destroyed. See \ref
+     * Func::release_cached_memory. May be NULL. */
+    void (*release_cached_memory)();
+
     /** Shutdown the thread pool maintained by this JIT module. This
      * is also done automatically when the last reference to this
      * module is destroyed. */
     void (*shutdown_thread_pool)();
 
+    /** Configure the thread pool maintained by this JIT module. See
+     * \ref Func::set_num_threads, \ref Func::set_thread_spin_us, and
+     * \ref Func::set_thread_affinity. Resizing or changing the
+     * affinity returns -1 if parallel loops are running. May be
+     * NULL. */
+    // @{
+    int (*set_num_threads)(int threads);
+    void (*set_thread_spin_us)(int us);
+    int (*set_thread_affinity)(int mode);
+    // @}
+
     // The JIT Module Allocator holds onto the memory storing the functions above.
     IntrusivePtr<JITModuleHolder> module;
 
@@ -78,7 +110,14 @@ struct JITCompiledModule {
         set_custom_allocator(NULL), 
         set_custom_do_par_for(NULL), 
         set_custom_do_task(NULL), 
-        shutdown_thread_pool(NULL) {}
+        set_custom_thread_pool(NULL), 
+        set_scratch_arena(NULL), 
+        memory_stats(NULL),
+        release_cached_memory(NULL),
+        shutdown_thread_pool(NULL),
+        set_num_threads(NULL),
+        set_thread_spin_us(NULL),
+        set_thread_affinity(NULL) {}
                 
     /** Take an llvm module and compile it. Populates the function
      * pointer members above with the result. */
@@ -12,6 +12,9 @@
 #include <sstream>
 #include "RemoveDeadLets.h"
 #include "Tracing.h"
+#include "Profiling.h"
+#include "CompileProfiling.h"
+#include "MemoryTracking.h"
 #include "StorageFlattening.h"
 #include "BoundsInference.h"
 #include "VectorizeLoops.h"
@@ -22,6 +25,9 @@
 #include "Deinterleave.h"
 #include "DebugToFile.h"
 #include "EarlyFree.h"
+#include "HoistAllocations.h"
+#include "ReuseAllocations.h"
+#include "CSE.h"
 
 namespace Halide {
 namespace Internal {
@@ -112,7 +118,7 @@ Stmt build_provide_loop_nest(string buffer, string prefix, vector<Expr> site, Ex
         const Schedule::Dim &dim = s.dims[i];
         Expr min = Variable::make(Int(32), prefix + dim.var + ".min");
         Expr extent = Variable::make(Int(32), prefix + dim.var + ".extent");
-        stmt = For::make(prefix + dim.var, min, extent, dim.for_type, stmt);
+        stmt = For::make(prefix + dim.var, min, extent, dim.for_type, stmt, dim.grain);
     }
 
     // Define the bounds on the split dimensions using the bounds
@@ -371,7 +377,8 @@ private:
                            for_loop->min, 
                            for_loop->extent, 
                            for_loop->for_type, 
-                           body);
+                           body,
+                           for_loop->grain);
         }
     }
     
@@ -736,6 +743,8 @@ Stmt add_image_checks(Stmt s, Function f) {
 }
 
 Stmt lower(Function f) {
+    CompileTimer timer("lowering " + f.name());
+
     // Compute an environment
     map<string, Function> env;
     populate_environment(f, env);
@@ -744,74 +753,119 @@ Stmt lower(Function f) {
     map<string, set<string> > graph;
     vector<string> order = realization_order(f.name(), env, graph);
     Stmt s = create_initial_loop_nest(f);
+    timer.lap("initial loop nest", s);
 
     log(2) << "Initial statement: " << '\n' << s << '\n';
     s = schedule_functions(s, order, env, graph);
+    timer.lap("schedule functions", s);
     log(2) << "All realizations injected:\n" << s << '\n';
 
     log(1) << "Injecting tracing...\n";
-    s = inject_tracing(s);
+    s = inject_tracing(s, f.name());
+    timer.lap("inject tracing", s);
     log(2) << "Tracing injected:\n" << s << '\n';
 
     log(1) << "Adding checks for images\n";
     s = add_image_checks(s, f);    
+    timer.lap("add image checks", s);
     log(2) << "Image checks injected:\n" << s << '\n';
 
     log(1) << "Performing bounds inference...\n";
     s = bounds_inference(s, order, env);
+    timer.lap("bounds inference", s);
     log(2) << "Bounds inference:\n" << s << '\n';
 
     log(1) << "Performing sliding window optimization...\n";
     s = sliding_window(s, env);
+    timer.lap("sliding window", s);
     log(2) << "Sliding window:\n" << s << '\n';
 
     log(1) << "Simplifying...\n";
     s = simplify(s);
+    timer.lap("simplify", s);
     log(2) << "Simplified: \n" << s << "\n\n";
 
     log(1) << "Performing storage folding optimization...\n";
     s = storage_folding(s);
+    timer.lap("storage folding", s);
     log(2) << "Storage folding:\n" << s << '\n';
 
     log(1) << "Injecting debug_to_file calls...\n";
     s = debug_to_file(s, env);
+    timer.lap("debug to file", s);
     log(2) << "Injected debug_to_file calls:\n" << s << '\n';
 
     log(1) << "Performing storage flattening...\n";
     s = storage_flattening(s, env);
+    timer.lap("storage flattening", s);
     log(2) << "Storage flattening: " << '\n' << s << "\n\n";
 
     log(1) << "Simplifying...\n";
     s = simplify(s);
+    timer.lap("simplify", s);
     log(2) << "Simplified: \n" << s << "\n\n";
 
     log(1) << "Vectorizing...\n";
     s = vectorize_loops(s);
+    timer.lap("vectorize loops", s);
     log(2) << "Vectorized: \n" << s << "\n\n";
 
     log(1) << "Unrolling...\n";
     s = unroll_loops(s);
+    timer.lap("unroll loops", s);
     log(2) << "Unrolled: \n" << s << "\n\n";
 
     log(1) << "Simplifying...\n";
     s = simplify(s);
+    timer.lap("simplify", s);
     log(2) << "Simplified: \n" << s << "\n\n";
 
     log(1) << "Detecting vector interleavings...\n";
     s = rewrite_interleavings(s);
+    timer.lap("rewrite interleavings", s);
     log(2) << "Rewrote vector interleavings: \n" << s << "\n\n";
 
     log(1) << "Injecting early frees...\n";
     s = inject_early_frees(s);
+    timer.lap("inject early frees", s);
     log(2) << "Injected early frees: \n" << s << "\n\n";
 
+    // Memory tracking and profiling report by the names of the
+    // allocations and pipelines, so they go in before allocations are
+    // hoisted or share memory, which renames them.
+    log(1) << "Injecting memory tracking...\n";
+    s = inject_memory_tracking(s, f.name());
+    timer.lap("inject memory tracking", s);
+    log(2) << "Memory tracking injected: \n" << s << "\n\n";
+
+    log(1) << "Injecting profiling...\n";
+    s = inject_profiling(s, f.name());
+    timer.lap("inject profiling", s);
+    log(2) << "Profiling injected: \n" << s << "\n\n";
+
+    log(1) << "Hoisting allocations out of serial loops...\n";
+    s = hoist_allocations(s);
+    timer.lap("hoist allocations", s);
+    log(2) << "Hoisted allocations: \n" << s << "\n\n";
+
+    log(1) << "Sharing memory between allocations...\n";
+    s = reuse_allocations(s);
+    timer.lap("reuse allocations", s);
+    log(2) << "Shared memory between allocations: \n" << s << "\n\n";
+
     log(1) << "Simplifying...\n";
     s = simplify(s);
     s = remove_trivial_for_loops(s);
     s = remove_dead_lets(s);
     s = simplify(s);
+    timer.lap("final simplification", s);
     log(1) << "Simplified: \n" << s << "\n\n";
 
+    log(1) << "Eliminating common subexpressions...\n";
+    s = common_subexpression_elimination(s);
+    timer.lap("common subexpression elimination", s);
+    log(2) << "Common subexpressions eliminated: \n" << s << "\n\n";
+
     return s;
 } 
    
@@ -15,7 +15,8 @@ namespace Internal {
 
 /** Given a halide function with a schedule, create a statement that
  * evaluates it. Automatically pulls in all the functions f depends
- * on */
+ * on. If the environment variable HL_COMPILE_PROFILE is set, prints
+ * the time taken by each lowering pass. */
 Stmt lower(Function f);
 
 void lower_test();
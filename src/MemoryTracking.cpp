@@ -0,0 +1,111 @@
+#include "MemoryTracking.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "Scope.h"
+#include "Tracing.h"
+#include "Log.h"
+#include <map>
+
+namespace Halide {
+namespace Internal {
+
+using std::map;
+using std::string;
+using std::vector;
+
+int memory_tracking_level() {
+    char *track = getenv("HL_TRACK_MEMORY");
+    return track ? atoi(track) : 0;
+}
+
+class InjectMemoryTracking : public IRMutator {
+public:
+    // The names of the allocations, indexed by ID minus one
+    vector<string> names;
+
+private:
+    using IRMutator::visit;
+
+    // An allocation may be made in several places (e.g. for the pure
+    // step and the update of a consumer), which all share the same
+    // ID.
+    map<string, int> ids;
+
+    // The ID and size in bytes of the allocations in scope, so that
+    // their frees can report the same number.
+    Scope<std::pair<int, Expr> > allocations;
+
+    int get_id(const string &name) {
+        map<string, int>::iterator iter = ids.find(name);
+        if (iter != ids.end()) return iter->second;
+        names.push_back(name);
+        int id = (int)names.size();
+        ids[name] = id;
+        return id;
+    }
+
+    void visit(const Allocate *op) {
+        int id = get_id(op->name);
+        Expr bytes = cast(Int(64), op->size) * (op->type.bits / 8);
+        allocations.push(op->name, std::make_pair(id, bytes));
+        Stmt body = mutate(op->body);
+        allocations.pop(op->name);
+
+        Expr call = Call::make(Int(32), "halide_memory_allocate", vec(Expr(id), bytes));
+        body = Block::make(AssertStmt::make(call == 0, "Failed to track an allocation"), body);
+        stmt = Allocate::make(op->name, op->type, op->size, body);
+    }
+
+    void visit(const Free *op) {
+        stmt = op;
+        if (allocations.contains(op->name)) {
+            std::pair<int, Expr> a = allocations.get(op->name);
+            Expr call = Call::make(Int(32), "halide_memory_free", vec(Expr(a.first), a.second));
+            stmt = Block::make(AssertStmt::make(call == 0, "Failed to track a free"), stmt);
+        }
+    }
+};
+
+Stmt inject_memory_tracking(Stmt s, string pipeline_name) {
+    int level = memory_tracking_level();
+    bool tracing = tracing_level() > 0;
+    if (level < 1 && !tracing) return s;
+
+    InjectMemoryTracking tracking;
+    s = tracking.mutate(s);
+
+    int num_allocations = (int)tracking.names.size();
+
+    // Tell the runtime the names of the allocations at the start of
+    // each run. Entry zero is the whole pipeline.
+    Expr start_call = Call::make(Int(32), "halide_memory_tracking_start", vec(Expr(num_allocations)));
+    Stmt start = AssertStmt::make(start_call == 0, "Failed to start tracking memory");
+    for (int i = 0; i <= num_allocations; i++) {
+        string name = i == 0 ? pipeline_name : tracking.names[i-1];
+        Expr name_expr = Call::make(Int(32), name, vector<Expr>());
+        Expr name_call = Call::make(Int(32), "memory allocation name", vec(Expr(i), name_expr));
+        start = Block::make(start, AssertStmt::make(name_call == 0, "Failed to name an allocation"));
+    }
+    s = Block::make(start, s);
+
+    if (level >= 2 || tracing) {
+        // Print the peak bytes and the number of allocations of each
+        Stmt report;
+        for (int i = 0; i <= num_allocations; i++) {
+            Expr peak = Call::make(Int(64), "halide_memory_stat", vec(Expr(i), Expr(1)));
+            Expr count = Call::make(Int(64), "halide_memory_stat", vec(Expr(i), Expr(2)));
+            string prefix = i == 0 ? "Memory use of " + pipeline_name + ", peak bytes and allocations:" :
+                "    " + tracking.names[i-1] + ":";
+            Stmt line = PrintStmt::make(prefix, vec(peak, count));
+            report = report.defined() ? Block::make(report, line) : line;
+        }
+        s = Block::make(s, report);
+    }
+
+    log(2) << "Tracking the memory of " << num_allocations << " allocations\n";
+
+    return s;
+}
+
+}
+}
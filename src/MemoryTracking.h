@@ -0,0 +1,33 @@
+#ifndef HALIDE_MEMORY_TRACKING_H
+#define HALIDE_MEMORY_TRACKING_H
+
+/** \file
+ * Defines the lowering pass that reports each allocation and free to
+ * the runtime, so that it can account for the memory a pipeline uses
+ */
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Take a statement representing a halide pipeline, and (if the
+ * environment variable HL_TRACK_MEMORY is set, or tracing is on)
+ * inject calls that tell the runtime how many bytes each Allocate
+ * node asks for, and when it's freed. The runtime keeps the bytes
+ * currently allocated, the peak bytes allocated, and the number of
+ * allocations, both for each allocation name and for the whole
+ * pipeline. See \ref Func::memory_stats. When tracing, or with
+ * HL_TRACK_MEMORY=2, the pipeline also prints these at the end of
+ * each run. Allocations small enough to go on the stack are counted
+ * too. Should be done after allocations are shared and hoisted, so
+ * that the numbers reflect what's actually allocated. */
+Stmt inject_memory_tracking(Stmt, std::string pipeline_name);
+
+/** Gets the memory tracking level (by reading HL_TRACK_MEMORY) */
+int memory_tracking_level();
+
+}
+}
+
+#endif
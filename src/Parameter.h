@@ -120,6 +120,11 @@ public:
         return contents.defined();
     }
 
+    /** Tests if two handles refer to the same parameter */
+    bool same_as(const Parameter &other) const {
+        return contents.same_as(other.contents);
+    }
+
     /** Get and set constraints for the min, extent, and stride (see
      * ImageParam::set_extent) */
     //@{
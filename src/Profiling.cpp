@@ -0,0 +1,140 @@
+#include "Profiling.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "Log.h"
+#include <map>
+
+namespace Halide {
+namespace Internal {
+
+using std::map;
+using std::string;
+using std::vector;
+
+int profiling_level() {
+    char *profile = getenv("HL_PROFILE");
+    return profile ? atoi(profile) : 0;
+}
+
+namespace {
+Stmt set_current_phase(int phase) {
+    Expr call = Call::make(Int(32), "halide_profiler_set_current", vec(Expr(phase)));
+    return AssertStmt::make(call == 0, "Failed to set the profiler phase");
+}
+}
+
+class InjectProfiling : public IRMutator {
+public:
+    // The names of the phases, indexed by phase number minus one
+    vector<string> phases;
+
+    InjectProfiling() : current_phase(0) {}
+
+private:
+    using IRMutator::visit;
+
+    // The phase the code being mutated belongs to
+    int current_phase;
+
+    // A function may be computed in several places (e.g. once for
+    // its consumer's pure step and once for its update), which all
+    // share the same phases.
+    map<string, int> phase_ids;
+
+    int get_phase(const string &name) {
+        map<string, int>::iterator iter = phase_ids.find(name);
+        if (iter != phase_ids.end()) return iter->second;
+        phases.push_back(name);
+        int id = (int)phases.size();
+        phase_ids[name] = id;
+        return id;
+    }
+
+    void visit(const Pipeline *op) {
+        int old_phase = current_phase;
+
+        current_phase = get_phase(op->name + " produce");
+        Stmt produce = Block::make(set_current_phase(current_phase), mutate(op->produce));
+
+        Stmt update;
+        if (op->update.defined()) {
+            current_phase = get_phase(op->name + " update");
+            update = Block::make(set_current_phase(current_phase), mutate(op->update));
+        }
+
+        current_phase = get_phase(op->name + " consume");
+        Stmt consume = Block::make(set_current_phase(current_phase), mutate(op->consume));
+
+        current_phase = old_phase;
+
+        stmt = Pipeline::make(op->name, produce, update, consume);
+        if (old_phase) {
+            // Once the consumer is done with this function, the
+            // enclosing phase continues.
+            stmt = Block::make(stmt, set_current_phase(old_phase));
+        }
+    }
+
+    void visit(const For *op) {
+        IRMutator::visit(op);
+        if (op->for_type == For::Parallel && current_phase) {
+            // The loop body runs on worker threads, which need to be
+            // told what they're working on, and marked idle again
+            // once they're done. The thread that launched the loop
+            // also works on it, so it needs to be reminded of its own
+            // phase afterwards.
+            op = stmt.as<For>();
+            Stmt body = Block::make(set_current_phase(current_phase),
+                                    Block::make(op->body, set_current_phase(0)));
+            stmt = For::make(op->name, op->min, op->extent, op->for_type, body, op->grain);
+            stmt = Block::make(stmt, set_current_phase(current_phase));
+        }
+    }
+};
+
+Stmt inject_profiling(Stmt s, string pipeline_name) {
+    int level = profiling_level();
+    if (level < 1) return s;
+
+    InjectProfiling profiling;
+    s = profiling.mutate(s);
+
+    int num_phases = (int)profiling.phases.size();
+    if (num_phases == 0) return s;
+
+    // At level 2 the runtime counts hardware events at each change of
+    // phase instead of sampling.
+    bool counting = level >= 2;
+    string start_fn = counting ? "halide_profiler_counters_start" : "halide_profiler_pipeline_start";
+    Expr start_call = Call::make(Int(32), start_fn, vec(Expr(num_phases)));
+    Stmt start = AssertStmt::make(start_call == 0, "Failed to start the profiler");
+    Expr end_call = Call::make(Int(32), "halide_profiler_pipeline_end", vector<Expr>());
+    Stmt end = AssertStmt::make(end_call == 0, "Failed to stop the profiler");
+
+    // Print the time spent in each phase in nanoseconds, and as a
+    // percentage of the total. When counting, follow that with the
+    // hardware events, or -1 for those that couldn't be counted.
+    Expr total = Call::make(Int(64), "halide_profiler_time_ns", vec(Expr(0)));
+    Stmt report = PrintStmt::make("Profile of " + pipeline_name + ", total time (ns):", vec(total));
+    if (counting) {
+        report = Block::make(report, PrintStmt::make("    Columns are time (ns), percentage, cycles, instructions, "
+                                                     "L1 data cache misses, last level cache misses, "
+                                                     "branch misses", vector<Expr>()));
+    }
+    for (int i = 0; i < num_phases; i++) {
+        Expr t = Call::make(Int(64), "halide_profiler_time_ns", vec(Expr(i+1)));
+        Expr percent = (t * 100) / max(total, make_one(Int(64)));
+        vector<Expr> args = vec(t, percent);
+        for (int c = 0; counting && c < 5; c++) {
+            args.push_back(Call::make(Int(64), "halide_profiler_counter", vec(Expr(i+1), Expr(c))));
+        }
+        report = Block::make(report, PrintStmt::make("    " + profiling.phases[i] + ":", args));
+    }
+
+    log(2) << "Injected " << num_phases << " profiled phases\n";
+
+    return Block::make(Block::make(start, s), Block::make(end, report));
+}
+
+}
+}
@@ -0,0 +1,34 @@
+#ifndef HALIDE_PROFILING_H
+#define HALIDE_PROFILING_H
+
+/** \file
+ * Defines the lowering pass that instruments a pipeline for the
+ * sampling profiler when profiling is turned on
+ */
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Take a statement representing a halide pipeline, and (if the
+ * environment variable HL_PROFILE is set) inject calls that tell the
+ * runtime's sampling profiler which produce, update, or consume phase
+ * of which function each thread is in. At the end of each run the
+ * pipeline prints the time spent in each phase (summed over all
+ * threads), and what percentage of the total that was. The sampling
+ * interval is set with HL_PROFILE_SAMPLE_US at runtime. With
+ * HL_PROFILE=2, the runtime instead reads the clock and (on linux)
+ * the hardware event counters at each change of phase, and the report
+ * also gives the cycles, instructions, cache misses, and branch
+ * misses of each phase. Should be done after vectorization and
+ * unrolling, so that only parallel loops remain. */
+Stmt inject_profiling(Stmt, std::string pipeline_name);
+
+/** Gets the profiling level (by reading HL_PROFILE) */
+int profiling_level();
+
+}
+}
+
+#endif
@@ -24,7 +24,7 @@ class RemoveDeadLets : public IRMutator {
         if (min.same_as(op->min) && extent.same_as(op->extent) && body.same_as(op->body)) {
             stmt = op;
         } else {
-            stmt = For::make(op->name, min, extent, op->for_type, body);
+            stmt = For::make(op->name, min, extent, op->for_type, body, op->grain);
         }
     }
 
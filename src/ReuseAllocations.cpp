@@ -0,0 +1,405 @@
+#include "ReuseAllocations.h"
+#include "IRVisitor.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "IRPrinter.h"
+#include "IREquality.h"
+#include "Simplify.h"
+#include "Log.h"
+#include <iostream>
+#include <map>
+#include <set>
+
+namespace Halide {
+namespace Internal {
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace {
+
+struct BufferLifetime {
+    string name;
+    Type type;
+    Expr size;
+    // The first and last steps (see LinearizeLoopLevel) at which the
+    // buffer is used. first_use is -1 if it's never used.
+    int first_use, last_use;
+    // The allocations enclosing this one, innermost last.
+    vector<string> enclosing;
+    // The lets in scope where this allocation is made.
+    set<string> lets;
+};
+
+// Number the statements at one loop level in the order they run, and
+// record when each allocation made at this level is used. Inner loops
+// count as a single step. Their bodies are separate loop levels, and
+// are queued up to be analyzed in turn.
+class LinearizeLoopLevel : public IRVisitor {
+public:
+    vector<BufferLifetime> buffers;
+    vector<Stmt> inner_loop_bodies;
+
+    LinearizeLoopLevel() : step(0), in_loop(false) {}
+
+private:
+    int step;
+    bool in_loop;
+    map<string, int> index;
+    vector<string> open_allocations;
+    vector<string> lets;
+
+    using IRVisitor::visit;
+
+    void use(const string &name) {
+        map<string, int>::iterator iter = index.find(name);
+        if (iter == index.end()) return;
+        BufferLifetime &b = buffers[iter->second];
+        if (b.first_use < 0) b.first_use = step;
+        if (step > b.last_use) b.last_use = step;
+    }
+
+    void visit(const Load *op) {
+        IRVisitor::visit(op);
+        use(op->name);
+    }
+
+    void visit(const Store *op) {
+        IRVisitor::visit(op);
+        use(op->name);
+        if (!in_loop) step++;
+    }
+
+    void visit(const Free *op) {
+        use(op->name);
+        if (!in_loop) step++;
+    }
+
+    void visit(const AssertStmt *op) {
+        IRVisitor::visit(op);
+        if (!in_loop) step++;
+    }
+
+    void visit(const PrintStmt *op) {
+        IRVisitor::visit(op);
+        if (!in_loop) step++;
+    }
+
+    void visit(const For *op) {
+        if (in_loop) {
+            IRVisitor::visit(op);
+        } else {
+            inner_loop_bodies.push_back(op->body);
+            in_loop = true;
+            IRVisitor::visit(op);
+            in_loop = false;
+            step++;
+        }
+    }
+
+    void visit(const LetStmt *op) {
+        op->value.accept(this);
+        if (in_loop) {
+            op->body.accept(this);
+        } else {
+            lets.push_back(op->name);
+            op->body.accept(this);
+            lets.pop_back();
+        }
+    }
+
+    void visit(const Allocate *op) {
+        op->size.accept(this);
+        if (in_loop) {
+            // Belongs to the inner loop level.
+            op->body.accept(this);
+            return;
+        }
+
+        BufferLifetime b;
+        b.name = op->name;
+        b.type = op->type;
+        b.size = op->size;
+        b.first_use = -1;
+        b.last_use = -1;
+        b.enclosing = open_allocations;
+        b.lets.insert(lets.begin(), lets.end());
+        index[op->name] = (int)buffers.size();
+        buffers.push_back(b);
+
+        open_allocations.push_back(op->name);
+        op->body.accept(this);
+        open_allocations.pop_back();
+    }
+};
+
+// Collect the names of all the variables an expression refers to
+class FindVariables : public IRVisitor {
+    using IRVisitor::visit;
+
+    void visit(const Variable *op) {
+        names.insert(op->name);
+    }
+public:
+    set<string> names;
+};
+
+// Rewrite the allocations according to the plan made by
+// plan_reuse.
+class ApplyReuse : public IRMutator {
+public:
+    // Buffers that should use the memory of another.
+    map<string, string> renamed;
+    // New sizes for the allocations others are reusing.
+    map<string, Expr> new_size;
+    // Frees to drop, because the memory lives on in a later buffer.
+    set<string> dropped_frees;
+
+private:
+    using IRMutator::visit;
+
+    string rename(const string &name) {
+        map<string, string>::iterator iter = renamed.find(name);
+        return iter == renamed.end() ? name : iter->second;
+    }
+
+    void visit(const Allocate *op) {
+        Stmt body = mutate(op->body);
+        if (renamed.count(op->name)) {
+            stmt = body;
+        } else if (new_size.count(op->name)) {
+            stmt = Allocate::make(op->name, op->type, new_size[op->name], body);
+        } else if (body.same_as(op->body)) {
+            stmt = op;
+        } else {
+            stmt = Allocate::make(op->name, op->type, op->size, body);
+        }
+    }
+
+    void visit(const Pipeline *op) {
+        // Codegen for some targets (e.g. ptx) finds the buffer by
+        // the name of its pipeline, so rename those too.
+        IRMutator::visit(op);
+        if (renamed.count(op->name)) {
+            const Pipeline *p = stmt.as<Pipeline>();
+            stmt = Pipeline::make(rename(op->name), p->produce, p->update, p->consume);
+        }
+    }
+
+    void visit(const Free *op) {
+        if (dropped_frees.count(op->name)) {
+            stmt = Stmt();
+        } else if (renamed.count(op->name)) {
+            stmt = Free::make(rename(op->name));
+        } else {
+            stmt = op;
+        }
+    }
+
+    void visit(const Load *op) {
+        Expr index = mutate(op->index);
+        if (renamed.count(op->name)) {
+            expr = Load::make(op->type, rename(op->name), index, op->image, op->param);
+        } else if (index.same_as(op->index)) {
+            expr = op;
+        } else {
+            expr = Load::make(op->type, op->name, index, op->image, op->param);
+        }
+    }
+
+    void visit(const Store *op) {
+        Expr value = mutate(op->value);
+        Expr index = mutate(op->index);
+        if (renamed.count(op->name)) {
+            stmt = Store::make(rename(op->name), value, index);
+        } else if (value.same_as(op->value) && index.same_as(op->index)) {
+            stmt = op;
+        } else {
+            stmt = Store::make(op->name, value, index);
+        }
+    }
+
+    void visit(const Block *op) {
+        Stmt first = mutate(op->first);
+        Stmt rest = op->rest.defined() ? mutate(op->rest) : Stmt();
+        if (!first.defined()) {
+            stmt = rest;
+        } else if (!rest.defined()) {
+            stmt = first;
+        } else if (first.same_as(op->first) && rest.same_as(op->rest)) {
+            stmt = op;
+        } else {
+            stmt = Block::make(first, rest);
+        }
+    }
+};
+
+// Greedily assign the buffers at one loop level to the memory of
+// enclosing buffers that are dead by the time they're first used.
+void plan_reuse(vector<BufferLifetime> &buffers, ApplyReuse &apply) {
+    // The buffer whose memory each buffer ends up in
+    map<string, int> slot_of;
+    // For each buffer that owns memory: the last step at which it's
+    // used, and the buffer currently occupying it.
+    map<string, int> slot_last_use;
+    map<string, string> slot_occupant;
+
+    for (size_t i = 0; i < buffers.size(); i++) {
+        BufferLifetime &b = buffers[i];
+
+        FindVariables vars;
+        b.size.accept(&vars);
+
+        string chosen;
+        if (b.first_use >= 0) {
+            for (size_t j = 0; j < b.enclosing.size() && chosen.empty(); j++) {
+                map<string, int>::iterator iter = slot_of.find(b.enclosing[j]);
+                assert(iter != slot_of.end());
+                const BufferLifetime &slot = buffers[iter->second];
+                if (slot.name != b.enclosing[j]) continue;
+
+                // The slot must be dead before we first touch it.
+                if (slot_last_use[slot.name] >= b.first_use) continue;
+
+                // Only share memory between buffers of the same
+                // type, so that the buffer's type (and for device
+                // buffers, its element size) stays correct for
+                // everything stored in it.
+                if (slot.type != b.type) continue;
+
+                // Don't mix stack-sized constant allocations with
+                // dynamic ones.
+                if (is_const(slot.size) != is_const(b.size)) continue;
+
+                // Our size has to be computable where the slot is
+                // allocated.
+                bool ok = true;
+                for (set<string>::iterator v = vars.names.begin(); v != vars.names.end(); ++v) {
+                    if (b.lets.count(*v) && !slot.lets.count(*v)) ok = false;
+                }
+                if (!ok) continue;
+
+                chosen = slot.name;
+            }
+        }
+
+        if (chosen.empty()) {
+            slot_of[b.name] = (int)i;
+            slot_last_use[b.name] = b.last_use;
+            slot_occupant[b.name] = b.name;
+        } else {
+            log(3) << "Buffer " << b.name << " can reuse the memory of " << chosen << "\n";
+            slot_of[b.name] = slot_of[chosen];
+            apply.renamed[b.name] = chosen;
+            apply.dropped_frees.insert(slot_occupant[chosen]);
+            slot_occupant[chosen] = b.name;
+            slot_last_use[chosen] = b.last_use;
+
+            // Grow the slot to fit
+            const BufferLifetime &slot = buffers[slot_of[chosen]];
+            Expr old_size = apply.new_size.count(chosen) ? apply.new_size[chosen] : slot.size;
+            Expr size = b.size;
+            if (!equal(old_size, size)) {
+                size = simplify(Max::make(old_size, size));
+            }
+            apply.new_size[chosen] = size;
+        }
+    }
+}
+
+}
+
+Stmt reuse_allocations(Stmt s) {
+    ApplyReuse apply;
+
+    vector<Stmt> loop_levels;
+    loop_levels.push_back(s);
+    while (!loop_levels.empty()) {
+        Stmt level = loop_levels.back();
+        loop_levels.pop_back();
+
+        LinearizeLoopLevel linearize;
+        level.accept(&linearize);
+        plan_reuse(linearize.buffers, apply);
+        loop_levels.insert(loop_levels.end(),
+                           linearize.inner_loop_bodies.begin(),
+                           linearize.inner_loop_bodies.end());
+    }
+
+    if (apply.renamed.empty()) return s;
+    return apply.mutate(s);
+}
+
+void reuse_allocations_test() {
+    Expr x = Variable::make(Int(32), "x");
+    Expr n = Variable::make(Int(32), "n");
+
+    // f is produced and consumed by g, and then g is consumed by
+    // h. h can go in f's memory.
+    Stmt produce_f = For::make("x", 0, n, For::Serial, Store::make("f", x, x));
+    Expr load_f = Load::make(Int(32), "f", x, Buffer(), Parameter());
+    Stmt produce_g = For::make("x", 0, n, For::Serial, Store::make("g", cast(Int(16), load_f), x));
+    Expr load_g = Load::make(Int(16), "g", x, Buffer(), Parameter());
+    Stmt produce_h = For::make("x", 0, n, For::Serial, Store::make("h", cast(Int(32), load_g), x));
+    Expr load_h = Load::make(Int(32), "h", x, Buffer(), Parameter());
+    Stmt consume_h = For::make("x", 0, n, For::Serial, Store::make("out", load_h, x));
+
+    Stmt s = Pipeline::make("h", produce_h, Stmt(), Block::make(Free::make("g"), Block::make(consume_h, Free::make("h"))));
+    s = Allocate::make("h", Int(32), n, s);
+    s = Block::make(produce_g, Block::make(Free::make("f"), s));
+    s = Allocate::make("g", Int(16), n, s);
+    s = Block::make(produce_f, s);
+    s = Allocate::make("f", Int(32), n, s);
+
+    Stmt result = reuse_allocations(s);
+
+    // f is already big enough for h
+    const Allocate *f = result.as<Allocate>();
+    assert(f && f->name == "f" && equal(f->size, n));
+
+    // g is untouched, h is gone
+    const Block *b = f->body.as<Block>();
+    assert(b);
+    const Allocate *g = b->rest.as<Allocate>();
+    assert(g && g->name == "g");
+    b = g->body.as<Block>();
+    assert(b && b->first.as<For>());
+
+    // The free of f has been dropped, and h's pipeline, loads, and
+    // stores now refer to f.
+    const Pipeline *pipeline_h = b->rest.as<Pipeline>();
+    assert(pipeline_h && pipeline_h->name == "f");
+    const Store *store_h = pipeline_h->produce.as<For>()->body.as<Store>();
+    assert(store_h && store_h->name == "f");
+
+    // Make h larger than f, and it should grow.
+    s = Pipeline::make("h", produce_h, Stmt(), Block::make(Free::make("g"), Block::make(consume_h, Free::make("h"))));
+    s = Allocate::make("h", Int(32), n*4, s);
+    s = Block::make(produce_g, Block::make(Free::make("f"), s));
+    s = Allocate::make("g", Int(16), n, s);
+    s = Block::make(produce_f, s);
+    s = Allocate::make("f", Int(32), n, s);
+    result = reuse_allocations(s);
+    f = result.as<Allocate>();
+    assert(f && equal(f->size, max(n, n*4)));
+
+    // Buffers of different types don't share memory
+    produce_h = For::make("x", 0, n, For::Serial, Store::make("h", load_g, x));
+    load_h = Load::make(Int(16), "h", x, Buffer(), Parameter());
+    consume_h = For::make("x", 0, n, For::Serial, Store::make("out", load_h, x));
+    s = Pipeline::make("h", produce_h, Stmt(), Block::make(Free::make("g"), Block::make(consume_h, Free::make("h"))));
+    s = Allocate::make("h", Int(16), n, s);
+    s = Block::make(produce_g, Block::make(Free::make("f"), s));
+    s = Allocate::make("g", Int(16), n, s);
+    s = Block::make(produce_f, s);
+    s = Allocate::make("f", Int(32), n, s);
+    result = reuse_allocations(s);
+    assert(result.same_as(s));
+
+    std::cout << "reuse_allocations test passed" << std::endl;
+}
+
+}
+}
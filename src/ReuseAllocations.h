@@ -0,0 +1,27 @@
+#ifndef HALIDE_REUSE_ALLOCATIONS_H
+#define HALIDE_REUSE_ALLOCATIONS_H
+
+/** \file
+ * Defines the lowering pass that lets intermediate buffers with
+ * non-overlapping lifetimes share memory.
+ */
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Find allocations whose contents are dead (according to the Free
+ * markers injected by inject_early_frees) before another allocation
+ * of the same type nested inside them is first touched, and have the
+ * inner one reuse the outer one's memory instead. The outer allocation
+ * grows to fit both. Only considers allocations at the same loop
+ * level. */
+Stmt reuse_allocations(Stmt s);
+
+void reuse_allocations_test();
+
+}
+}
+
+#endif
@@ -81,12 +81,14 @@ struct Schedule {
     struct Dim {
         std::string var;
         For::ForType for_type;
+        int grain;
     };
     /** The list and ordering of dimensions used to evaluate this
      * function, after all splits have taken place. The first
      * dimension in the vector corresponds to the innermost for loop,
      * and the last is the outermost. Also specifies what type of for
-     * loop to use for each dimension. Does not specify the bounds on
+     * loop to use for each dimension, and for parallel dimensions how
+     * many iterations a worker claims at a time. Does not specify the bounds on
      * each dimension. These get inferred from how the function is
      * used, what the splits are, and any optional bounds in the list below. */
     std::vector<Dim> dims;
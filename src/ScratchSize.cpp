@@ -0,0 +1,238 @@
+#include "ScratchSize.h"
+#include "IRVisitor.h"
+#include "IROperator.h"
+#include "IRPrinter.h"
+#include "Simplify.h"
+#include "Parameter.h"
+#include "Buffer.h"
+#include "Log.h"
+#include <iostream>
+#include <sstream>
+#include <limits.h>
+
+namespace Halide {
+namespace Internal {
+
+using std::string;
+using std::vector;
+using std::ostringstream;
+
+namespace {
+// The scratch arena in the runtime rounds each block up to a multiple
+// of 32 bytes and adds a 32-byte header and 32 bytes of slack for
+// vector loads that spill off the end. See posix_allocator.cpp.
+const int arena_overhead = 32 + 31 + 32;
+
+// Max and add that propagate unboundedness
+Expr max_or_undef(Expr a, Expr b) {
+    if (!a.defined() || !b.defined()) return Expr();
+    if (is_zero(a)) return b;
+    if (is_zero(b)) return a;
+    return Max::make(a, b);
+}
+
+Expr add_or_undef(Expr a, Expr b) {
+    if (!a.defined() || !b.defined()) return Expr();
+    if (is_zero(a)) return b;
+    if (is_zero(b)) return a;
+    return Add::make(a, b);
+}
+}
+
+class PeakScratch : public IRVisitor {
+public:
+    Scope<Interval> scope;
+
+    PeakScratch(const Scope<Interval> &s, int t) : scope(s), stack_threshold(t) {}
+
+    Expr peak_of(Stmt s) {
+        peak = 0;
+        if (s.defined()) s.accept(this);
+        return peak;
+    }
+
+private:
+    // The peak scratch memory used by the last statement visited
+    Expr peak;
+
+    int stack_threshold;
+
+    using IRVisitor::visit;
+
+    void visit(const LetStmt *op) {
+        scope.push(op->name, bounds_of_expr_in_scope(op->value, scope));
+        peak = peak_of(op->body);
+        scope.pop(op->name);
+    }
+
+    void visit(const For *op) {
+        Interval min = bounds_of_expr_in_scope(op->min, scope);
+        Interval extent = bounds_of_expr_in_scope(op->extent, scope);
+        Expr max;
+        if (min.max.defined() && extent.max.defined()) {
+            max = min.max + extent.max - 1;
+        }
+        scope.push(op->name, Interval(min.min, max));
+        Expr body = peak_of(op->body);
+        scope.pop(op->name);
+
+        if (op->for_type == For::Parallel && body.defined() && !is_zero(body)) {
+            // Every iteration could hold onto its allocations at once.
+            peak = extent.max.defined() ? body * Max::make(extent.max, 1) : Expr();
+        } else {
+            peak = body;
+        }
+    }
+
+    void visit(const Block *op) {
+        Expr first = peak_of(op->first);
+        Expr rest = peak_of(op->rest);
+        peak = max_or_undef(first, rest);
+    }
+
+    void visit(const Pipeline *op) {
+        Expr produce = peak_of(op->produce);
+        Expr update = peak_of(op->update);
+        Expr consume = peak_of(op->consume);
+        peak = max_or_undef(max_or_undef(produce, update), consume);
+    }
+
+    void visit(const Allocate *op) {
+        Expr bytes;
+        int bytes_per_element = op->type.bits / 8;
+        const IntImm *size = op->size.as<IntImm>();
+        if (size && (int64_t)size->value * bytes_per_element < stack_threshold) {
+            // Goes on the stack
+            bytes = 0;
+        } else {
+            Interval size_bounds = bounds_of_expr_in_scope(op->size, scope);
+            if (size_bounds.max.defined()) {
+                bytes = size_bounds.max * bytes_per_element + arena_overhead;
+            }
+        }
+        Expr body = peak_of(op->body);
+        peak = add_or_undef(bytes, body);
+    }
+};
+
+Expr peak_scratch_size(Stmt s, const Scope<Interval> &scope, int stack_threshold) {
+    PeakScratch p(scope, stack_threshold);
+    return p.peak_of(s);
+}
+
+namespace {
+
+// Bind a value to a name in a scope
+void bind(Scope<Interval> &scope, const string &name, Expr value) {
+    scope.push(name, Interval(value, value));
+}
+
+void bind_buffer(Scope<Interval> &scope, const string &name, Buffer b) {
+    for (int i = 0; i < b.dimensions(); i++) {
+        ostringstream dim;
+        dim << i;
+        bind(scope, name + ".min." + dim.str(), b.min(i));
+        bind(scope, name + ".extent." + dim.str(), b.extent(i));
+        bind(scope, name + ".stride." + dim.str(), b.stride(i));
+    }
+    bind(scope, name + ".elem_size", b.type().bits / 8);
+}
+
+// The current value of a scalar param, or an undefined Expr if it
+// can't be represented exactly as a constant (doubles, 64-bit ints,
+// and uint32s too large for an IntImm), in which case it's left
+// unknown.
+Expr param_value(const Parameter &p) {
+    Type t = p.type();
+    if (t == Float(32)) return p.get_scalar<float>();
+    if (t == Int(8)) return cast(t, p.get_scalar<int8_t>());
+    if (t == Int(16)) return cast(t, p.get_scalar<int16_t>());
+    if (t == Int(32)) return p.get_scalar<int>();
+    if (t == UInt(1)) return cast(t, p.get_scalar<bool>() ? 1 : 0);
+    if (t == UInt(8)) return cast(t, p.get_scalar<uint8_t>());
+    if (t == UInt(16)) return cast(t, p.get_scalar<uint16_t>());
+    if (t == UInt(32)) {
+        uint32_t value = p.get_scalar<uint32_t>();
+        if (value > INT_MAX) return Expr();
+        return cast(t, (int)value);
+    }
+    return Expr();
+}
+
+// Find the input buffers and scalar params of a lowered pipeline, and
+// bind their current values.
+class BindInputs : public IRVisitor {
+public:
+    Scope<Interval> &scope;
+    BindInputs(Scope<Interval> &s) : scope(s) {}
+
+private:
+    using IRVisitor::visit;
+
+    void visit(const Load *op) {
+        IRVisitor::visit(op);
+        if (op->image.defined()) {
+            if (!scope.contains(op->image.name() + ".elem_size")) {
+                bind_buffer(scope, op->image.name(), op->image);
+            }
+        } else if (op->param.defined()) {
+            if (!scope.contains(op->param.name() + ".elem_size")) {
+                Buffer b = op->param.get_buffer();
+                assert(b.defined() && "An ImageParam is not bound to a buffer");
+                bind_buffer(scope, op->param.name(), b);
+            }
+        }
+    }
+
+    void visit(const Variable *op) {
+        if (op->param.defined() && !op->param.is_buffer() && !scope.contains(op->name)) {
+            Expr value = param_value(op->param);
+            if (value.defined()) {
+                bind(scope, op->name, value);
+            } else {
+                log(1) << "Treating the value of " << op->name << " as unknown when computing scratch size\n";
+            }
+        }
+    }
+};
+
+}
+
+size_t scratch_size(Stmt s, const string &output, const vector<int> &extents,
+                    int elem_size, int stack_threshold) {
+    Scope<Interval> scope;
+
+    // The output buffer starts at zero and is densely packed.
+    int stride = 1;
+    for (size_t i = 0; i < extents.size(); i++) {
+        ostringstream dim;
+        dim << i;
+        bind(scope, output + ".min." + dim.str(), 0);
+        bind(scope, output + ".extent." + dim.str(), extents[i]);
+        bind(scope, output + ".stride." + dim.str(), stride);
+        stride *= extents[i];
+    }
+    bind(scope, output + ".elem_size", elem_size);
+
+    BindInputs bind_inputs(scope);
+    s.accept(&bind_inputs);
+
+    Expr peak = peak_scratch_size(s, scope, stack_threshold);
+    if (!peak.defined()) {
+        std::cerr << "The scratch memory required by " << output << " is unbounded\n";
+        assert(false);
+    }
+    peak = simplify(peak);
+    log(2) << "Peak scratch size of " << output << ": " << peak << "\n";
+
+    const IntImm *result = peak.as<IntImm>();
+    if (!result) {
+        std::cerr << "Could not compute a constant scratch size for " << output
+                  << ". The best bound found was: " << peak << "\n";
+        assert(false);
+    }
+    return (size_t)result->value;
+}
+
+}
+}
@@ -0,0 +1,41 @@
+#ifndef HALIDE_SCRATCH_SIZE_H
+#define HALIDE_SCRATCH_SIZE_H
+
+/** \file
+ * Defines methods for computing how much heap memory a lowered
+ * pipeline needs, so that callers can hand it a scratch arena of the
+ * right size (see \ref Func::realize).
+ */
+
+#include "IR.h"
+#include "Bounds.h"
+#include "Scope.h"
+#include <string>
+#include <vector>
+
+namespace Halide {
+namespace Internal {
+
+/** Compute an upper bound on the number of bytes of scratch memory
+ * that the heap allocations in a lowered statement need at any one
+ * time. Includes the per-allocation overhead of the runtime's
+ * scratch arena. The result is in terms of the free variables of the
+ * statement, unless bounds for them are given in the scope. Returns
+ * an undefined Expr if the peak is unbounded. Iterations of a
+ * parallel loop are assumed to all be in flight at once. Constant
+ * allocations smaller than the stack threshold (in bytes) aren't
+ * counted. */
+Expr peak_scratch_size(Stmt s, const Scope<Interval> &scope, int stack_threshold);
+
+/** Compute the peak scratch memory required to realize a lowered
+ * pipeline into an output buffer with the given name, extents, and
+ * element size. The bounds of the input buffers and the values of
+ * the scalar params are taken from whatever they're currently bound
+ * to. */
+size_t scratch_size(Stmt s, const std::string &output, const std::vector<int> &extents,
+                    int elem_size, int stack_threshold);
+
+}
+}
+
+#endif
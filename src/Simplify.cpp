@@ -12,6 +12,7 @@
 namespace Halide { 
 namespace Internal {
 
+using std::map;
 using std::string;
 
 bool is_simple_const(Expr e) {
@@ -37,11 +38,37 @@ int do_indirect_int_cast(Type t, int x) {
 // Implementation of Halide div and mod operators
 
 class Simplify : public IRMutator {
+public:
+    Simplify(ExprCache *c = NULL) : cache(c) {}
 
+    using IRMutator::mutate;
+
+    Expr mutate(Expr e) {
+        if (!cache || !e.defined()) return IRMutator::mutate(e);
+
+        Expr key = cache->canonical(e);
+        map<const IRNode *, Expr>::iterator iter = memo.find(key.ptr);
+        if (iter != memo.end()) return iter->second;
+
+        // Hash-cons the results too, so that later comparisons
+        // between them are cheap.
+        Expr result = cache->canonical(IRMutator::mutate(e));
+        memo[key.ptr] = result;
+        return result;
+    }
+
+private:
     Scope<Expr> scope;
 
     Scope<ModulusRemainder> alignment_info;
 
+    // When memoizing, the table of canonical expressions, and the
+    // simplified forms of the canonical expressions simplified so
+    // far. How an expression simplifies depends on the lets in scope,
+    // so the simplified forms are forgotten whenever that changes.
+    ExprCache *cache;
+    map<const IRNode *, Expr> memo;
+
     using IRMutator::visit;
 
     void visit(const IntImm *op) {
@@ -1074,6 +1101,7 @@ class Simplify : public IRMutator {
             value_tracked = true;
         }
 
+        memo.clear();
         body = mutator->mutate(body);
 
         if (value_tracked) {
@@ -1084,6 +1112,7 @@ class Simplify : public IRMutator {
         }
 
         scope.pop(op->name);
+        memo.clear();
 
         if (wrapper_value.defined()) {
             return T::make(wrapper_name, wrapper_value, T::make(op->name, value, body));
@@ -1140,11 +1169,19 @@ class Simplify : public IRMutator {
     }    
 };
 
-Expr simplify(Expr e) {
+Expr simplify(Expr e, bool memoize) {
+    if (memoize) {
+        ExprCache cache;
+        return Simplify(&cache).mutate(e);
+    }
     return Simplify().mutate(e);
 }
 
-Stmt simplify(Stmt s) {
+Stmt simplify(Stmt s, bool memoize) {
+    if (memoize) {
+        ExprCache cache;
+        return Simplify(&cache).mutate(s);
+    }
     return Simplify().mutate(s);
 }
 
@@ -1418,6 +1455,31 @@ void simplify_test() {
     check(Let::make("x", y, Expr(Let::make("x", y*17, x+4)) + x), 
           Let::make("x", y, Expr(Let::make("x", y*17, x+4)) + y));
 
+    {
+        // When memoizing, the same expression should simplify
+        // differently inside and outside of a let
+        Stmt inside = LetStmt::make("x", 3, Store::make("f", x + 1, 0));
+        Stmt outside = Store::make("f", x + 1, 1);
+        Stmt s = simplify(Block::make(inside, Block::make(outside, inside)), true);
+        Stmt inside_correct = LetStmt::make("x", 3, Store::make("f", 4, 0));
+        Stmt correct = Block::make(inside_correct,
+                                   Block::make(Store::make("f", x + 1, 1), inside_correct));
+        if (!equal(s, correct)) {
+            std::cout << "Memoized simplification failure: " << std::endl
+                      << s << std::endl << "should have been: " << std::endl << correct << std::endl;
+            assert(false);
+        }
+
+        // Copies of the same expression should simplify to the same
+        // object
+        Expr e = (x*2 + 3) - 3;
+        s = simplify(Store::make("f", max(e, y) + min(e, y), 0), true);
+        const Add *add = s.as<Store>()->value.as<Add>();
+        assert(add && add->a.as<Max>() && add->b.as<Min>());
+        assert(add->a.as<Max>()->a.same_as(add->b.as<Min>()->a));
+        assert(equal(add->a.as<Max>()->a, x*2));
+    }
+
     std::cout << "Simplify test passed" << std::endl;
 }
 }
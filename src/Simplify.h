@@ -13,11 +13,16 @@ namespace Internal {
 
 /** Perform a a wide range of simplifications to expressions
  * and statements, including constant folding, substituting in
- * trivial values, arithmetic rearranging, etc.
+ * trivial values, arithmetic rearranging, etc. If memoize is true,
+ * equal subexpressions (e.g. the copies of an inlined function) are
+ * only simplified once per enclosing let, and the results share
+ * their equal subexpressions. That pays off for whole statements, but
+ * not for the small expressions simplified during bounds inference,
+ * hence the different defaults.
  */
 // @{
-Stmt simplify(Stmt);
-Expr simplify(Expr);
+Stmt simplify(Stmt, bool memoize = true);
+Expr simplify(Expr, bool memoize = false);
 // @}     
    
 /** Implementations of division and mod that are specific to Halide.
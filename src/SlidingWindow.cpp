@@ -147,7 +147,7 @@ class SlidingWindowOnFunction : public IRMutator {
         if (new_body.same_as(op->body)) {
             stmt = op;
         } else {
-            stmt = For::make(op->name, op->min, op->extent, op->for_type, new_body);
+            stmt = For::make(op->name, op->min, op->extent, op->for_type, new_body, op->grain);
         }
     }
 
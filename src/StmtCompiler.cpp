@@ -75,10 +75,18 @@ void StmtCompiler::compile(Stmt stmt, string name, const vector<Argument> &args)
     contents.ptr->compile(stmt, name, args);
 }
 
+void StmtCompiler::set_stack_allocation_threshold(int bytes) {
+    contents.ptr->set_stack_allocation_threshold(bytes);
+}
+
 void StmtCompiler::compile_to_bitcode(const string &filename) {
     contents.ptr->compile_to_bitcode(filename);
 }
 
+bool StmtCompiler::compile_from_bitcode(const string &filename, const string &name) {
+    return contents.ptr->compile_from_bitcode(filename, name);
+}
+
 void StmtCompiler::compile_to_native(const string &filename, bool assembly) {
     contents.ptr->compile_to_native(filename, assembly);
 }
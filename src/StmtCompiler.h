@@ -34,9 +34,19 @@ public:
      * until one of the later functions is called: */
     void compile(Stmt stmt, std::string name, const std::vector<Argument> &args);
 
+    /** Put constant-sized allocations of less than the given number
+     * of bytes on the stack. Call this before calling compile. */
+    void set_stack_allocation_threshold(int bytes);
+
     /** Write the module to an llvm bitcode file */
     void compile_to_bitcode(const std::string &filename);
 
+    /** Instead of calling compile, load a module written by
+     * compile_to_bitcode from an earlier call to compile for the same
+     * architecture. name is the name that was passed to
+     * compile. Returns false if the module can't be loaded. */
+    bool compile_from_bitcode(const std::string &filename, const std::string &name);
+
     /** Compile and write the module to either a binary object file,
      * or as assembly */
     void compile_to_native(const std::string &filename, bool assembly = false);
@@ -0,0 +1,297 @@
+#include "ThreadPool.h"
+#include "Log.h"
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+namespace Halide {
+namespace Internal {
+
+using std::deque;
+using std::pair;
+using std::vector;
+
+namespace {
+// A parallel for loop in flight on a pool
+struct PoolJob {
+    void (*f)(int, uint8_t *);
+    uint8_t *closure;
+    int min, extent, grain;
+    // The loop is split into this many chunks of grain indices each,
+    // which threads claim by atomically incrementing next_chunk. No
+    // lock is needed per chunk.
+    int num_chunks;
+    volatile int next_chunk;
+    // How many threads other than the owner are claiming chunks of
+    // this job. Protected by the pool mutex.
+    int helpers;
+    // Whether the job is still on the pool's stack. Protected by the
+    // pool mutex.
+    bool on_stack;
+    PoolJob *next_job;
+
+    // Claim and run chunks until there are none left.
+    void run_chunks() {
+        while (true) {
+            int chunk = __sync_fetch_and_add(&next_chunk, 1);
+            if (chunk >= num_chunks) return;
+            int chunk_min = min + chunk * grain;
+            int chunk_max = chunk_min + grain;
+            if (chunk == num_chunks - 1) chunk_max = min + extent;
+            for (int i = chunk_min; i < chunk_max; i++) {
+                f(i, closure);
+            }
+        }
+    }
+
+    bool exhausted() const {
+        return next_chunk >= num_chunks;
+    }
+};
+}
+
+struct ThreadPoolContents {
+    mutable RefCount ref_count;
+
+    int priority;
+
+    // Everything below is protected by this mutex.
+    pthread_mutex_t mutex;
+
+    // Idle workers wait on this for new work or shutdown.
+    pthread_cond_t wakeup_workers;
+
+    // Threads in do_par_for wait on this for the helpers on their job
+    // to finish.
+    pthread_cond_t job_done;
+
+    // Stack of parallel loops that may still have chunks to hand
+    // out. Workers take the most recent first.
+    PoolJob *jobs;
+
+    // One-off calls from enqueue.
+    deque<pair<void (*)(void *), void *> > tasks;
+
+    vector<pthread_t> threads;
+
+    bool shutdown;
+
+    ThreadPoolContents(int threads, int p);
+    ~ThreadPoolContents();
+
+    // Take a job off the stack. Must hold the mutex.
+    void remove(PoolJob *job) {
+        if (!job->on_stack) return;
+        PoolJob **ptr = &jobs;
+        while (*ptr != job) ptr = &((*ptr)->next_job);
+        *ptr = job->next_job;
+        job->on_stack = false;
+    }
+
+    // Help out with a job until it has no chunks left. Must hold the
+    // mutex, which is released while the chunks run. The mutex is
+    // only taken again once the job is exhausted, so the owner can't
+    // return while we still hold a pointer to it.
+    void help(PoolJob *job) {
+        job->helpers++;
+        pthread_mutex_unlock(&mutex);
+        job->run_chunks();
+        pthread_mutex_lock(&mutex);
+        remove(job);
+        job->helpers--;
+        if (job->helpers == 0) {
+            pthread_cond_broadcast(&job_done);
+        }
+    }
+
+    void worker_loop() {
+        #ifdef __linux__
+        if (priority) {
+            // On linux, nice values are per-thread.
+            setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), priority);
+        }
+        #endif
+
+        // Finish any tasks still queued before shutting down.
+        pthread_mutex_lock(&mutex);
+        while (!shutdown || !tasks.empty()) {
+            if (jobs) {
+                PoolJob *job = jobs;
+                if (job->exhausted()) {
+                    remove(job);
+                } else {
+                    help(job);
+                }
+            } else if (!tasks.empty()) {
+                pair<void (*)(void *), void *> task = tasks.front();
+                tasks.pop_front();
+                pthread_mutex_unlock(&mutex);
+                task.first(task.second);
+                pthread_mutex_lock(&mutex);
+            } else {
+                pthread_cond_wait(&wakeup_workers, &mutex);
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    static void *worker_thread(void *arg) {
+        ((ThreadPoolContents *)arg)->worker_loop();
+        return NULL;
+    }
+
+    void do_par_for(void (*f)(int, uint8_t *), int min, int extent, int grain, uint8_t *closure) {
+        if (extent <= 0) return;
+
+        PoolJob job;
+        job.f = f;
+        job.closure = closure;
+        job.min = min;
+        job.extent = extent;
+        job.grain = grain < 1 ? 1 : grain;
+        job.num_chunks = (int)(((int64_t)extent + job.grain - 1) / job.grain);
+        job.next_chunk = 0;
+        job.helpers = 0;
+
+        if (job.num_chunks == 1) {
+            // Nothing to share
+            job.run_chunks();
+            return;
+        }
+
+        pthread_mutex_lock(&mutex);
+        job.next_job = jobs;
+        job.on_stack = true;
+        jobs = &job;
+
+        // Wake up as many workers as there are chunks for, not
+        // counting the one we're about to take ourselves.
+        int chunks = job.num_chunks - 1;
+        if (chunks >= (int)threads.size()) {
+            pthread_cond_broadcast(&wakeup_workers);
+        } else {
+            for (int i = 0; i < chunks; i++) {
+                pthread_cond_signal(&wakeup_workers);
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+
+        // Work on our own job until it's all handed out, then wait
+        // for the helpers to finish their last chunks.
+        job.run_chunks();
+
+        pthread_mutex_lock(&mutex);
+        remove(&job);
+        while (job.helpers > 0) {
+            pthread_cond_wait(&job_done, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void enqueue(void (*f)(void *), void *arg) {
+        pthread_mutex_lock(&mutex);
+        tasks.push_back(std::make_pair(f, arg));
+        pthread_cond_signal(&wakeup_workers);
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+namespace {
+// One thread per cpu this process is allowed to run on, which is
+// also how the runtime sizes its own pool.
+int default_num_threads() {
+    int count = 0;
+    #ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        count = CPU_COUNT(&allowed);
+    }
+    #endif
+    #ifdef _SC_NPROCESSORS_ONLN
+    if (count <= 0) {
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    #endif
+    return count > 0 ? count : 8;
+}
+}
+
+ThreadPoolContents::ThreadPoolContents(int num_threads, int p) : priority(p), jobs(NULL), shutdown(false) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&wakeup_workers, NULL);
+    pthread_cond_init(&job_done, NULL);
+
+    if (num_threads <= 0) {
+        num_threads = default_num_threads();
+    }
+
+    log(2) << "Starting a thread pool with " << num_threads << " threads at priority " << priority << "\n";
+    threads.resize(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, worker_thread, this);
+    }
+}
+
+ThreadPoolContents::~ThreadPoolContents() {
+    pthread_mutex_lock(&mutex);
+    shutdown = true;
+    pthread_cond_broadcast(&wakeup_workers);
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&wakeup_workers);
+    pthread_cond_destroy(&job_done);
+}
+
+template<>
+EXPORT RefCount &ref_count<ThreadPoolContents>(const ThreadPoolContents *p) {return p->ref_count;}
+
+template<>
+EXPORT void destroy<ThreadPoolContents>(const ThreadPoolContents *p) {delete p;}
+
+}
+
+using namespace Internal;
+
+ThreadPool::ThreadPool(int threads, int priority) : contents(new ThreadPoolContents(threads, priority)) {
+}
+
+int ThreadPool::size() const {
+    assert(defined() && "Can't query an undefined ThreadPool");
+    return (int)contents.ptr->threads.size();
+}
+
+int ThreadPool::priority() const {
+    assert(defined() && "Can't query an undefined ThreadPool");
+    return contents.ptr->priority;
+}
+
+void ThreadPool::do_par_for(void (*f)(int, uint8_t *), int min, int extent, int grain, uint8_t *closure) const {
+    assert(defined() && "Can't run a parallel loop on an undefined ThreadPool");
+    contents.ptr->do_par_for(f, min, extent, grain, closure);
+}
+
+void ThreadPool::enqueue(void (*f)(void *), void *arg) const {
+    assert(defined() && "Can't enqueue work on an undefined ThreadPool");
+    contents.ptr->enqueue(f, arg);
+}
+
+void ThreadPool::runtime_do_par_for(void *pool, void (*f)(int, uint8_t *), int min, int extent, int grain, uint8_t *closure) {
+    ((ThreadPoolContents *)pool)->do_par_for(f, min, extent, grain, closure);
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef HALIDE_THREAD_POOL_H
+#define HALIDE_THREAD_POOL_H
+
+/** \file
+ * Defines ThreadPool - a pool of worker threads that the parallel
+ * loops of jit-compiled pipelines can be assigned to.
+ */
+
+#include "IntrusivePtr.h"
+#include "Util.h"
+
+#include <stdint.h>
+
+namespace Halide {
+
+namespace Internal {
+struct ThreadPoolContents;
+}
+
+/** A pool of worker threads, separate from the one the halide
+ * runtime maintains for each compiled module. Assign one to a Func
+ * with \ref Func::set_thread_pool, and the parallel loops of that
+ * Func will run on this pool instead. Pipelines that shouldn't
+ * compete for the same workers (e.g. a latency-critical pipeline and
+ * a batch one) can each be given their own pool. Several Funcs may
+ * share a pool. The threads are shut down when the last handle to the
+ * pool goes away. */
+class ThreadPool {
+    Internal::IntrusivePtr<Internal::ThreadPoolContents> contents;
+public:
+    /** Construct an undefined pool handle */
+    ThreadPool() {}
+
+    /** Make a new pool with the given number of worker threads. Zero
+     * means one per cpu. The thread that launches a parallel loop
+     * on the pool also works on it. The priority is a nice value
+     * applied to each worker thread: positive values make the
+     * workers yield to other threads, and negative values (which
+     * usually need special privileges) do the opposite. The
+     * priority is only honored on linux. */
+    EXPORT ThreadPool(int threads, int priority = 0);
+
+    /** Is this handle pointing at an actual pool */
+    bool defined() const {
+        return contents.defined();
+    }
+
+    /** The number of worker threads in this pool */
+    EXPORT int size() const;
+
+    /** The nice value the worker threads run at */
+    EXPORT int priority() const;
+
+    /** Call f(idx, closure) for every idx in [min, min + extent),
+     * spread across the workers of this pool and the calling
+     * thread. Each thread claims grain consecutive indices at a
+     * time. Returns once all the calls have completed. Safe to call
+     * from within one of the calls, in which case the calling worker
+     * helps out with the inner loop. */
+    EXPORT void do_par_for(void (*f)(int, uint8_t *), int min, int extent, int grain, uint8_t *closure) const;
+
+    /** Have one of the workers call f(arg) at some point in the
+     * future. Jobs from do_par_for take precedence over these. */
+    EXPORT void enqueue(void (*f)(void *), void *arg) const;
+
+    /** The function and argument to hand to the halide runtime via
+     * halide_set_custom_thread_pool in order to run its parallel
+     * loops on this pool. Used by Func. */
+    // @{
+    EXPORT static void runtime_do_par_for(void *pool, void (*f)(int, uint8_t *), int min, int extent, int grain, uint8_t *closure);
+    void *runtime_handle() const {
+        return (void *)contents.ptr;
+    }
+    // @}
+};
+
+}
+
+#endif
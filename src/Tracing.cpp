@@ -1,6 +1,9 @@
 #include "Tracing.h"
 #include "IRMutator.h"
 #include "IROperator.h"
+#include "trace_event.h"
+#include <algorithm>
+#include <map>
 
 namespace Halide {
 namespace Internal {
@@ -10,15 +13,50 @@ int tracing_level() {
     return trace ? atoi(trace) : 0;
 }
 
+bool tracing_to_file() {
+    char *trace_file = getenv("HL_TRACE_FILE");
+    return trace_file != NULL;
+}
+
+using std::map;
+using std::string;
 using std::vector;
 
+namespace {
+// Make a call that appends an event to the binary trace. There's room
+// for four coordinates per event, so events of functions with more
+// dimensions than that only keep the first four.
+Stmt trace_event(int event, int func, const vector<Expr> &coords) {
+    int dimensions = std::min((int)coords.size(), 4);
+    vector<Expr> args = vec<Expr>(event, func, dimensions);
+    for (size_t i = 0; i < 4; i++) {
+        args.push_back(i < coords.size() ? coords[i] : 0);
+    }
+    Expr call = Call::make(Int(32), "halide_trace", args);
+    return AssertStmt::make(call == 0, "Failed to trace an event");
+}
+}
+
 class InjectTracing : public IRMutator {
 public:
     int level;
+    bool binary;
+
+    // The IDs of the functions in the binary trace
+    map<string, int> func_ids;
+
     InjectTracing() {
         level = tracing_level();
+        binary = tracing_to_file();
     }
 
+    int get_func_id(const string &name) {
+        map<string, int>::iterator iter = func_ids.find(name);
+        if (iter != func_ids.end()) return iter->second;
+        int id = (int)func_ids.size();
+        func_ids[name] = id;
+        return id;
+    }
 
 private:
     using IRMutator::visit;
@@ -32,10 +70,15 @@ private:
         // We print every provide at tracing level 3 or higher
         if (level >= 3) {
             const Provide *op = stmt.as<Provide>();
-            vector<Expr> args = op->args;
-            args.push_back(op->value);
-            Stmt print = PrintStmt::make("Provide " + op->name, args);
-            stmt = Block::make(print, op);
+            Stmt trace;
+            if (binary) {
+                trace = trace_event(HALIDE_TRACE_PROVIDE, get_func_id(op->name), op->args);
+            } else {
+                vector<Expr> args = op->args;
+                args.push_back(op->value);
+                trace = PrintStmt::make("Provide " + op->name, args);
+            }
+            stmt = Block::make(trace, op);
         }
     }
 
@@ -43,31 +86,58 @@ private:
         IRMutator::visit(op);
         if (level >= 1) {
             const Realize *op = stmt.as<Realize>();
-            vector<Expr> args;
-            for (size_t i = 0; i < op->bounds.size(); i++) {
-                args.push_back(op->bounds[i].min);
-                args.push_back(op->bounds[i].extent);
+            Stmt trace;
+            if (binary) {
+                vector<Expr> mins, extents;
+                for (size_t i = 0; i < op->bounds.size(); i++) {
+                    mins.push_back(op->bounds[i].min);
+                    extents.push_back(op->bounds[i].extent);
+                }
+                int id = get_func_id(op->name);
+                trace = Block::make(trace_event(HALIDE_TRACE_REALIZE_MIN, id, mins),
+                                    trace_event(HALIDE_TRACE_REALIZE_EXTENT, id, extents));
+            } else {
+                vector<Expr> args;
+                for (size_t i = 0; i < op->bounds.size(); i++) {
+                    args.push_back(op->bounds[i].min);
+                    args.push_back(op->bounds[i].extent);
+                }
+                Expr time = Call::make(Int(64), "halide_current_time_ns", std::vector<Expr>());
+                Stmt print = PrintStmt::make("Realizing " + op->name + " over ", args);
+                Stmt start_time = PrintStmt::make("Starting realization of " + op->name + " at time (ns) ", vec(time));
+                trace = Block::make(start_time, print);
             }
-            Expr time = Call::make(Int(32), "halide_current_time", std::vector<Expr>());
-            Stmt print = PrintStmt::make("Realizing " + op->name + " over ", args);
-            Stmt start_time = PrintStmt::make("Starting realization of " + op->name + " at time ", vec(time));
-            Stmt body = Block::make(Block::make(start_time, print), op->body);
+            Stmt body = Block::make(trace, op->body);
             stmt = Realize::make(op->name, op->type, op->bounds, body);
         }        
     }
 
     void visit(const Pipeline *op) {
         if (level >= 1) {
-            Expr time = Call::make(Int(32), "halide_current_time", std::vector<Expr>());
-            Stmt print_produce = PrintStmt::make("Producing " + op->name + " at time ", vec(time));
-            Stmt print_update = PrintStmt::make("Updating " + op->name + " at time ", vec(time));
-            Stmt print_consume = PrintStmt::make("Consuming " + op->name + " at time ", vec(time));
+            Stmt trace_produce, trace_update, trace_consume;
+            if (binary) {
+                int id = get_func_id(op->name);
+                trace_produce = trace_event(HALIDE_TRACE_PRODUCE, id, vector<Expr>());
+                trace_update = trace_event(HALIDE_TRACE_UPDATE, id, vector<Expr>());
+                trace_consume = trace_event(HALIDE_TRACE_CONSUME, id, vector<Expr>());
+            } else {
+                Expr time = Call::make(Int(64), "halide_current_time_ns", std::vector<Expr>());
+                trace_produce = PrintStmt::make("Producing " + op->name + " at time (ns) ", vec(time));
+                trace_update = PrintStmt::make("Updating " + op->name + " at time (ns) ", vec(time));
+                trace_consume = PrintStmt::make("Consuming " + op->name + " at time (ns) ", vec(time));
+            }
             Stmt produce = mutate(op->produce);
             Stmt update = op->update.defined() ? mutate(op->update) : Stmt();
             Stmt consume = mutate(op->consume);
-            produce = Block::make(print_produce, produce);
-            update = update.defined() ? Block::make(print_update, update) : Stmt();
-            consume = Block::make(print_consume, consume);
+            produce = Block::make(trace_produce, produce);
+            update = update.defined() ? Block::make(trace_update, update) : Stmt();
+            consume = Block::make(trace_consume, consume);
+            if (binary) {
+                // Mark where the consume phase ends, so that the
+                // phases can be drawn as spans on a timeline
+                int id = get_func_id(op->name);
+                consume = Block::make(consume, trace_event(HALIDE_TRACE_END_CONSUME, id, vector<Expr>()));
+            }
             stmt = Pipeline::make(op->name, produce, update, consume);
         } else {
             IRMutator::visit(op);
@@ -78,20 +148,48 @@ private:
         // We only enter for loops at tracing level 2 or higher
         if (level >= 2) {
             IRMutator::visit(op);
+            if (binary && op->for_type == For::Parallel) {
+                // Trace each iteration, so that it can be attributed
+                // to the worker thread that ran it.
+                op = stmt.as<For>();
+                int id = get_func_id(op->name);
+                Expr idx = Variable::make(Int(32), op->name);
+                Stmt body = Block::make(trace_event(HALIDE_TRACE_BEGIN_TASK, id, vec(idx)),
+                                        Block::make(op->body, trace_event(HALIDE_TRACE_END_TASK, id, vec(idx))));
+                stmt = For::make(op->name, op->min, op->extent, op->for_type, body, op->grain);
+            }
         } else {
             stmt = op;
         }
     }
 };
 
-Stmt inject_tracing(Stmt s) {
+Stmt inject_tracing(Stmt s, const string &pipeline_name) {
     InjectTracing tracing;
     s = tracing.mutate(s);
-    if (tracing.level >= 1) {
-        Expr time = Call::make(Int(32), "halide_current_time", std::vector<Expr>());
+    if (tracing.level >= 1 && tracing.binary) {
+        int id = tracing.get_func_id(pipeline_name);
+        // The trace file is named after the pipeline
+        Expr pipeline = Call::make(Int(32), pipeline_name, vector<Expr>());
+        Expr start_call = Call::make(Int(32), "trace start", vec(pipeline));
+        Stmt start = AssertStmt::make(start_call == 0, "Failed to open the trace file");
+        // The names of the functions go at the start of the trace
+        for (map<string, int>::iterator iter = tracing.func_ids.begin();
+             iter != tracing.func_ids.end(); ++iter) {
+            Expr name = Call::make(Int(32), iter->first, vector<Expr>());
+            Expr name_call = Call::make(Int(32), "trace func name", vec(Expr(iter->second), name));
+            start = Block::make(start, AssertStmt::make(name_call == 0, "Failed to trace a function name"));
+        }
+        start = Block::make(start, trace_event(HALIDE_TRACE_BEGIN_PIPELINE, id, vector<Expr>()));
+        Stmt end = trace_event(HALIDE_TRACE_END_PIPELINE, id, vector<Expr>());
+        Expr end_call = Call::make(Int(32), "halide_trace_end", vector<Expr>());
+        end = Block::make(end, AssertStmt::make(end_call == 0, "Failed to flush the trace file"));
+        s = Block::make(Block::make(start, s), end);
+    } else if (tracing.level >= 1) {
+        Expr time = Call::make(Int(64), "halide_current_time_ns", std::vector<Expr>());
         Expr start_clock_call = Call::make(Int(32), "halide_start_clock", std::vector<Expr>());
         Stmt start_clock = AssertStmt::make(start_clock_call == 0, "Failed to start clock");
-        Stmt print_final_time = PrintStmt::make("Total time: ", vec(time));
+        Stmt print_final_time = PrintStmt::make("Total time (ns): ", vec(time));
         s = Block::make(Block::make(start_clock, s), print_final_time);
     }
     return s;
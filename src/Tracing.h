@@ -12,13 +12,21 @@ namespace Internal {
 
 /** Take a statement representing a halide pipeline, and (depending on
  * the environment variable HL_TRACE), inject print statements at
- * interesting points, such as allocations. Should be done before
- * storage flattening, but after all bounds inference. */
-Stmt inject_tracing(Stmt);
+ * interesting points, such as allocations. If HL_TRACE_FILE is set,
+ * the events are instead appended to a binary trace (see
+ * trace_event.h), which the runtime writes to a file named after
+ * both HL_TRACE_FILE and the pipeline when the pipeline runs. Should
+ * be done before storage flattening, but after all bounds
+ * inference. */
+Stmt inject_tracing(Stmt, const std::string &pipeline_name);
 
 /** Gets the current tracing level (by reading HL_TRACE) */
 int tracing_level();
 
+/** Whether tracing goes to a binary file rather than being printed
+ * (by checking for HL_TRACE_FILE) */
+bool tracing_to_file();
+
 }
 }
 
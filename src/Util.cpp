@@ -1,6 +1,7 @@
 #include "Util.h"
 #include <sstream>
 #include <map>
+#include <stdlib.h>
 
 namespace Halide { 
 namespace Internal {
@@ -78,5 +79,18 @@ string base_name(const string &name) {
     return name.substr(off+1);
 }
 
+int default_stack_allocation_threshold() {
+    #ifdef _WIN32
+    char env[128];
+    size_t read = 0;
+    getenv_s(&read, env, "HL_STACK_THRESHOLD");
+    if (read) return atoi(env);
+    #else
+    char *env = getenv("HL_STACK_THRESHOLD");
+    if (env) return atoi(env);
+    #endif
+    return 32*1024;
+}
+
 }
 }
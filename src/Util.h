@@ -111,6 +111,13 @@ EXPORT bool ends_with(const std::string &str, const std::string &suffix);
  * delimited by '.' */
 EXPORT std::string base_name(const std::string &name);
 
+/** Allocations with a constant size of less than this many bytes go
+ * on the stack instead of the heap, unless told otherwise (see \ref
+ * Func::set_stack_allocation_threshold). Defaults to 32k (8k
+ * elements of a 32-bit type), and may be overridden with the
+ * environment variable HL_STACK_THRESHOLD. */
+EXPORT int default_stack_allocation_threshold();
+
 }
 }
 
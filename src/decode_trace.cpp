@@ -0,0 +1,197 @@
+// Decodes the binary trace files written by pipelines compiled with
+// HL_TRACE and HL_TRACE_FILE set, and prints one line per event.
+//
+// With -chrome, it instead prints a timeline of the produce, update,
+// and consume phases of each function on each thread, in the JSON
+// trace event format understood by chrome://tracing and Perfetto. At
+// HL_TRACE=2 or higher, the iterations of parallel loops show up too,
+// on the worker threads that ran them.
+//
+// Usage: decode_trace [-chrome] halide.trace
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "trace_event.h"
+
+std::map<int, std::string> func_names;
+
+const char *event_name(int event) {
+    switch (event) {
+    case HALIDE_TRACE_REALIZE_MIN: return "realize min";
+    case HALIDE_TRACE_REALIZE_EXTENT: return "realize extent";
+    case HALIDE_TRACE_PRODUCE: return "produce";
+    case HALIDE_TRACE_UPDATE: return "update";
+    case HALIDE_TRACE_CONSUME: return "consume";
+    case HALIDE_TRACE_PROVIDE: return "provide";
+    case HALIDE_TRACE_BEGIN_PIPELINE: return "begin pipeline";
+    case HALIDE_TRACE_END_PIPELINE: return "end pipeline";
+    case HALIDE_TRACE_END_CONSUME: return "end consume";
+    case HALIDE_TRACE_BEGIN_TASK: return "begin task";
+    case HALIDE_TRACE_END_TASK: return "end task";
+    default: return "unknown";
+    }
+}
+
+std::string func_name(int id) {
+    std::map<int, std::string>::iterator iter = func_names.find(id);
+    if (iter != func_names.end()) return iter->second;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "#%d", id);
+    return buf;
+}
+
+void print_text(const halide_trace_record_t &r) {
+    printf("%lld %d %s %s", (long long)r.time_ns, (int)r.thread,
+           event_name(r.event), func_name(r.func).c_str());
+    for (int i = 0; i < r.dimensions && i < 4; i++) {
+        printf(" %d", r.coords[i]);
+    }
+    printf("\n");
+}
+
+// The spans that are open on each thread in the timeline
+struct Span {
+    std::string name, category;
+    int64_t start_ns;
+};
+std::map<int, std::vector<Span> > open_spans;
+bool first_chrome_event = true;
+
+// The runtime numbers threads exactly, so each thread of the
+// pipeline gets a row of its own, and the spans on a row nest.
+void print_chrome_span(int thread, const Span &span, int64_t end_ns) {
+    printf("%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+           "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, \"tid\": %d}",
+           first_chrome_event ? "" : ",",
+           span.name.c_str(), span.category.c_str(),
+           span.start_ns / 1000.0, (end_ns - span.start_ns) / 1000.0,
+           thread);
+    first_chrome_event = false;
+}
+
+void begin_span(const halide_trace_record_t &r, const std::string &name, const char *category) {
+    Span span = {name, category, r.time_ns};
+    open_spans[r.thread].push_back(span);
+}
+
+// Close the most recent span on the thread with the given name, and
+// any spans opened inside it that were never closed.
+void end_span(const halide_trace_record_t &r, const std::string &name) {
+    std::vector<Span> &spans = open_spans[r.thread];
+    for (size_t i = spans.size(); i > 0; i--) {
+        if (spans[i-1].name == name) {
+            while (spans.size() >= i) {
+                print_chrome_span(r.thread, spans.back(), r.time_ns);
+                spans.pop_back();
+            }
+            return;
+        }
+    }
+}
+
+void print_chrome(const halide_trace_record_t &r) {
+    std::string name = func_name(r.func);
+    switch (r.event) {
+    case HALIDE_TRACE_PRODUCE:
+        begin_span(r, name + " produce", "produce");
+        break;
+    case HALIDE_TRACE_UPDATE:
+        end_span(r, name + " produce");
+        begin_span(r, name + " update", "update");
+        break;
+    case HALIDE_TRACE_CONSUME:
+        end_span(r, name + " produce");
+        end_span(r, name + " update");
+        begin_span(r, name + " consume", "consume");
+        break;
+    case HALIDE_TRACE_END_CONSUME:
+        end_span(r, name + " consume");
+        break;
+    case HALIDE_TRACE_BEGIN_TASK: {
+        char buf[32];
+        snprintf(buf, sizeof(buf), " %d", r.coords[0]);
+        begin_span(r, "par_for " + name + buf, "task");
+        break;
+    }
+    case HALIDE_TRACE_END_TASK: {
+        char buf[32];
+        snprintf(buf, sizeof(buf), " %d", r.coords[0]);
+        end_span(r, "par_for " + name + buf);
+        break;
+    }
+    case HALIDE_TRACE_BEGIN_PIPELINE:
+        begin_span(r, name, "pipeline");
+        break;
+    case HALIDE_TRACE_END_PIPELINE:
+        end_span(r, name);
+        break;
+    default:
+        // Realizations and provides don't get drawn
+        break;
+    }
+}
+
+int main(int argc, char **argv) {
+    bool chrome = argc == 3 && strcmp(argv[1], "-chrome") == 0;
+    if (argc != 2 && !chrome) {
+        fprintf(stderr, "Usage: %s [-chrome] trace_file\n", argv[0]);
+        return -1;
+    }
+    const char *filename = argv[argc-1];
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return -1;
+    }
+
+    char magic[8];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, HALIDE_TRACE_MAGIC, 8)) {
+        fprintf(stderr, "%s is not a halide trace file\n", filename);
+        return -1;
+    }
+
+    if (chrome) printf("{\"traceEvents\": [");
+
+    halide_trace_record_t r;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.event == HALIDE_TRACE_FUNC_NAME) {
+            // The name follows, padded to a multiple of the record size
+            size_t len = r.coords[0];
+            size_t padded = (len + sizeof(r) - 1) / sizeof(r) * sizeof(r);
+            std::string name(padded, '\0');
+            if (fread(&name[0], 1, padded, f) != padded) {
+                fprintf(stderr, "Truncated function name\n");
+                return -1;
+            }
+            name.resize(len);
+            func_names[r.func] = name;
+            continue;
+        }
+
+        if (chrome) {
+            print_chrome(r);
+        } else {
+            print_text(r);
+        }
+    }
+
+    if (chrome) {
+        printf("\n]}\n");
+        // Spans only stay open if the trace was cut short
+        size_t unclosed = 0;
+        for (std::map<int, std::vector<Span> >::iterator iter = open_spans.begin();
+             iter != open_spans.end(); ++iter) {
+            unclosed += iter->second.size();
+        }
+        if (unclosed) {
+            fprintf(stderr, "%d spans were never closed\n", (int)unclosed);
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
@@ -11,6 +11,20 @@ extern "C" {
 WEAK void halide_shutdown_thread_pool() {
 }
 
+// There are no idle threads to tune here.
+WEAK void halide_set_spin_us(int us) {
+}
+
+// Thread placement is left to the operating system here.
+WEAK int halide_set_thread_affinity(int mode) {
+    return 0;
+}
+
+// There is only ever the calling thread here.
+WEAK int halide_set_num_threads(int n) {
+    return 0;
+}
+
 WEAK void (*halide_custom_do_task)(void (*)(int, uint8_t *), int, uint8_t *);
 WEAK void set_halide_custom_do_task(void (*f)(void (*)(int, uint8_t *), int, uint8_t *)) {
     halide_custom_do_task = f;
@@ -21,6 +35,16 @@ WEAK void set_halide_custom_do_par_for(void (*f)(void (*)(int, uint8_t *), int,
     halide_custom_do_par_for = f;
 }
 
+// A thread pool that lives outside of the runtime, e.g. one owned by
+// the application. If set, parallel loops are handed to it along with
+// the user pointer, unless a custom do_par_for is also set.
+WEAK void (*halide_custom_thread_pool)(void *, void (*)(int, uint8_t *), int, int, int, uint8_t *);
+WEAK void *halide_custom_thread_pool_user;
+WEAK void halide_set_custom_thread_pool(void (*f)(void *, void (*)(int, uint8_t *), int, int, int, uint8_t *), void *user) {
+    halide_custom_thread_pool = f;
+    halide_custom_thread_pool_user = user;
+}
+
 WEAK void halide_do_task(void (*f)(int, uint8_t *), int idx, uint8_t *closure) {
     if (halide_custom_do_task) {
         (*halide_custom_do_task)(f, idx, closure);
@@ -34,10 +58,24 @@ WEAK void halide_do_par_for(void (*f)(int, uint8_t *), int min, int size, uint8_
         (*halide_custom_do_par_for)(f, min, size, closure);
         return;
     }
+    if (halide_custom_thread_pool) {
+        (*halide_custom_thread_pool)(halide_custom_thread_pool_user, f, min, size, 1, closure);
+        return;
+    }
 
     for (int x = min; x < min + size; x++) {
         halide_do_task(f, x, closure);
     }
 }
 
+// The grain only affects how the tasks are handed out, so it's safe
+// to ignore it here.
+WEAK void halide_do_par_for_chunked(void (*f)(int, uint8_t *), int min, int size, int grain, uint8_t *closure) {
+    if (halide_custom_thread_pool && !halide_custom_do_par_for) {
+        (*halide_custom_thread_pool)(halide_custom_thread_pool_user, f, min, size, grain, closure);
+        return;
+    }
+    halide_do_par_for(f, min, size, closure);
+}
+
 }
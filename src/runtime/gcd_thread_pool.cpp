@@ -8,6 +8,20 @@ extern "C" {
 WEAK void halide_shutdown_thread_pool() {
 }
 
+// There are no idle threads to tune here.
+WEAK void halide_set_spin_us(int us) {
+}
+
+// Thread placement is left to the operating system here.
+WEAK int halide_set_thread_affinity(int mode) {
+    return 0;
+}
+
+// Grand central dispatch sizes its own pool.
+WEAK int halide_set_num_threads(int n) {
+    return 0;
+}
+
 WEAK void (*halide_custom_do_task)(void (*)(int, uint8_t *), int, uint8_t *);
 WEAK void halide_set_custom_do_task(void (*f)(void (*)(int, uint8_t *), int, uint8_t *)) {
     halide_custom_do_task = f;
@@ -18,6 +32,16 @@ WEAK void halide_set_custom_do_par_for(void (*f)(void (*)(int, uint8_t *), int,
     halide_custom_do_par_for = f;
 }
 
+// A thread pool that lives outside of the runtime, e.g. one owned by
+// the application. If set, parallel loops are handed to it along with
+// the user pointer.
+WEAK void (*halide_custom_thread_pool)(void *, void (*)(int, uint8_t *), int, int, int, uint8_t *);
+WEAK void *halide_custom_thread_pool_user;
+WEAK void halide_set_custom_thread_pool(void (*f)(void *, void (*)(int, uint8_t *), int, int, int, uint8_t *), void *user) {
+    halide_custom_thread_pool = f;
+    halide_custom_thread_pool_user = user;
+}
+
 WEAK void halide_do_task(void (*f)(int, uint8_t *), int idx, uint8_t *closure) {    
     if (halide_custom_do_task) {
         (*halide_custom_do_task)(f, idx, closure);
@@ -40,6 +64,10 @@ WEAK void halide_do_gcd_task(void *job, size_t idx) {
 }
 
 WEAK void halide_do_par_for(void (*f)(int, uint8_t *), int min, int size, uint8_t *closure) {
+    if (halide_custom_thread_pool) {
+        (*halide_custom_thread_pool)(halide_custom_thread_pool_user, f, min, size, 1, closure);
+        return;
+    }
     halide_gcd_job job;
     job.f = f;
     job.closure = closure;
@@ -47,4 +75,40 @@ WEAK void halide_do_par_for(void (*f)(int, uint8_t *), int min, int size, uint8_
     dispatch_apply_f(size, dispatch_get_global_queue(0, 0), &job, &halide_do_gcd_task);
 }
 
+struct halide_gcd_chunked_job {
+    void (*f)(int, uint8_t *);
+    uint8_t *closure;
+    int min, end, grain;
+};
+
+// Run one chunk of grain consecutive tasks
+WEAK void halide_do_gcd_chunk(void *job, size_t idx) {
+    halide_gcd_chunked_job *j = (halide_gcd_chunked_job *)job;
+    int min = j->min + (int)idx * j->grain;
+    int end = min + j->grain;
+    if (end > j->end) end = j->end;
+    for (int x = min; x < end; x++) {
+        halide_do_task(j->f, x, j->closure);
+    }
+}
+
+WEAK void halide_do_par_for_chunked(void (*f)(int, uint8_t *), int min, int size, int grain, uint8_t *closure) {
+    if (halide_custom_thread_pool) {
+        (*halide_custom_thread_pool)(halide_custom_thread_pool_user, f, min, size, grain, closure);
+        return;
+    }
+    if (grain <= 1) {
+        halide_do_par_for(f, min, size, closure);
+        return;
+    }
+    if (size <= 0) return;
+    halide_gcd_chunked_job job;
+    job.f = f;
+    job.closure = closure;
+    job.min = min;
+    job.end = min + size;
+    job.grain = grain;
+    dispatch_apply_f((size + grain - 1) / grain, dispatch_get_global_queue(0, 0), &job, &halide_do_gcd_chunk);
+}
+
 }
@@ -26,24 +26,356 @@ WEAK void halide_set_custom_allocator(void *(*cust_malloc)(size_t), void (*cust_
     halide_custom_free = cust_free;
 }
 
+// Freed blocks are cached in size classes, so that a pipeline that
+// allocates the same buffer once per tile doesn't hit the system
+// allocator every time. Up to 4 KB the classes are powers of two. Above
+// that each power of two is split into four, so that rounding up
+// wastes at most a quarter of a block. Blocks bigger than the largest
+// class go straight to malloc and free.
+#define MIN_SIZE_CLASS 6   // 64 bytes
+#define FINE_SIZE_CLASS 12 // 4 kilobytes
+#define MAX_SIZE_CLASS 22  // 4 megabytes
+#define NUM_COARSE_SIZE_CLASSES (FINE_SIZE_CLASS - MIN_SIZE_CLASS + 1)
+#define NUM_SIZE_CLASSES (NUM_COARSE_SIZE_CLASSES + 4*(MAX_SIZE_CLASS - FINE_SIZE_CLASS))
+#define NO_SIZE_CLASS 0xff
+
+// Caps the memory each shard holds onto per size class. Small
+// classes may cache up to MAX_CACHED_BLOCKS blocks, and large ones at
+// least MIN_CACHED_BLOCKS.
+#define MAX_CACHED_BYTES (1 << 21)
+#define MIN_CACHED_BLOCKS 2
+#define MAX_CACHED_BLOCKS 64
+
+// Caps the memory held onto by all the shards together.
+#define MAX_TOTAL_CACHED_BYTES (1 << 25)
+
+// The caches are split into shards, each with its own lock, and
+// threads are spread across them. We can't use thread-local storage
+// in the runtime, so threads are told apart by where their stack
+// is.
+#define NUM_ALLOCATOR_SHARDS 16
+
+struct halide_allocator_shard {
+    volatile int lock;
+    // Singly-linked free lists, threaded through the first word of
+    // each cached block.
+    void *free_list[NUM_SIZE_CLASSES];
+    int cached[NUM_SIZE_CLASSES];
+    // Keep the locks of neighbouring shards off the same cache line.
+    char padding[64];
+};
+
+WEAK halide_allocator_shard halide_allocator_shards[NUM_ALLOCATOR_SHARDS];
+
+// The bytes currently cached across all shards. Only modified using
+// atomic operations.
+WEAK volatile size_t halide_allocator_cached_bytes = 0;
+
+// The size class for a request of the given size, or NO_SIZE_CLASS
+// if it's too big to cache.
+static inline size_t halide_allocator_size_class(size_t x) {
+    int c = MIN_SIZE_CLASS;
+    while (c <= MAX_SIZE_CLASS && ((size_t)1 << c) < x) c++;
+    if (c > MAX_SIZE_CLASS) return NO_SIZE_CLASS;
+    if (c <= FINE_SIZE_CLASS) return c - MIN_SIZE_CLASS;
+    // x lies in (2^(c-1), 2^c], which is split into four steps.
+    size_t step = (size_t)1 << (c - 3);
+    size_t k = (x - ((size_t)1 << (c - 1)) + step - 1) / step;
+    return NUM_COARSE_SIZE_CLASSES + 4*(c - FINE_SIZE_CLASS - 1) + (k - 1);
+}
+
+// The size of the blocks in a size class.
+static inline size_t halide_allocator_class_bytes(size_t idx) {
+    if (idx < NUM_COARSE_SIZE_CLASSES) return (size_t)1 << (idx + MIN_SIZE_CLASS);
+    idx -= NUM_COARSE_SIZE_CLASSES;
+    int c = FINE_SIZE_CLASS + 1 + (int)(idx / 4);
+    return ((size_t)1 << (c - 1)) + (idx % 4 + 1) * ((size_t)1 << (c - 3));
+}
+
+static inline halide_allocator_shard *halide_allocator_my_shard() {
+    int on_my_stack;
+    // Stacks are at least a megabyte apart, so hash the megabyte my
+    // stack lives in.
+    uint32_t h = (uint32_t)((size_t)&on_my_stack >> 20) * 2654435761u;
+    return halide_allocator_shards + (h >> 28);
+}
+
+static inline void halide_allocator_lock(halide_allocator_shard *s) {
+    while (__sync_lock_test_and_set(&s->lock, 1)) {
+        while (s->lock);
+    }
+}
+
+static inline void halide_allocator_unlock(halide_allocator_shard *s) {
+    __sync_lock_release(&s->lock);
+}
+
+// Layout of a block: the system allocation starts at orig. The
+// pointer we hand out is the first multiple of 32 at least 33 bytes
+// in, so that there's always room for the header just before it. The
+// header holds orig at ptr[-1] and the size class at ptr[-2].
+static inline void *halide_allocator_new_block(size_t size, size_t size_class) {
+    void *orig = malloc(size + 64);
+    if (!orig) return NULL;
+    void *ptr = (void *)((((size_t)orig + 64) >> 5) << 5);
+    ((void **)ptr)[-1] = orig;
+    ((size_t *)ptr)[-2] = size_class;
+    return ptr;
+}
+
+// A caller-provided scratch arena. While one is set, halide_malloc
+// carves blocks off the top of it, and halide_free releases them
+// again. Blocks are only actually reclaimed once every block above
+// them has been freed too, so the arena behaves like a stack. That's
+// a perfect fit for the nested allocations of a serial pipeline. If
+// allocations from parallel tasks interleave, or the arena runs out,
+// the remaining allocations fall back to the heap. Once a
+// realization completes every block has been freed, so the arena is
+// empty again.
+struct halide_arena_header {
+    // The header of the block below this one, or NULL.
+    halide_arena_header *prev;
+    bool freed;
+};
+
+// Each block is a 32-byte header followed by the payload rounded up
+// to a multiple of 32, plus another 32 bytes so vector loads can
+// spill off the end.
+#define ARENA_HEADER_SIZE 32
+
+WEAK uint8_t *halide_arena_base = NULL;
+WEAK uint8_t *halide_arena_end = NULL;
+WEAK uint8_t *halide_arena_top = NULL;
+WEAK halide_arena_header *halide_arena_last = NULL;
+WEAK volatile int halide_arena_lock = 0;
+
+WEAK void halide_set_scratch_arena(void *base, size_t size) {
+    if (base == NULL) size = 0;
+    // Align the start of the arena to 32 bytes
+    uint8_t *start = (uint8_t *)((((size_t)base + 31) >> 5) << 5);
+    uint8_t *end = (uint8_t *)base + size;
+    if (end < start) end = start;
+    halide_arena_base = start;
+    halide_arena_end = end;
+    halide_arena_top = start;
+    halide_arena_last = NULL;
+}
+
+static void *halide_arena_malloc(size_t x) {
+    size_t bytes = ARENA_HEADER_SIZE + (((x + 31) >> 5) << 5) + 32;
+    void *ptr = NULL;
+    while (__sync_lock_test_and_set(&halide_arena_lock, 1)) {
+        while (halide_arena_lock);
+    }
+    if (bytes <= (size_t)(halide_arena_end - halide_arena_top)) {
+        halide_arena_header *h = (halide_arena_header *)halide_arena_top;
+        h->prev = halide_arena_last;
+        h->freed = false;
+        halide_arena_last = h;
+        halide_arena_top += bytes;
+        ptr = (uint8_t *)h + ARENA_HEADER_SIZE;
+    }
+    __sync_lock_release(&halide_arena_lock);
+    return ptr;
+}
+
+static void halide_arena_free(void *ptr) {
+    while (__sync_lock_test_and_set(&halide_arena_lock, 1)) {
+        while (halide_arena_lock);
+    }
+    halide_arena_header *h = (halide_arena_header *)((uint8_t *)ptr - ARENA_HEADER_SIZE);
+    h->freed = true;
+    // Pop everything off the top that's been freed
+    while (halide_arena_last && halide_arena_last->freed) {
+        halide_arena_top = (uint8_t *)halide_arena_last;
+        halide_arena_last = halide_arena_last->prev;
+    }
+    __sync_lock_release(&halide_arena_lock);
+}
+
 WEAK void *halide_malloc(size_t x) {
+    if (halide_arena_base != halide_arena_end) {
+        void *ptr = halide_arena_malloc(x);
+        if (ptr) return ptr;
+    }
+
     if (halide_custom_malloc) {
         return halide_custom_malloc(x);
+    }
+
+    size_t idx = halide_allocator_size_class(x);
+    if (idx == NO_SIZE_CLASS) {
+        return halide_allocator_new_block(x, NO_SIZE_CLASS);
+    }
+
+    halide_allocator_shard *s = halide_allocator_my_shard();
+    size_t bytes = halide_allocator_class_bytes(idx);
+    void *ptr = NULL;
+    halide_allocator_lock(s);
+    if (s->free_list[idx]) {
+        ptr = s->free_list[idx];
+        s->free_list[idx] = *(void **)ptr;
+        s->cached[idx]--;
+    }
+    halide_allocator_unlock(s);
+
+    if (ptr) {
+        __sync_fetch_and_sub(&halide_allocator_cached_bytes, bytes);
     } else {
-        void *orig = malloc(x+32);
-        // Round up to next multiple of 32. Should add at least 8 bytes so we can fit the original pointer.
-        void *ptr = (void *)((((size_t)orig + 32) >> 5) << 5);
-        ((void **)ptr)[-1] = orig;
-        return ptr;
+        ptr = halide_allocator_new_block(bytes, idx);
     }
+    return ptr;
 }
 
 WEAK void halide_free(void *ptr) {
+    if ((uint8_t *)ptr >= halide_arena_base && (uint8_t *)ptr < halide_arena_end) {
+        halide_arena_free(ptr);
+        return;
+    }
+
     if (halide_custom_free) {
         halide_custom_free(ptr);
-    } else {
-        free(((void**)ptr)[-1]);
+        return;
+    }
+
+    size_t idx = ((size_t *)ptr)[-2];
+    if (idx != NO_SIZE_CLASS) {
+        size_t bytes = halide_allocator_class_bytes(idx);
+        // Reserve room under the global cap first, and give it back
+        // if the shard turns out to be full.
+        if (__sync_add_and_fetch(&halide_allocator_cached_bytes, bytes) <= MAX_TOTAL_CACHED_BYTES) {
+            halide_allocator_shard *s = halide_allocator_my_shard();
+            int limit = (int)(MAX_CACHED_BYTES / bytes);
+            if (limit < MIN_CACHED_BLOCKS) limit = MIN_CACHED_BLOCKS;
+            if (limit > MAX_CACHED_BLOCKS) limit = MAX_CACHED_BLOCKS;
+            bool cached = false;
+            halide_allocator_lock(s);
+            if (s->cached[idx] < limit) {
+                *(void **)ptr = s->free_list[idx];
+                s->free_list[idx] = ptr;
+                s->cached[idx]++;
+                cached = true;
+            }
+            halide_allocator_unlock(s);
+            if (cached) return;
+        }
+        __sync_fetch_and_sub(&halide_allocator_cached_bytes, bytes);
+    }
+
+    free(((void**)ptr)[-1]);
+}
+
+// Hand all cached blocks back to the system. Called when a jit
+// compiled module is destroyed, and by Func::release_cached_memory,
+// and safe to call at any other time too.
+WEAK void halide_release_cached_memory() {
+    for (int i = 0; i < NUM_ALLOCATOR_SHARDS; i++) {
+        halide_allocator_shard *s = halide_allocator_shards + i;
+        halide_allocator_lock(s);
+        for (int idx = 0; idx < NUM_SIZE_CLASSES; idx++) {
+            void *ptr = s->free_list[idx];
+            while (ptr) {
+                void *next = *(void **)ptr;
+                free(((void**)ptr)[-1]);
+                ptr = next;
+            }
+            __sync_fetch_and_sub(&halide_allocator_cached_bytes,
+                                 s->cached[idx] * halide_allocator_class_bytes(idx));
+            s->free_list[idx] = NULL;
+            s->cached[idx] = 0;
+        }
+        halide_allocator_unlock(s);
+    }
+}
+
+// Accounting of the memory used by each allocation in a pipeline,
+// for pipelines compiled with HL_TRACK_MEMORY set. The pipeline
+// numbers its allocations from one, tells the runtime their names at
+// the start of each run, and reports every allocation and free of
+// them. Entry zero covers the whole pipeline. Only one tracked run of
+// a pipeline may be in flight at a time.
+#define MAX_TRACKED_ALLOCATIONS 256
+
+struct halide_memory_stats_entry {
+    const char *name;
+    volatile int64_t current;
+    volatile int64_t peak;
+    volatile int64_t count;
+};
+
+WEAK halide_memory_stats_entry halide_memory_stats_table[MAX_TRACKED_ALLOCATIONS];
+WEAK int halide_memory_stats_entries = 0;
+
+static void halide_memory_raise_peak(volatile int64_t *peak, int64_t bytes) {
+    int64_t old = *peak;
+    while (bytes > old && !__sync_bool_compare_and_swap(peak, old, bytes)) {
+        old = *peak;
+    }
+}
+
+// Called at the start of each run. Clears the numbers from the last
+// run.
+WEAK int halide_memory_tracking_start(int num_allocations) {
+    int entries = num_allocations + 1;
+    if (entries > MAX_TRACKED_ALLOCATIONS) entries = MAX_TRACKED_ALLOCATIONS;
+    for (int i = 0; i < MAX_TRACKED_ALLOCATIONS; i++) {
+        halide_memory_stats_entry *e = halide_memory_stats_table + i;
+        e->name = NULL;
+        e->current = e->peak = e->count = 0;
+    }
+    halide_memory_stats_entries = entries;
+    return 0;
+}
+
+// The name must stay valid for as long as the numbers may be queried.
+WEAK int halide_memory_allocation_name(int id, const char *name) {
+    if (id >= 0 && id < MAX_TRACKED_ALLOCATIONS) {
+        halide_memory_stats_table[id].name = name;
+    }
+    return 0;
+}
+
+// Allocations beyond the size of the table still count towards the
+// total.
+WEAK int halide_memory_allocate(int id, int64_t bytes) {
+    halide_memory_stats_entry *total = halide_memory_stats_table;
+    halide_memory_raise_peak(&total->peak, __sync_add_and_fetch(&total->current, bytes));
+    __sync_fetch_and_add(&total->count, 1);
+    if (id > 0 && id < MAX_TRACKED_ALLOCATIONS) {
+        halide_memory_stats_entry *e = halide_memory_stats_table + id;
+        halide_memory_raise_peak(&e->peak, __sync_add_and_fetch(&e->current, bytes));
+        __sync_fetch_and_add(&e->count, 1);
+    }
+    return 0;
+}
+
+WEAK int halide_memory_free(int id, int64_t bytes) {
+    __sync_fetch_and_sub(&halide_memory_stats_table[0].current, bytes);
+    if (id > 0 && id < MAX_TRACKED_ALLOCATIONS) {
+        __sync_fetch_and_sub(&halide_memory_stats_table[id].current, bytes);
     }
+    return 0;
+}
+
+// Get the bytes currently allocated (which = 0), the peak bytes
+// allocated (which = 1), or the number of allocations (which = 2)
+// for an entry.
+WEAK int64_t halide_memory_stat(int id, int which) {
+    if (id < 0 || id >= halide_memory_stats_entries) return 0;
+    halide_memory_stats_entry *e = halide_memory_stats_table + id;
+    return which == 0 ? e->current : which == 1 ? e->peak : e->count;
+}
+
+// Get all the numbers for an entry at once. Returns -1 if there's no
+// such entry.
+WEAK int halide_memory_stats(int id, const char **name, int64_t *current, int64_t *peak, int64_t *count) {
+    if (id < 0 || id >= halide_memory_stats_entries) return -1;
+    halide_memory_stats_entry *e = halide_memory_stats_table + id;
+    *name = e->name;
+    *current = e->current;
+    *peak = e->peak;
+    *count = e->count;
+    return 0;
 }
 
 }
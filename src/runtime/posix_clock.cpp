@@ -14,22 +14,59 @@ struct timeval {
 };
 #endif
 #endif
-    
+
 extern int gettimeofday(timeval *tv, void *);
 
-WEAK timeval halide_reference_clock;
+// OS X and native client don't have a monotonic clock_gettime, so
+// they fall back to gettimeofday.
+#if !defined(__APPLE__) && !defined(__native_client__)
+#define HALIDE_HAS_CLOCK_GETTIME
+
+#ifdef _LP64
+struct halide_timespec {
+    int64_t tv_sec, tv_nsec;
+};
+#else
+struct halide_timespec {
+    int32_t tv_sec, tv_nsec;
+};
+#endif
+
+#define CLOCK_MONOTONIC 1
+extern int clock_gettime(int clk_id, halide_timespec *tp);
+#endif
+
+// Nanoseconds since some arbitrary point in the past. Unlike
+// halide_current_time_ns, this never jumps when a pipeline restarts
+// the clock, so the runtime uses it to measure intervals.
+WEAK int64_t halide_monotonic_ns() {
+    #ifdef HALIDE_HAS_CLOCK_GETTIME
+    halide_timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    #else
+    timeval now;
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000000 + (int64_t)now.tv_usec * 1000;
+    #endif
+}
+
+WEAK int64_t halide_reference_clock = 0;
 
 WEAK int halide_start_clock() {
-    gettimeofday(&halide_reference_clock, NULL);
+    halide_reference_clock = halide_monotonic_ns();
     return 0;
 }
 
+// Nanoseconds since halide_start_clock was last called. For
+// timestamps shown to the user.
+WEAK int64_t halide_current_time_ns() {
+    return halide_monotonic_ns() - halide_reference_clock;
+}
+
+// The same in milliseconds. Only good for about 24 days.
 WEAK int halide_current_time() {
-    timeval now;
-    gettimeofday(&now, NULL);    
-    int delta = (now.tv_sec - halide_reference_clock.tv_sec)*1000;
-    delta += (now.tv_usec - halide_reference_clock.tv_usec)/1000;
-    return delta;
+    return (int)(halide_current_time_ns() / 1000000);
 }
 
 }
@@ -0,0 +1,385 @@
+#include <stdint.h>
+#include <string.h>
+
+// The posix thread pool declares the pthreads functions we need. The
+// other thread pools don't, so get them from the system headers.
+#ifndef HALIDE_POSIX_THREAD_POOL
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#define WEAK __attribute__((weak))
+
+extern "C" {
+
+#ifdef HALIDE_POSIX_THREAD_POOL
+extern int usleep(uint32_t usec);
+#endif
+
+extern int64_t halide_monotonic_ns();
+
+// On linux, the profiler can also count hardware events using
+// perf_event_open, which has no libc wrapper.
+#if defined(__linux__) && !defined(__native_client__)
+#if defined(__x86_64__)
+#define PERF_EVENT_OPEN_SYSCALL 298
+#elif defined(__i386__)
+#define PERF_EVENT_OPEN_SYSCALL 336
+#elif defined(__arm__)
+#define PERF_EVENT_OPEN_SYSCALL 364
+#endif
+#endif
+
+#ifdef PERF_EVENT_OPEN_SYSCALL
+extern long syscall(long number, ...);
+#ifndef HALIDE_POSIX_THREAD_POOL
+#include <unistd.h>
+#else
+extern long read(int fd, void *buf, size_t count);
+extern int close(int fd);
+#endif
+
+// The first 64 bytes of struct perf_event_attr, which is all the
+// kernel requires.
+struct halide_perf_event_attr {
+    uint32_t type, size;
+    uint64_t config;
+    uint64_t sample_period;
+    uint64_t sample_type;
+    uint64_t read_format;
+    uint64_t flags;
+    uint32_t wakeup_events, bp_type;
+    uint64_t config1;
+};
+#endif
+
+// A sampling profiler for pipelines compiled with HL_PROFILE set. The
+// pipeline numbers each produce, update, and consume phase of each
+// Func, and tells the runtime which one it's in by calling
+// halide_profiler_set_current whenever that changes. A separate
+// thread wakes up every so often and charges the time since it last
+// woke up to the current phase of every thread that's busy. We can't
+// use thread-local storage in the runtime. With the posix thread
+// pool, each thread gets the slot of its id in the pool, which the
+// pool keeps as pthreads thread-specific data, so it takes the same
+// time to find however big the pool is. The thread that runs the
+// pipeline gets slot zero. Otherwise, or when parallel loops are
+// handed to a pool outside the runtime, threads are told apart by
+// where their stack is, and two threads that hash to the same slot
+// will confuse the profile.
+//
+// Alternatively (for pipelines compiled with HL_PROFILE=2), there's
+// no sampling thread. Instead each thread reads the clock and its
+// hardware event counters whenever it changes phase, and charges the
+// difference since its last change to the phase it's leaving. Where
+// the counters aren't available, only the time is counted.
+#ifdef HALIDE_POSIX_THREAD_POOL
+#define PROFILER_SLOTS MAX_THREADS
+#else
+#define PROFILER_SLOTS 64
+#endif
+
+// The hardware events counted: cycles, instructions, L1 data cache
+// read misses, last level cache misses, and branch mispredictions.
+#define PROFILER_COUNTERS 5
+
+// What each thread last read, for the counting mode. Indexed by
+// slot. The hardware counters only count for the thread that opened
+// them, so where threads may share a slot (see
+// halide_profiler_my_slot), one thread's events can be charged to
+// another thread's phase.
+struct halide_profiler_thread {
+    int64_t last_time;
+    int64_t last_counts[PROFILER_COUNTERS];
+    // The perf event group leader, or -1 if there are no counters
+    int fd;
+    bool opened;
+    // Where each counter is in a read of the group, or -1 if it
+    // couldn't be opened.
+    int position[PROFILER_COUNTERS];
+    int other_fds[PROFILER_COUNTERS];
+};
+
+struct halide_profiler_state {
+    // The phase each thread is in, or zero for none.
+    volatile int current[PROFILER_SLOTS];
+    // Nanoseconds spent in each phase, summed over all threads. Only
+    // touched by the sampling thread while it's running.
+    int64_t *time;
+    // The hardware events in each phase, PROFILER_COUNTERS per phase
+    int64_t *counts;
+    int num_phases;
+    int sample_us;
+    volatile bool running;
+    bool thread_started;
+    pthread_t thread;
+    bool counting;
+    // Which counters any thread managed to open
+    volatile bool available[PROFILER_COUNTERS];
+    halide_profiler_thread threads[PROFILER_SLOTS];
+};
+
+WEAK halide_profiler_state halide_profiler;
+
+static inline volatile int *halide_profiler_my_slot() {
+    #ifdef HALIDE_POSIX_THREAD_POOL
+    if (!halide_custom_do_par_for && !halide_custom_thread_pool) {
+        return halide_profiler.current + halide_worker_id();
+    }
+    #endif
+    // Hash the megabyte my stack lives in into one of 64 slots.
+    int on_my_stack;
+    uint32_t h = (uint32_t)((size_t)&on_my_stack >> 20) * 2654435761u;
+    return halide_profiler.current + (h >> 26);
+}
+
+static void *halide_profiler_sampler(void *) {
+    int64_t last = halide_monotonic_ns();
+    while (halide_profiler.running) {
+        usleep(halide_profiler.sample_us);
+        int64_t now = halide_monotonic_ns();
+        int64_t elapsed = now - last;
+        last = now;
+        for (int i = 0; i < PROFILER_SLOTS; i++) {
+            int phase = halide_profiler.current[i];
+            if (phase > 0 && phase <= halide_profiler.num_phases) {
+                halide_profiler.time[phase] += elapsed;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Open the calling thread's hardware event counters. They count for
+// this thread only, and only in user mode.
+static void halide_profiler_open_counters(halide_profiler_thread *t) {
+    t->opened = true;
+    t->fd = -1;
+    for (int i = 0; i < PROFILER_COUNTERS; i++) {
+        t->position[i] = -1;
+        t->other_fds[i] = -1;
+    }
+    #ifdef PERF_EVENT_OPEN_SYSCALL
+    // PERF_TYPE_HARDWARE is 0, and PERF_TYPE_HW_CACHE is 3.
+    const uint32_t types[PROFILER_COUNTERS] = {0, 0, 3, 0, 0};
+    // Cycles, instructions, L1D read misses, cache misses, and branch misses
+    const uint64_t configs[PROFILER_COUNTERS] = {0, 1, 0x10000, 3, 5};
+    int position = 0;
+    for (int i = 0; i < PROFILER_COUNTERS; i++) {
+        halide_perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = types[i];
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        // PERF_FORMAT_GROUP
+        attr.read_format = 1 << 3;
+        // exclude_kernel and exclude_hv
+        attr.flags = (1 << 5) | (1 << 6);
+        int fd = (int)syscall(PERF_EVENT_OPEN_SYSCALL, &attr, 0, -1, t->fd, 0);
+        if (fd < 0) {
+            // Without a leader there's no group to read
+            if (t->fd < 0) return;
+            continue;
+        }
+        if (t->fd < 0) {
+            t->fd = fd;
+        } else {
+            t->other_fds[i] = fd;
+        }
+        t->position[i] = position++;
+        halide_profiler.available[i] = true;
+    }
+    #endif
+}
+
+static void halide_profiler_close_counters(halide_profiler_thread *t) {
+    #ifdef PERF_EVENT_OPEN_SYSCALL
+    if (t->opened && t->fd >= 0) {
+        for (int i = 0; i < PROFILER_COUNTERS; i++) {
+            if (t->other_fds[i] >= 0) close(t->other_fds[i]);
+        }
+        close(t->fd);
+    }
+    #endif
+    t->opened = false;
+}
+
+// Read the calling thread's counters. Returns false if it has none.
+static bool halide_profiler_read_counters(halide_profiler_thread *t, int64_t *counts) {
+    if (!t->opened) halide_profiler_open_counters(t);
+    #ifdef PERF_EVENT_OPEN_SYSCALL
+    if (t->fd >= 0) {
+        // The number of counters, followed by their values
+        uint64_t values[PROFILER_COUNTERS + 1];
+        if (read(t->fd, values, sizeof(values)) > 0) {
+            for (int i = 0; i < PROFILER_COUNTERS; i++) {
+                int p = t->position[i];
+                counts[i] = p >= 0 ? (int64_t)values[p + 1] : 0;
+            }
+            return true;
+        }
+    }
+    #endif
+    return false;
+}
+
+// Charge the calling thread's time and events since it last changed
+// phase to the phase it's leaving.
+static void halide_profiler_count(int slot, int phase) {
+    halide_profiler_thread *t = halide_profiler.threads + slot;
+    int64_t now = halide_monotonic_ns();
+    int64_t counts[PROFILER_COUNTERS];
+    bool have_counts = halide_profiler_read_counters(t, counts);
+    if (phase > 0 && phase <= halide_profiler.num_phases && t->last_time) {
+        __sync_fetch_and_add(halide_profiler.time + phase, now - t->last_time);
+        if (have_counts) {
+            int64_t *phase_counts = halide_profiler.counts + phase * PROFILER_COUNTERS;
+            for (int i = 0; i < PROFILER_COUNTERS; i++) {
+                __sync_fetch_and_add(phase_counts + i, counts[i] - t->last_counts[i]);
+            }
+        }
+    }
+    t->last_time = now;
+    if (have_counts) {
+        for (int i = 0; i < PROFILER_COUNTERS; i++) {
+            t->last_counts[i] = counts[i];
+        }
+    }
+}
+
+// Stop the sampling thread, if there is one. Called at the end of
+// each profiled pipeline, and when a jit compiled module is
+// destroyed, in case a pipeline bailed out early.
+WEAK void halide_profiler_shutdown() {
+    if (halide_profiler.counting) {
+        halide_profiler.counting = false;
+        for (int i = 0; i < PROFILER_SLOTS; i++) {
+            halide_profiler_close_counters(halide_profiler.threads + i);
+        }
+    }
+    if (!halide_profiler.thread_started) return;
+    halide_profiler.running = false;
+    void *retval;
+    pthread_join(halide_profiler.thread, &retval);
+    halide_profiler.thread_started = false;
+}
+
+// Zero the profile and the hardware event counts.
+static int halide_profiler_reset(int num_phases) {
+    halide_profiler_shutdown();
+
+    if (!halide_profiler.time || halide_profiler.num_phases < num_phases) {
+        free(halide_profiler.time);
+        free(halide_profiler.counts);
+        halide_profiler.time = (int64_t *)malloc(sizeof(int64_t) * (num_phases + 1));
+        halide_profiler.counts = (int64_t *)malloc(sizeof(int64_t) * (num_phases + 1) * PROFILER_COUNTERS);
+        if (!halide_profiler.time || !halide_profiler.counts) {
+            free(halide_profiler.time);
+            free(halide_profiler.counts);
+            halide_profiler.time = NULL;
+            halide_profiler.counts = NULL;
+            halide_profiler.num_phases = 0;
+            return -1;
+        }
+    }
+    halide_profiler.num_phases = num_phases;
+    for (int i = 0; i <= num_phases; i++) {
+        halide_profiler.time[i] = 0;
+    }
+    for (int i = 0; i < (num_phases + 1) * PROFILER_COUNTERS; i++) {
+        halide_profiler.counts[i] = 0;
+    }
+    for (int i = 0; i < PROFILER_SLOTS; i++) {
+        halide_profiler.current[i] = 0;
+        halide_profiler.threads[i].last_time = 0;
+    }
+    for (int i = 0; i < PROFILER_COUNTERS; i++) {
+        halide_profiler.available[i] = false;
+    }
+    return 0;
+}
+
+// Zero the profile and start sampling. Only one profiled pipeline may
+// run at a time.
+WEAK int halide_profiler_pipeline_start(int num_phases) {
+    if (halide_profiler_reset(num_phases)) return -1;
+
+    if (!halide_profiler.sample_us) {
+        char *sample_str = getenv("HL_PROFILE_SAMPLE_US");
+        halide_profiler.sample_us = sample_str ? atoi(sample_str) : 100;
+        if (halide_profiler.sample_us <= 0) halide_profiler.sample_us = 100;
+    }
+
+    halide_profiler.running = true;
+    if (pthread_create(&halide_profiler.thread, NULL, halide_profiler_sampler, NULL)) {
+        halide_profiler.running = false;
+        return -1;
+    }
+    halide_profiler.thread_started = true;
+    return 0;
+}
+
+// Zero the profile and start counting instead of sampling.
+WEAK int halide_profiler_counters_start(int num_phases) {
+    if (halide_profiler_reset(num_phases)) return -1;
+    halide_profiler.counting = true;
+    return 0;
+}
+
+// Stop sampling or counting. The profile stays around for
+// halide_profiler_time_ns and halide_profiler_counter to read.
+WEAK int halide_profiler_pipeline_end() {
+    if (halide_profiler.counting) {
+        // Charge the last phase of the calling thread
+        volatile int *slot = halide_profiler_my_slot();
+        halide_profiler_count((int)(slot - halide_profiler.current), *slot);
+        *slot = 0;
+    }
+    halide_profiler_shutdown();
+    return 0;
+}
+
+// Mark the calling thread as being in the given phase. Zero means the
+// thread is idle.
+WEAK int halide_profiler_set_current(int phase) {
+    volatile int *slot = halide_profiler_my_slot();
+    if (halide_profiler.counting) {
+        halide_profiler_count((int)(slot - halide_profiler.current), *slot);
+    }
+    *slot = phase;
+    return 0;
+}
+
+// Nanoseconds spent in the given phase over the last profiled
+// pipeline, summed over all threads. Phase zero gives the total over
+// all phases.
+WEAK int64_t halide_profiler_time_ns(int phase) {
+    if (!halide_profiler.time || phase < 0 || phase > halide_profiler.num_phases) return 0;
+    if (phase > 0) return halide_profiler.time[phase];
+    int64_t total = 0;
+    for (int i = 1; i <= halide_profiler.num_phases; i++) {
+        total += halide_profiler.time[i];
+    }
+    return total;
+}
+
+// The number of the given hardware event over the last profiled
+// pipeline in the given phase, summed over all threads. Phase zero
+// gives the total over all phases. Returns -1 if the event couldn't be
+// counted. The events are numbered in the order cycles, instructions,
+// L1 data cache read misses, last level cache misses, and branch
+// mispredictions.
+WEAK int64_t halide_profiler_counter(int phase, int counter) {
+    if (!halide_profiler.counts || counter < 0 || counter >= PROFILER_COUNTERS ||
+        !halide_profiler.available[counter]) return -1;
+    if (phase < 0 || phase > halide_profiler.num_phases) return 0;
+    if (phase > 0) return halide_profiler.counts[phase * PROFILER_COUNTERS + counter];
+    int64_t total = 0;
+    for (int i = 1; i <= halide_profiler.num_phases; i++) {
+        total += halide_profiler.counts[i * PROFILER_COUNTERS + counter];
+    }
+    return total;
+}
+
+}
@@ -9,6 +9,9 @@ typedef uint32_t size_t;
 #endif
 #define WEAK __attribute__((weak))
 
+// Lets the profiler know the pthreads functions are already declared
+#define HALIDE_POSIX_THREAD_POOL
+
 extern "C" {
 
 typedef struct {
@@ -22,71 +25,209 @@ typedef struct {
 typedef long pthread_t;
 typedef struct {
     // 48 bytes is enough for a cond on 64-bit and 32-bit systems
-    unsigned char _private[48]; 
+    unsigned char _private[48];
 } pthread_cond_t;
 typedef long pthread_condattr_t;
 typedef struct {
     // 40 bytes is enough for a mutex on 64-bit and 32-bit systems
-    unsigned char _private[40]; 
+    unsigned char _private[40];
 } pthread_mutex_t;
 typedef long pthread_mutexattr_t;
+typedef unsigned int pthread_key_t;
 extern int pthread_create(pthread_t *thread, pthread_attr_t const * attr,
                           void *(*start_routine)(void *), void * arg);
 extern int pthread_join(pthread_t thread, void **retval);
+extern pthread_t pthread_self();
 extern int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
 extern int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 extern int pthread_cond_broadcast(pthread_cond_t *cond);
+extern int pthread_cond_signal(pthread_cond_t *cond);
 extern int pthread_cond_destroy(pthread_cond_t *cond);
 extern int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
 extern int pthread_mutex_lock(pthread_mutex_t *mutex);
 extern int pthread_mutex_unlock(pthread_mutex_t *mutex);
 extern int pthread_mutex_destroy(pthread_mutex_t *mutex);
+extern int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
+extern int pthread_key_delete(pthread_key_t key);
+extern void *pthread_getspecific(pthread_key_t key);
+extern int pthread_setspecific(pthread_key_t key, const void *value);
+extern int sched_yield();
 
 extern char *getenv(const char *);
 extern int atoi(const char *);
+extern void *malloc(size_t);
+extern void free(void *);
 
-extern int halide_printf(const char *, ...);
+extern int sched_getaffinity(int pid, size_t cpusetsize, void *mask);
+extern int sched_setaffinity(int pid, size_t cpusetsize, const void *mask);
+extern int open(const char *pathname, int flags, ...);
+extern long read(int fd, void *buf, size_t count);
+extern int close(int fd);
 
 #ifndef NULL
 #define NULL 0
 #endif
 
+#define CACHE_LINE_SIZE 64
+// The size of the cpu masks we hand to sched_{get,set}affinity, in
+// 64-bit words. Matches glibc's cpu_set_t.
+#define CPU_MASK_WORDS 16
+#define MAX_CPUS (CPU_MASK_WORDS * 64)
+// A sanity limit on the size of the pool. Every job puts one cache
+// line per thread on the stack of the thread that launched it, so
+// this keeps that under 16 KB.
+#define MAX_THREADS 256
+
+// The tasks of a job are dealt out as contiguous ranges, one per
+// thread. A thread claims tasks from the front of its own range, and
+// when that runs dry it steals the back half of some other thread's
+// range. Each range has its own tiny spin lock, so claiming a task
+// never touches the work queue mutex. Ranges are padded out to a
+// cache line so that threads working through their own ranges don't
+// fight over the same line.
+struct work_range {
+    volatile int lock;
+    int next, end;
+    char padding[CACHE_LINE_SIZE - 3*sizeof(int)];
+};
+
 struct work {
     work *next_job;
+
+    // The job whose task was running on the pool thread that pushed
+    // this one, or NULL if it was pushed from outside the pool.
+    work *parent;
+
     void (*f)(int, uint8_t *);
-    int next, max;
     uint8_t *closure;
-    int active_workers;
 
-    bool running() { return next < max || active_workers > 0; }
+    // How many consecutive tasks a thread claims at once.
+    int grain;
+
+    // When this job was pushed, relative to the other jobs. See
+    // halide_work_queue.jobs_pushed.
+    uint32_t seq;
+
+    // The number of tasks that no thread has claimed yet. Only
+    // modified using atomic operations.
+    volatile int unclaimed;
+
+    // The number of threads currently claiming or running tasks from
+    // this job. Only modified while holding the work queue mutex, but
+    // the owner polls it without the lock while spinning.
+    volatile int active_workers;
+
+    // One range per thread in the pool. Lives on the stack of the
+    // thread that called do_par_for.
+    work_range *ranges;
+
+    bool running() { return unclaimed > 0 || active_workers > 0; }
 };
 
 // The work queue and thread pool is weak, so one big work queue is shared by all halide functions
-#define MAX_THREADS 64
 WEAK struct {
-    // all fields are protected by this mutex.
+    // The job stack and the active_workers counts of the jobs on it
+    // are protected by this mutex. Claiming individual tasks is not.
     pthread_mutex_t mutex;
 
-    // Singly linked list for job stack
-    work *jobs;
-
-    // Broadcast whenever items are added to the queue or a job completes.
-    pthread_cond_t state_change;
-    // Keep track of threads so they can be joined at shutdown
-    pthread_t threads[MAX_THREADS];
-
-    // Global flag indicating 
-    bool shutdown;
-
-    bool running() { 
-        return !shutdown; 
-    }    
+    // Singly linked list for job stack. Only jobs with unclaimed
+    // tasks are on the stack. Idle workers poll this without the
+    // lock while spinning.
+    work *volatile jobs;
+
+    // Idle worker threads park on this. It is signaled once per
+    // worker needed when a job is pushed, and broadcast at shutdown.
+    pthread_cond_t wakeup_workers;
+    // The number of worker threads parked on wakeup_workers.
+    int sleeping_workers;
+
+    // Threads that called do_par_for park on this while the last
+    // tasks of their job finish. Broadcast whenever a job completes,
+    // and when a job is pushed that parked owners could help with.
+    pthread_cond_t wakeup_owners;
+    // The number of job owners parked on wakeup_owners.
+    int sleeping_owners;
+
+    // Counts the jobs ever pushed. Used to number the jobs, and
+    // polled without the lock by spinning owners to notice new ones.
+    volatile uint32_t jobs_pushed;
+
+    // Keep track of threads so they can be joined at shutdown. Has
+    // halide_threads-1 entries.
+    pthread_t *threads;
+
+    // Global flag indicating
+    volatile bool shutdown;
+
+    bool running() {
+        return !shutdown;
+    }
 
 } halide_work_queue;
 
+// The number of threads in the pool, including the thread that calls
+// do_par_for.
 WEAK int halide_threads;
 WEAK bool halide_thread_pool_initialized = false;
 
+// Guards starting up the pool, and resizing or restarting it, against
+// each other and against parallel loops in flight.
+WEAK volatile int halide_thread_pool_lock = 0;
+
+// The number of calls to do_par_for using the pool that haven't
+// returned yet, including nested ones. The pool can only be restarted
+// while this is zero. Incremented while holding
+// halide_thread_pool_lock, and decremented atomically.
+WEAK volatile int halide_loops_in_flight = 0;
+
+// The pool size requested with halide_set_num_threads. Zero means
+// use HL_NUMTHREADS if it's set, or else one thread per cpu we're
+// allowed to run on.
+WEAK int halide_requested_threads = 0;
+
+// How long in microseconds an idle thread spins (and then yields)
+// waiting for new work before it parks on a condition variable. Zero
+// means park right away. Negative means not yet set, in which case
+// it's read from HL_SPIN_US when the pool starts up.
+WEAK int halide_spin_us = -1;
+
+WEAK void halide_set_spin_us(int us) {
+    halide_spin_us = us;
+}
+
+// Worker thread placement. With no affinity, workers float freely. In
+// compact mode, worker i is pinned to the i'th cpu we're allowed to
+// run on, ordered by NUMA node, so the pool packs onto as few nodes
+// as possible. In scatter mode, consecutive workers are dealt
+// round-robin across the nodes. Negative means not yet set, in which
+// case it's read from HL_AFFINITY (none, compact, or scatter) when the
+// pool starts up.
+enum {
+    halide_affinity_none = 0,
+    halide_affinity_compact = 1,
+    halide_affinity_scatter = 2
+};
+WEAK int halide_affinity_mode = -1;
+
+// The NUMA node each thread id is pinned to. The thread that calls
+// do_par_for from outside the pool (id 0) is never pinned, and is
+// assumed to live on the first node used.
+WEAK int *halide_thread_node;
+// The cpu each worker thread id is pinned to, or -1 if it isn't.
+WEAK int *halide_thread_cpu;
+// The order in which the contiguous ranges of a job are dealt out to
+// thread ids. Grouped by node, so that neighbouring tasks run on the
+// same node.
+WEAK int *halide_range_order;
+// The job whose tasks each thread id is running right now, if
+// any. Only kept for worker threads, because the threads outside the
+// pool all share id 0.
+WEAK work **halide_thread_job;
+// Each worker thread's id, stored as thread-specific data so that
+// looking it up doesn't depend on the size of the pool. Threads
+// outside the pool have no value, which reads as id 0.
+WEAK pthread_key_t halide_worker_id_key;
+
 WEAK void halide_shutdown_thread_pool() {
     if (!halide_thread_pool_initialized) return;
 
@@ -94,7 +235,7 @@ WEAK void halide_shutdown_thread_pool() {
     // to go home
     pthread_mutex_lock(&halide_work_queue.mutex);
     halide_work_queue.shutdown = true;
-    pthread_cond_broadcast(&halide_work_queue.state_change);
+    pthread_cond_broadcast(&halide_work_queue.wakeup_workers);
     pthread_mutex_unlock(&halide_work_queue.mutex);
 
     // Wait until they leave
@@ -107,8 +248,59 @@ WEAK void halide_shutdown_thread_pool() {
     //fprintf(stderr, "All threads have quit. Destroying mutex and condition variable.\n");
     // Tidy up
     pthread_mutex_destroy(&halide_work_queue.mutex);
-    pthread_cond_destroy(&halide_work_queue.state_change);
+    pthread_cond_destroy(&halide_work_queue.wakeup_workers);
+    pthread_cond_destroy(&halide_work_queue.wakeup_owners);
+    free(halide_work_queue.threads);
+    free(halide_thread_node);
+    free(halide_thread_job);
+    halide_work_queue.threads = NULL;
+    halide_thread_job = NULL;
+    halide_thread_node = halide_thread_cpu = halide_range_order = NULL;
     halide_thread_pool_initialized = false;
+    pthread_key_delete(halide_worker_id_key);
+}
+
+static inline void halide_spin_lock(volatile int *lock) {
+    while (__sync_lock_test_and_set(lock, 1)) {
+        // Spin on a plain read so that we don't hammer the cache
+        // line with atomic operations while someone else holds it. If
+        // the holder got descheduled, get out of its way.
+        for (int spins = 0; *lock; spins++) {
+            if (spins > 1000) sched_yield();
+        }
+    }
+}
+
+static inline void halide_spin_unlock(volatile int *lock) {
+    __sync_lock_release(lock);
+}
+
+// Shut down the pool so that it restarts with new settings on the
+// next parallel loop. Fails and returns false if any parallel loops
+// are running.
+static bool halide_restart_thread_pool() {
+    halide_spin_lock(&halide_thread_pool_lock);
+    bool idle = halide_loops_in_flight == 0;
+    if (idle) {
+        halide_shutdown_thread_pool();
+    }
+    halide_spin_unlock(&halide_thread_pool_lock);
+    return idle;
+}
+
+// Resize the pool. Zero or less goes back to the default size. The
+// pool is shut down and restarts at the new size on the next parallel
+// loop. Returns the previous requested size, or -1 without changing
+// anything if parallel loops are running.
+WEAK int halide_set_num_threads(int n) {
+    if (n < 0) n = 0;
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    int old = halide_requested_threads;
+    if (n != old) {
+        if (!halide_restart_thread_pool()) return -1;
+        halide_requested_threads = n;
+    }
+    return old;
 }
 
 WEAK void (*halide_custom_do_task)(void (*)(int, uint8_t *), int, uint8_t *);
@@ -121,6 +313,30 @@ WEAK void halide_set_custom_do_par_for(void (*f)(void (*)(int, uint8_t *), int,
     halide_custom_do_par_for = f;
 }
 
+// A thread pool that lives outside of the runtime, e.g. one owned by
+// the application. If set, parallel loops are handed to it along with
+// the user pointer, unless a custom do_par_for is also set.
+WEAK void (*halide_custom_thread_pool)(void *, void (*)(int, uint8_t *), int, int, int, uint8_t *);
+WEAK void *halide_custom_thread_pool_user;
+WEAK void halide_set_custom_thread_pool(void (*f)(void *, void (*)(int, uint8_t *), int, int, int, uint8_t *), void *user) {
+    halide_custom_thread_pool = f;
+    halide_custom_thread_pool_user = user;
+}
+
+// Change how worker threads are placed. The pool is shut down and
+// restarts with the new placement on the next parallel loop. Returns
+// 0, or -1 without changing anything if parallel loops are running.
+WEAK int halide_set_thread_affinity(int mode) {
+    if (mode != halide_affinity_compact && mode != halide_affinity_scatter) {
+        mode = halide_affinity_none;
+    }
+    if (mode != halide_affinity_mode) {
+        if (!halide_restart_thread_pool()) return -1;
+        halide_affinity_mode = mode;
+    }
+    return 0;
+}
+
 WEAK void halide_do_task(void (*f)(int, uint8_t *), int idx, uint8_t *closure) {
     if (halide_custom_do_task) {
         (*halide_custom_do_task)(f, idx, closure);
@@ -129,8 +345,134 @@ WEAK void halide_do_task(void (*f)(int, uint8_t *), int idx, uint8_t *closure) {
     }
 }
 
-WEAK void *halide_worker_thread(void *void_arg) {
-    work *owned_job = (work *)void_arg;
+// Which range of a job the calling thread should claim tasks
+// from. Worker thread i uses range i+1. Any thread outside of the
+// pool uses range 0. Such threads only ever work on the job they own,
+// so no two threads ever share a range of the same job.
+WEAK int halide_worker_id() {
+    if (!halide_thread_pool_initialized) return 0;
+    return (int)(size_t)pthread_getspecific(halide_worker_id_key);
+}
+
+// Claim the next chunk of up to grain tasks from the front of my own
+// range. The claimed tasks are [*idx, *idx + *count).
+static bool halide_claim_task(work *job, int id, int *idx, int *count) {
+    work_range *r = job->ranges + id;
+    // Cheap unlocked check, because nobody else ever adds tasks to my range.
+    if (r->next >= r->end) return false;
+    int claimed = 0;
+    halide_spin_lock(&r->lock);
+    if (r->next < r->end) {
+        *idx = r->next;
+        claimed = r->end - r->next;
+        if (claimed > job->grain) claimed = job->grain;
+        r->next += claimed;
+    }
+    halide_spin_unlock(&r->lock);
+    if (claimed) {
+        *count = claimed;
+        __sync_fetch_and_sub(&job->unclaimed, claimed);
+    }
+    return claimed > 0;
+}
+
+// My range is empty. Steal the back half of someone else's range,
+// keep the first chunk of it for myself, and make the rest my new
+// range so that others can steal from me in turn. Threads on my own
+// NUMA node are robbed first.
+static bool halide_steal_task(work *job, int id, int *idx, int *count) {
+    for (int i = 1; i < 2*halide_threads; i++) {
+        int victim = id + i;
+        while (victim >= halide_threads) victim -= halide_threads;
+        bool same_node = halide_thread_node[victim] == halide_thread_node[id];
+        if (same_node != (i < halide_threads)) continue;
+        work_range *r = job->ranges + victim;
+        if (r->next >= r->end) continue;
+
+        int min = 0, max = 0;
+        halide_spin_lock(&r->lock);
+        int remaining = r->end - r->next;
+        if (remaining > 0) {
+            max = r->end;
+            min = max - (remaining + 1)/2;
+            r->end = min;
+        }
+        halide_spin_unlock(&r->lock);
+
+        if (max > min) {
+            int claimed = max - min;
+            if (claimed > job->grain) claimed = job->grain;
+            work_range *mine = job->ranges + id;
+            halide_spin_lock(&mine->lock);
+            mine->next = min + claimed;
+            mine->end = max;
+            halide_spin_unlock(&mine->lock);
+            *idx = min;
+            *count = claimed;
+            __sync_fetch_and_sub(&job->unclaimed, claimed);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Is job a newer than job b? Written to survive wraparound.
+static inline bool halide_job_newer(work *a, work *b) {
+    return (int32_t)(a->seq - b->seq) > 0;
+}
+
+// Was job a pushed from within a task of job b, or from within a task
+// of one of b's descendants? The ancestors of a job on the stack are
+// all still running, because they're waiting on its tasks.
+static inline bool halide_job_descends_from(work *a, work *b) {
+    for (work *p = a->parent; p; p = p->parent) {
+        if (p == b) return true;
+    }
+    return false;
+}
+
+// Take a job off the job stack, if it's still there. Must hold the
+// work queue mutex.
+static void halide_remove_job(work *job) {
+    work *volatile *ptr = &halide_work_queue.jobs;
+    while (*ptr) {
+        if (*ptr == job) {
+            *ptr = job->next_job;
+            return;
+        }
+        ptr = &((*ptr)->next_job);
+    }
+}
+
+// Spin without holding the lock until there might be something for
+// this thread to do, or until halide_spin_us microseconds have
+// passed. Spins on a plain read for a while, then yields between
+// polls so that we don't starve a thread we're waiting on.
+static void halide_spin_wait(work *owned_job, int id) {
+    int64_t start = halide_monotonic_ns();
+    uint32_t jobs_pushed = halide_work_queue.jobs_pushed;
+    for (int spins = 0; ; spins++) {
+        if (owned_job != NULL) {
+            if (!owned_job->running()) return;
+            // Pool threads waiting on their own job can also help
+            // with new jobs.
+            if (id > 0 && halide_work_queue.jobs_pushed != jobs_pushed) return;
+        } else if (halide_work_queue.jobs != NULL || halide_work_queue.shutdown) {
+            return;
+        }
+        // Reading the clock isn't free, so only check it every so often
+        // while spinning hard.
+        if (spins >= 1000 || (spins & 63) == 63) {
+            int64_t elapsed = halide_monotonic_ns() - start;
+            if (elapsed >= (int64_t)halide_spin_us * 1000) return;
+            if (spins >= 1000) sched_yield();
+        }
+    }
+}
+
+WEAK void halide_worker_thread_loop(work *owned_job, int id) {
+    // Whether we've already spun since we last did something useful.
+    bool spun = false;
 
     // Grab the lock
     pthread_mutex_lock(&halide_work_queue.mutex);
@@ -142,103 +484,434 @@ WEAK void *halide_worker_thread(void *void_arg) {
     while (owned_job != NULL ? owned_job->running()
            : halide_work_queue.running()) {
 
-        if (halide_work_queue.jobs == NULL) {
-            // There are no jobs pending, though some tasks may still
-            // be in flight from the last job. Release the lock and
-            // wait for something new to happen.
-            pthread_cond_wait(&halide_work_queue.state_change, &halide_work_queue.mutex);
+        // Worker threads take the most recently pushed job that
+        // still has tasks to claim. Job owners work on their own job.
+        work *job = owned_job;
+        if (!job) {
+            job = halide_work_queue.jobs;
+            while (job && job->unclaimed == 0) job = job->next_job;
+        } else if (job->unclaimed == 0 && id > 0) {
+            // All the tasks of my job have been claimed, but some are
+            // still running. I'm a pool thread that called do_par_for
+            // from within a task, so rather than sit idle I can help
+            // with the parallel loops nested inside the tasks of my
+            // job that are still running, which gets my own job done
+            // sooner. Any other job is off limits, even a newer
+            // one. Its tasks could take arbitrarily long, and I'd be
+            // buried under one when my job finishes. Descendants are
+            // always newer, so we can stop at the first older
+            // job. Threads outside of the pool all share range 0, so
+            // they only ever work on their own job.
+            for (work *j = halide_work_queue.jobs;
+                 j && halide_job_newer(j, owned_job); j = j->next_job) {
+                if (j->unclaimed > 0 && halide_job_descends_from(j, owned_job)) {
+                    job = j;
+                    break;
+                }
+            }
+        }
+
+        if (job == NULL || job->unclaimed == 0) {
+            // There are no tasks pending, though some may still be
+            // in flight. Release the lock and wait for something new
+            // to happen. Waking up from a condition variable is slow,
+            // so spin for a little while first.
+            if (!spun && halide_spin_us > 0) {
+                spun = true;
+                pthread_mutex_unlock(&halide_work_queue.mutex);
+                halide_spin_wait(owned_job, id);
+                pthread_mutex_lock(&halide_work_queue.mutex);
+            } else if (owned_job != NULL) {
+                spun = false;
+                halide_work_queue.sleeping_owners++;
+                pthread_cond_wait(&halide_work_queue.wakeup_owners, &halide_work_queue.mutex);
+                halide_work_queue.sleeping_owners--;
+            } else {
+                spun = false;
+                halide_work_queue.sleeping_workers++;
+                pthread_cond_wait(&halide_work_queue.wakeup_workers, &halide_work_queue.mutex);
+                halide_work_queue.sleeping_workers--;
+            }
         } else {
-            // There are jobs still to do. Grab the next one.
-            work *job = halide_work_queue.jobs;
-
-            // Claim a task from it.
-            work myjob = *job;
-            job->next++;
-
-            // If there were no more tasks pending for this job,
-            // remove it from the stack.
-            if (job->next == job->max) {
-                halide_work_queue.jobs = job->next_job;
-            } 
-
-            // Increment the active_worker count so that other threads
-            // are aware that this job is still in progress even
-            // though there are no outstanding tasks for it.
-            job->active_workers++;
+            spun = false;
 
-            // Release the lock and do the task.
+            // Register as a worker on this job so that it stays alive
+            // while we're claiming tasks from it, then release the
+            // lock and keep claiming and running tasks until there's
+            // nothing left to claim or steal.
+            job->active_workers++;
             pthread_mutex_unlock(&halide_work_queue.mutex);
-            halide_do_task(myjob.f, myjob.next, myjob.closure);
+
+            // Note which job we're running tasks of, so that any
+            // parallel loops they launch know their parent.
+            work *outer_job = NULL;
+            if (id > 0) {
+                outer_job = halide_thread_job[id];
+                halide_thread_job[id] = job;
+            }
+
+            int idx, count;
+            while (halide_claim_task(job, id, &idx, &count) ||
+                   halide_steal_task(job, id, &idx, &count)) {
+                for (int i = idx; i < idx + count; i++) {
+                    halide_do_task(job->f, i, job->closure);
+                }
+            }
+
+            if (id > 0) {
+                halide_thread_job[id] = outer_job;
+            }
+
             pthread_mutex_lock(&halide_work_queue.mutex);
-            
+
             // We are no longer active on this job
             job->active_workers--;
 
+            // If every task has been claimed, take the job off the
+            // stack so that idle workers stop looking at it.
+            if (job->unclaimed == 0) {
+                halide_remove_job(job);
+            }
+
             // If the job is done and I'm not the owner of it, wake up
             // the owner.
             if (!job->running() && job != owned_job) {
-                pthread_cond_broadcast(&halide_work_queue.state_change);
+                pthread_cond_broadcast(&halide_work_queue.wakeup_owners);
             }
-        }        
+        }
     }
     pthread_mutex_unlock(&halide_work_queue.mutex);
+}
+
+WEAK void *halide_worker_thread(void *void_arg) {
+    int id = (int)(size_t)void_arg;
+    #ifndef __native_client__
+    int cpu = halide_thread_cpu[id];
+    if (cpu >= 0) {
+        uint64_t mask[CPU_MASK_WORDS] = {0};
+        mask[cpu / 64] = (uint64_t)1 << (cpu % 64);
+        // On linux, pid zero means the calling thread.
+        sched_setaffinity(0, sizeof(mask), mask);
+    }
+    #endif
+    pthread_setspecific(halide_worker_id_key, void_arg);
+    halide_worker_thread_loop(NULL, id);
     return NULL;
 }
 
-WEAK void halide_do_par_for(void (*f)(int, uint8_t *), int min, int size, uint8_t *closure) {
+// Parse a cpu list like "0-3,8-11" as found in sysfs, and mark those
+// cpus in the mask.
+static void halide_parse_cpu_list(const char *str, uint64_t *mask) {
+    while (*str) {
+        if (*str < '0' || *str > '9') {
+            str++;
+            continue;
+        }
+        int first = 0, last;
+        while (*str >= '0' && *str <= '9') first = first*10 + (*str++ - '0');
+        last = first;
+        if (*str == '-') {
+            str++;
+            last = 0;
+            while (*str >= '0' && *str <= '9') last = last*10 + (*str++ - '0');
+        }
+        for (int c = first; c <= last && c < MAX_CPUS; c++) {
+            mask[c / 64] |= (uint64_t)1 << (c % 64);
+        }
+    }
+}
+
+// Read a list like the above out of a file, and mark its entries in
+// the mask. Returns false if the file can't be read.
+static bool halide_read_list_file(const char *path, uint64_t *mask) {
+    int fd = open(path, 0);
+    if (fd < 0) return false;
+    char buf[1024];
+    long bytes = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (bytes < 0) return false;
+    buf[bytes] = 0;
+    halide_parse_cpu_list(buf, mask);
+    return true;
+}
+
+// Read the cpus belonging to a NUMA node out of sysfs. Returns false
+// if there's no such node.
+static bool halide_read_node_cpus(int node, uint64_t *mask) {
+    char path[64] = "/sys/devices/system/node/node";
+    char *p = path;
+    while (*p) p++;
+    char digits[16];
+    int n = 0;
+    do {
+        digits[n++] = '0' + node % 10;
+        node /= 10;
+    } while (node);
+    while (n) *p++ = digits[--n];
+    const char *suffix = "/cpulist";
+    while (*suffix) *p++ = *suffix++;
+    *p = 0;
+    return halide_read_list_file(path, mask);
+}
+
+// The default size of the pool: one thread per cpu this process is
+// allowed to run on.
+static int halide_default_num_threads() {
+    #ifndef __native_client__
+    uint64_t allowed[CPU_MASK_WORDS] = {0};
+    if (sched_getaffinity(0, sizeof(allowed), allowed) != 0) {
+        // Fall back to counting the online cpus.
+        halide_read_list_file("/sys/devices/system/cpu/online", allowed);
+    }
+    int count = 0;
+    for (int w = 0; w < CPU_MASK_WORDS; w++) {
+        count += __builtin_popcountll(allowed[w]);
+    }
+    if (count > 0) return count;
+    #endif
+
+    #ifdef _LP64
+    // On 64-bit systems we use 8 threads if we can't tell
+    return 8;
+    #else
+    // On 32-bit systems we use 2 threads if we can't tell
+    return 2;
+    #endif
+}
+
+// Work out which cpu and node each thread id should use, and the
+// order in which to deal out ranges. Must be called after
+// halide_threads is set and before the workers are launched.
+static void halide_init_affinity() {
+    for (int i = 0; i < halide_threads; i++) {
+        halide_thread_node[i] = 0;
+        halide_thread_cpu[i] = -1;
+        halide_range_order[i] = i;
+    }
+
+    if (halide_affinity_mode < 0) {
+        halide_affinity_mode = halide_affinity_none;
+        char *affinityStr = getenv("HL_AFFINITY");
+        if (affinityStr) {
+            if (affinityStr[0] == 'c') {
+                halide_affinity_mode = halide_affinity_compact;
+            } else if (affinityStr[0] == 's') {
+                halide_affinity_mode = halide_affinity_scatter;
+            }
+        }
+    }
+    if (halide_affinity_mode != halide_affinity_compact &&
+        halide_affinity_mode != halide_affinity_scatter) {
+        return;
+    }
+
+    #ifndef __native_client__
+    // Only use the cpus this process is allowed to run on.
+    uint64_t allowed[CPU_MASK_WORDS] = {0};
+    if (sched_getaffinity(0, sizeof(allowed), allowed) != 0) return;
+
+    // Group the allowed cpus by node. Node numbers may have gaps, so
+    // go by the list of nodes that are online. If there's no NUMA
+    // information, treat the whole machine as one node.
+    static int cpus[MAX_CPUS], cpu_node[MAX_CPUS];
+    int num_cpus = 0, num_nodes = 0;
+    uint64_t online_nodes[CPU_MASK_WORDS] = {0};
+    halide_read_list_file("/sys/devices/system/node/online", online_nodes);
+    for (int node = 0; node < MAX_CPUS; node++) {
+        if (!(online_nodes[node / 64] & ((uint64_t)1 << (node % 64)))) continue;
+        uint64_t mask[CPU_MASK_WORDS] = {0};
+        if (!halide_read_node_cpus(node, mask)) continue;
+        for (int w = 0; w < CPU_MASK_WORDS; w++) {
+            uint64_t bits = mask[w] & allowed[w];
+            allowed[w] &= ~bits;
+            for (int b = 0; b < 64; b++) {
+                if (bits & ((uint64_t)1 << b)) {
+                    cpus[num_cpus] = w*64 + b;
+                    cpu_node[num_cpus] = num_nodes;
+                    num_cpus++;
+                }
+            }
+        }
+        num_nodes++;
+    }
+    // Anything left over wasn't listed under any node.
+    for (int w = 0; w < CPU_MASK_WORDS; w++) {
+        for (int b = 0; b < 64; b++) {
+            if (allowed[w] & ((uint64_t)1 << b)) {
+                cpus[num_cpus] = w*64 + b;
+                cpu_node[num_cpus] = num_nodes;
+                num_cpus++;
+            }
+        }
+    }
+    if (num_cpus == 0) return;
+
+    // Pick the order in which to hand out the cpus. Compact order is
+    // the order we found them in, which is grouped by node. Scatter
+    // order takes one cpu from each node in turn.
+    static int order[MAX_CPUS];
+    if (halide_affinity_mode == halide_affinity_compact) {
+        for (int i = 0; i < num_cpus; i++) order[i] = i;
+    } else {
+        int n = 0;
+        for (int round = 0; n < num_cpus; round++) {
+            for (int node = 0; node <= num_nodes; node++) {
+                // Find the round'th cpu on this node
+                int seen = 0;
+                for (int i = 0; i < num_cpus; i++) {
+                    if (cpu_node[i] != node) continue;
+                    if (seen++ == round) {
+                        order[n++] = i;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Thread id 0 is the caller of do_par_for, which we don't pin, but
+    // leave the first cpu free for it. Worker i gets the i'th cpu.
+    for (int i = 0; i < halide_threads; i++) {
+        int c = order[i % num_cpus];
+        halide_thread_node[i] = cpu_node[c];
+        if (i > 0) halide_thread_cpu[i] = cpus[c];
+    }
+
+    // Deal ranges to threads grouped by node, so that adjacent
+    // ranges of tasks land on the same node.
+    int n = 0;
+    for (int node = 0; node <= num_nodes; node++) {
+        for (int i = 0; i < halide_threads; i++) {
+            if (halide_thread_node[i] == node) halide_range_order[n++] = i;
+        }
+    }
+    #endif
+}
+
+WEAK void halide_do_par_for_chunked(void (*f)(int, uint8_t *), int min, int size, int grain, uint8_t *closure) {
     if (halide_custom_do_par_for) {
         (*halide_custom_do_par_for)(f, min, size, closure);
         return;
     }
+    if (halide_custom_thread_pool) {
+        (*halide_custom_thread_pool)(halide_custom_thread_pool_user, f, min, size, grain, closure);
+        return;
+    }
+    if (size <= 0) return;
+
+    halide_spin_lock(&halide_thread_pool_lock);
     if (!halide_thread_pool_initialized) {
         halide_work_queue.shutdown = false;
         pthread_mutex_init(&halide_work_queue.mutex, NULL);
-        pthread_cond_init(&halide_work_queue.state_change, NULL);
+        pthread_cond_init(&halide_work_queue.wakeup_workers, NULL);
+        pthread_cond_init(&halide_work_queue.wakeup_owners, NULL);
         halide_work_queue.jobs = NULL;
+        halide_work_queue.sleeping_workers = 0;
+        halide_work_queue.sleeping_owners = 0;
+        halide_work_queue.jobs_pushed = 0;
+
+        if (halide_spin_us < 0) {
+            char *spinStr = getenv("HL_SPIN_US");
+            halide_spin_us = spinStr ? atoi(spinStr) : 50;
+            if (halide_spin_us < 0) halide_spin_us = 0;
+        }
 
-        char *threadStr = getenv("HL_NUMTHREADS");
-        #ifdef _LP64
-        // On 64-bit systems we use 8 threads by default
-        halide_threads = 8;
-        #else
-        // On 32-bit systems we use 2 threads by default
-        halide_threads = 2;
-        #endif
-        if (threadStr) {
-            halide_threads = atoi(threadStr);
-        } else {
-            halide_printf("HL_NUMTHREADS not defined. Defaulting to %d threads.\n", halide_threads);
+        halide_threads = halide_requested_threads;
+        if (halide_threads == 0) {
+            char *threadStr = getenv("HL_NUMTHREADS");
+            halide_threads = threadStr ? atoi(threadStr) : halide_default_num_threads();
         }
         if (halide_threads > MAX_THREADS) {
             halide_threads = MAX_THREADS;
+        } else if (halide_threads < 1) {
+            halide_threads = 1;
         }
+
+        halide_work_queue.threads = (pthread_t *)malloc(sizeof(pthread_t) * halide_threads);
+        int *per_thread = (int *)malloc(sizeof(int) * 3 * halide_threads);
+        halide_thread_node = per_thread;
+        halide_thread_cpu = per_thread + halide_threads;
+        halide_range_order = per_thread + 2*halide_threads;
+        halide_thread_job = (work **)malloc(sizeof(work *) * halide_threads);
+        for (int i = 0; i < halide_threads; i++) {
+            halide_thread_job[i] = NULL;
+        }
+        halide_init_affinity();
+        pthread_key_create(&halide_worker_id_key, NULL);
+
         for (int i = 0; i < halide_threads-1; i++) {
             //fprintf(stderr, "Creating thread %d\n", i);
-            pthread_create(halide_work_queue.threads + i, NULL, halide_worker_thread, NULL);
+            pthread_create(halide_work_queue.threads + i, NULL, halide_worker_thread, (void *)(size_t)(i+1));
         }
 
         halide_thread_pool_initialized = true;
     }
+    halide_loops_in_flight++;
+    halide_spin_unlock(&halide_thread_pool_lock);
 
     // Make the job.
-    work job; 
+    work job;
     job.f = f;               // The job should call this function. It takes an index and a closure.
-    job.next = min;          // Start at this index.
-    job.max  = min + size;   // Keep going until one less than this index.
     job.closure = closure;   // Use this closure.
+    job.grain = grain < 1 ? 1 : grain; // Claim this many tasks at a time.
+    job.unclaimed = size;
     job.active_workers = 0;
 
+    // If I'm a worker thread calling do_par_for from within a task, I
+    // use my own range, otherwise I use range 0.
+    int id = halide_worker_id();
+    job.parent = id > 0 ? halide_thread_job[id] : NULL;
+
+    // Get some stack space for the ranges, aligned to a cache line.
+    char *ranges = (char *)__builtin_alloca(sizeof(work_range) * (halide_threads + 1));
+    job.ranges = (work_range *)(((size_t)ranges + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+
+    // Deal the tasks out as evenly as possible, one contiguous range
+    // per thread.
+    for (int i = 0; i < halide_threads; i++) {
+        work_range *r = job.ranges + halide_range_order[i];
+        r->lock = 0;
+        r->next = min + (int)(((int64_t)size * i) / halide_threads);
+        r->end = min + (int)(((int64_t)size * (i+1)) / halide_threads);
+    }
+
     // Push the job onto the stack.
     pthread_mutex_lock(&halide_work_queue.mutex);
     job.next_job = halide_work_queue.jobs;
+    job.seq = halide_work_queue.jobs_pushed++;
     halide_work_queue.jobs = &job;
+
+    // Wake up only as many parked workers as there are chunks of
+    // work for them, not counting the one I'm about to take
+    // myself. Any workers that are still spinning will notice the new
+    // job on their own. If that's not enough, parked owners waiting
+    // on the tail end of older jobs may be able to help too.
+    int helpers = (int)(((int64_t)size + job.grain - 1) / job.grain) - 1;
+    if (helpers > halide_work_queue.sleeping_workers) {
+        if (halide_work_queue.sleeping_owners > 0) {
+            pthread_cond_broadcast(&halide_work_queue.wakeup_owners);
+        }
+        helpers = halide_work_queue.sleeping_workers;
+    }
+    for (int i = 0; i < helpers; i++) {
+        pthread_cond_signal(&halide_work_queue.wakeup_workers);
+    }
     pthread_mutex_unlock(&halide_work_queue.mutex);
-    
-    // Wake up any idle worker threads.
-    pthread_cond_broadcast(&halide_work_queue.state_change);
 
     // Do some work myself.
-    halide_worker_thread((void *)(&job));    
+    halide_worker_thread_loop(&job, id);
+
+    // The job is complete, so it was taken off the stack by whoever
+    // claimed its last task, but make sure before it goes out of scope.
+    pthread_mutex_lock(&halide_work_queue.mutex);
+    halide_remove_job(&job);
+    pthread_mutex_unlock(&halide_work_queue.mutex);
+
+    __sync_fetch_and_sub(&halide_loops_in_flight, 1);
+}
+
+WEAK void halide_do_par_for(void (*f)(int, uint8_t *), int min, int size, uint8_t *closure) {
+    halide_do_par_for_chunked(f, min, size, 1, closure);
 }
 
 }
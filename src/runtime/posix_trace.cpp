@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../trace_event.h"
+
+// The posix thread pool declares the pthreads functions we need. The
+// other thread pools don't, so get them from the system headers.
+#ifndef HALIDE_POSIX_THREAD_POOL
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#define WEAK __attribute__((weak))
+
+extern "C" {
+
+#ifdef HALIDE_POSIX_THREAD_POOL
+extern int usleep(uint32_t usec);
+#endif
+
+extern int64_t halide_monotonic_ns();
+
+// A binary trace sink for pipelines compiled with HL_TRACE_FILE
+// set. Each thread appends fixed-size records to its own ring buffer
+// without taking any locks, and a background thread drains the rings
+// to the trace file. Each pipeline gets a file of its own, named by
+// inserting the pipeline's name before the extension of HL_TRACE_FILE
+// (halide.trace by default), so that tracing one pipeline never
+// clobbers another's trace.
+//
+// Threads are numbered exactly. The workers of the posix thread pool
+// use their id in the pool. Every other thread is numbered after the
+// workers, in the order it first traced an event, and keeps its
+// number as pthreads thread-specific data. Both take the same time to
+// look up however many threads there are. Only once more than
+// TRACE_OTHER_THREADS threads outside the pool have traced do they
+// share a number, and a ring. That's still safe, because slots in a
+// ring are reserved atomically.
+#ifdef HALIDE_POSIX_THREAD_POOL
+#define TRACE_WORKERS MAX_THREADS
+#else
+#define TRACE_WORKERS 0
+#endif
+#define TRACE_OTHER_THREADS 64
+#define TRACE_RINGS (TRACE_WORKERS + TRACE_OTHER_THREADS)
+#define TRACE_RING_SIZE 4096
+
+struct halide_trace_ring {
+    // The index of the next record to hand out
+    volatile uint32_t head;
+    // The index of the next record to write out. Only the writer
+    // thread changes it.
+    volatile uint32_t tail;
+    // Set to one more than the index of the record in each entry once
+    // it has been filled in.
+    volatile uint32_t ready[TRACE_RING_SIZE];
+    halide_trace_record_t records[TRACE_RING_SIZE];
+};
+
+struct halide_trace_state {
+    halide_trace_ring *volatile rings[TRACE_RINGS];
+    // How many threads outside the pool have been numbered
+    volatile int num_other_threads;
+    // Holds one more than the number of each thread outside the pool
+    pthread_key_t thread_key;
+    bool key_created;
+    FILE *file;
+    volatile bool running;
+    bool thread_started;
+    pthread_t thread;
+};
+
+WEAK halide_trace_state halide_trace_sink;
+
+static int halide_trace_thread_id() {
+    #ifdef HALIDE_POSIX_THREAD_POOL
+    int worker = halide_worker_id();
+    if (worker > 0) return worker;
+    #endif
+    size_t id = (size_t)pthread_getspecific(halide_trace_sink.thread_key);
+    if (id) return (int)id - 1;
+    // We haven't seen this thread before, so give it the next number,
+    // or the last ring if we've run out.
+    int n = __sync_fetch_and_add(&halide_trace_sink.num_other_threads, 1);
+    id = n < TRACE_OTHER_THREADS ? TRACE_WORKERS + n : TRACE_RINGS - 1;
+    pthread_setspecific(halide_trace_sink.thread_key, (void *)(id + 1));
+    return (int)id;
+}
+
+static halide_trace_ring *halide_trace_my_ring(int *id) {
+    *id = halide_trace_thread_id();
+    halide_trace_ring *ring = halide_trace_sink.rings[*id];
+    if (!ring) {
+        ring = (halide_trace_ring *)malloc(sizeof(halide_trace_ring));
+        if (!ring) return NULL;
+        memset(ring, 0, sizeof(halide_trace_ring));
+        if (!__sync_bool_compare_and_swap(&halide_trace_sink.rings[*id], NULL, ring)) {
+            // Another thread that shares this ring beat us to it
+            free(ring);
+            ring = halide_trace_sink.rings[*id];
+        }
+    }
+    return ring;
+}
+
+// Write out every record that's ready. Returns the number of records
+// written.
+static int halide_trace_drain() {
+    int written = 0;
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        halide_trace_ring *ring = halide_trace_sink.rings[i];
+        if (!ring) continue;
+        uint32_t tail = ring->tail;
+        while (ring->ready[tail % TRACE_RING_SIZE] == tail + 1) {
+            halide_trace_record_t r = ring->records[tail % TRACE_RING_SIZE];
+            if (r.event == HALIDE_TRACE_FUNC_NAME) {
+                // The coordinates hold a pointer to the name
+                const char *name;
+                memcpy(&name, r.coords, sizeof(name));
+                size_t len = strlen(name);
+                memset(r.coords, 0, sizeof(r.coords));
+                r.coords[0] = (int32_t)len;
+                fwrite(&r, sizeof(r), 1, halide_trace_sink.file);
+                char padding[sizeof(halide_trace_record_t)];
+                memset(padding, 0, sizeof(padding));
+                fwrite(name, 1, len, halide_trace_sink.file);
+                fwrite(padding, 1, (sizeof(r) - len % sizeof(r)) % sizeof(r), halide_trace_sink.file);
+            } else {
+                fwrite(&r, sizeof(r), 1, halide_trace_sink.file);
+            }
+            tail++;
+            written++;
+        }
+        // Make sure we're done reading the records before letting the
+        // producers reuse them.
+        __sync_synchronize();
+        ring->tail = tail;
+    }
+    return written;
+}
+
+static void *halide_trace_writer(void *) {
+    while (halide_trace_sink.running) {
+        if (!halide_trace_drain()) {
+            usleep(1000);
+        }
+    }
+    // One last pass for anything written since we last looked
+    halide_trace_drain();
+    fflush(halide_trace_sink.file);
+    return NULL;
+}
+
+// Open the pipeline's trace file if need be, and start the writer
+// thread. Called at the start of each traced pipeline. Only one traced
+// pipeline may run at a time.
+WEAK int halide_trace_start(const char *pipeline_name) {
+    if (halide_trace_sink.thread_started) return 0;
+
+    if (!halide_trace_sink.file) {
+        const char *filename = getenv("HL_TRACE_FILE");
+        if (!filename || !filename[0]) filename = "halide.trace";
+        // Put the pipeline name before the extension, if the last
+        // component of the path has one, or else at the end.
+        const char *ext = strrchr(filename, '.');
+        const char *slash = strrchr(filename, '/');
+        if (!ext || (slash && ext < slash)) ext = filename + strlen(filename);
+        size_t stem_len = ext - filename, name_len = strlen(pipeline_name);
+        char *path = (char *)malloc(stem_len + name_len + strlen(ext) + 2);
+        if (!path) return -1;
+        memcpy(path, filename, stem_len);
+        path[stem_len] = '.';
+        memcpy(path + stem_len + 1, pipeline_name, name_len);
+        strcpy(path + stem_len + 1 + name_len, ext);
+        halide_trace_sink.file = fopen(path, "wb");
+        free(path);
+        if (!halide_trace_sink.file) return -1;
+        fwrite(HALIDE_TRACE_MAGIC, 1, 8, halide_trace_sink.file);
+    }
+
+    if (!halide_trace_sink.key_created) {
+        if (pthread_key_create(&halide_trace_sink.thread_key, NULL)) return -1;
+        halide_trace_sink.key_created = true;
+    }
+
+    halide_trace_sink.running = true;
+    if (pthread_create(&halide_trace_sink.thread, NULL, halide_trace_writer, NULL)) {
+        halide_trace_sink.running = false;
+        return -1;
+    }
+    halide_trace_sink.thread_started = true;
+    return 0;
+}
+
+// Wait for the writer to drain every ring, and stop it. Called at the
+// end of each traced pipeline, so the file is complete whenever no
+// pipeline is running.
+WEAK int halide_trace_end() {
+    if (!halide_trace_sink.thread_started) return 0;
+    halide_trace_sink.running = false;
+    void *retval;
+    pthread_join(halide_trace_sink.thread, &retval);
+    halide_trace_sink.thread_started = false;
+    return 0;
+}
+
+// Stop the writer and close the file. Called when a jit compiled
+// module is destroyed.
+WEAK void halide_trace_shutdown() {
+    halide_trace_end();
+    if (halide_trace_sink.file) {
+        fclose(halide_trace_sink.file);
+        halide_trace_sink.file = NULL;
+    }
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        free(halide_trace_sink.rings[i]);
+        halide_trace_sink.rings[i] = NULL;
+    }
+    if (halide_trace_sink.key_created) {
+        pthread_key_delete(halide_trace_sink.thread_key);
+        halide_trace_sink.key_created = false;
+    }
+    halide_trace_sink.num_other_threads = 0;
+}
+
+static halide_trace_record_t *halide_trace_begin_record(halide_trace_ring **ring, uint32_t *idx) {
+    int id;
+    *ring = halide_trace_my_ring(&id);
+    if (!*ring) return NULL;
+    *idx = __sync_fetch_and_add(&(*ring)->head, 1);
+    // If the ring is full, wait for the writer to catch up
+    while (*idx - (*ring)->tail >= TRACE_RING_SIZE) {
+        usleep(100);
+    }
+    halide_trace_record_t *r = (*ring)->records + (*idx % TRACE_RING_SIZE);
+    r->thread = (uint16_t)id;
+    r->time_ns = halide_monotonic_ns();
+    return r;
+}
+
+static void halide_trace_end_record(halide_trace_ring *ring, uint32_t idx) {
+    // The writer must see the contents of the record before it sees
+    // that it's ready.
+    __sync_synchronize();
+    ring->ready[idx % TRACE_RING_SIZE] = idx + 1;
+}
+
+WEAK int halide_trace(int event, int func, int dimensions, int c0, int c1, int c2, int c3) {
+    halide_trace_ring *ring;
+    uint32_t idx;
+    halide_trace_record_t *r = halide_trace_begin_record(&ring, &idx);
+    if (!r) return -1;
+    r->func = func;
+    r->event = (uint8_t)event;
+    r->dimensions = (uint8_t)dimensions;
+    r->coords[0] = c0;
+    r->coords[1] = c1;
+    r->coords[2] = c2;
+    r->coords[3] = c3;
+    halide_trace_end_record(ring, idx);
+    return 0;
+}
+
+// Records the name of a function ID. The name must stay valid until
+// the pipeline finishes.
+WEAK int halide_trace_func_name(int func, const char *name) {
+    halide_trace_ring *ring;
+    uint32_t idx;
+    halide_trace_record_t *r = halide_trace_begin_record(&ring, &idx);
+    if (!r) return -1;
+    r->func = func;
+    r->event = HALIDE_TRACE_FUNC_NAME;
+    r->dimensions = 0;
+    memcpy(r->coords, &name, sizeof(name));
+    halide_trace_end_record(ring, idx);
+    return 0;
+}
+
+}
@@ -5,4 +5,6 @@
 #include "android_io.cpp"
 #include "posix_math.cpp"
 #include "posix_thread_pool.cpp"
+#include "posix_profiler.cpp"
+#include "posix_trace.cpp"
 #include "copy_to_host_noop.cpp"
@@ -25,6 +25,8 @@
 #include "posix_thread_pool.cpp"
 #endif
 #endif
+#include "posix_profiler.cpp"
+#include "posix_trace.cpp"
 
 #include <OpenCL/cl.h>
 
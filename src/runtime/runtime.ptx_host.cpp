@@ -24,6 +24,8 @@
 #include "posix_thread_pool.cpp"
 #endif
 #endif
+#include "posix_profiler.cpp"
+#include "posix_trace.cpp"
 
 #define WEAK __attribute__((weak))
 
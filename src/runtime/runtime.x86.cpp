@@ -13,4 +13,6 @@
 #include "posix_thread_pool.cpp"
 #endif
 #endif
+#include "posix_profiler.cpp"
+#include "posix_trace.cpp"
 #include "copy_to_host_noop.cpp"
@@ -0,0 +1,73 @@
+#ifndef HALIDE_TRACE_EVENT_H
+#define HALIDE_TRACE_EVENT_H
+
+#include <stdint.h>
+
+/** \file
+ * Defines the layout of the binary trace files written by pipelines
+ * compiled with HL_TRACE and HL_TRACE_FILE set. Shared by the
+ * compiler, the runtime, and the decoder (bin/decode_trace).
+ */
+
+/** A trace file starts with these eight bytes, followed by a stream of
+ * records. Each pipeline writes its own file, named by inserting the
+ * pipeline's name before the extension of HL_TRACE_FILE. */
+#define HALIDE_TRACE_MAGIC "HLTRACE2"
+
+/** The kinds of event in a trace. */
+// @{
+/** Gives the name of a function ID. The name follows the record,
+ * padded with zeros to a multiple of the record size. coords[0] is
+ * the length of the name. */
+#define HALIDE_TRACE_FUNC_NAME 0
+/** A function is about to be realized over a region. The first
+ * record holds the min of each dimension, and the second the extent
+ * of each dimension. */
+#define HALIDE_TRACE_REALIZE_MIN 1
+#define HALIDE_TRACE_REALIZE_EXTENT 2
+/** A thread entered a phase of a function. Each phase lasts until
+ * the next one starts, and the consume phase lasts until
+ * HALIDE_TRACE_END_CONSUME. */
+#define HALIDE_TRACE_PRODUCE 3
+#define HALIDE_TRACE_UPDATE 4
+#define HALIDE_TRACE_CONSUME 5
+/** A value of a function was computed at the given coordinates */
+#define HALIDE_TRACE_PROVIDE 6
+/** A pipeline started or finished running. func is the ID of its
+ * output */
+#define HALIDE_TRACE_BEGIN_PIPELINE 7
+#define HALIDE_TRACE_END_PIPELINE 8
+/** A thread finished consuming a function */
+#define HALIDE_TRACE_END_CONSUME 9
+/** A thread started or finished one iteration of a parallel
+ * loop. func is the ID of the name of the loop variable, and
+ * coords[0] is the iteration. */
+#define HALIDE_TRACE_BEGIN_TASK 10
+#define HALIDE_TRACE_END_TASK 11
+// @}
+
+/** A single 32-byte trace record. Records from different threads are
+ * interleaved in the file in the order they were written out, which
+ * is not necessarily the order of their timestamps. */
+typedef struct halide_trace_record_t {
+    /** Nanoseconds on the runtime's monotonic clock */
+    int64_t time_ns;
+    /** The function the event concerns, as numbered by the
+     * HALIDE_TRACE_FUNC_NAME records */
+    int32_t func;
+    /** One of the HALIDE_TRACE_* event kinds */
+    uint8_t event;
+    /** How many of the coordinates are meaningful. Events of
+     * functions with more than four dimensions only record the first
+     * four coordinates. */
+    uint8_t dimensions;
+    /** Which thread the event came from. The runtime's worker threads
+     * are numbered from one by their place in its thread pool, and
+     * other threads after them in the order they first traced an
+     * event. Threads only share a number if there are more than 64
+     * threads outside the pool. */
+    uint16_t thread;
+    int32_t coords[4];
+} halide_trace_record_t;
+
+#endif
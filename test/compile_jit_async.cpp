@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+void check(Image<int> im) {
+    for (int y = 0; y < im.height(); y++) {
+        for (int x = 0; x < im.width(); x++) {
+            int correct = x * 3 + y;
+            if (im(x, y) != correct) {
+                printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), correct);
+                exit(-1);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    Var x, y, xi, yi;
+
+    // The fast version, which takes a while to compile
+    Func f;
+    f(x, y) = x * 3 + y;
+    f.tile(x, y, xi, yi, 8, 8).vectorize(xi, 4).unroll(yi, 2).parallel(y);
+
+    // A simple version to run in the meantime
+    Func slow;
+    slow(x, y) = x * 3 + y;
+
+    f.compile_jit_async(slow);
+
+    // Whichever version gets used, the results should be right
+    int realizations = 0;
+    while (!f.is_jit_compiled()) {
+        Image<int> im = f.realize(64, 64);
+        check(im);
+        realizations++;
+    }
+    printf("Realized the fallback %d times\n", realizations);
+
+    Image<int> im = f.realize(64, 64);
+    check(im);
+
+    // Without a fallback, realizing waits for the compilation
+    Func g;
+    g(x, y) = x * 3 + y;
+    g.vectorize(x, 8);
+    g.compile_jit_async();
+    im = g.realize(64, 64);
+    check(im);
+    if (!g.is_jit_compiled()) {
+        printf("g should have been compiled by now\n");
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
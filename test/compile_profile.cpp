@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    setenv("HL_COMPILE_PROFILE", "1", 1);
+
+    // An inlined stencil, whose expression shares subexpressions many
+    // times over.
+    Var x, y;
+    Func f[8];
+    f[0](x, y) = x + y;
+    for (int i = 1; i < 8; i++) {
+        f[i](x, y) = f[i-1](x-1, y) + f[i-1](x, y) + f[i-1](x+1, y);
+    }
+
+    // Capture what's printed to stderr while it compiles and runs
+    fflush(stderr);
+    FILE *tmp = tmpfile();
+    int saved = dup(2);
+    dup2(fileno(tmp), 2);
+    Image<int> im = f[7].realize(16, 16);
+    fflush(stderr);
+    dup2(saved, 2);
+    close(saved);
+
+    std::string profile;
+    rewind(tmp);
+    char line[1024];
+    while (fgets(line, sizeof(line), tmp)) {
+        profile += line;
+    }
+    fclose(tmp);
+
+    // Each stage of compilation prints a profile that ends in a total
+    const char *stages[] = {"Compile profile of lowering ",
+                            "Compile profile of code generation for ",
+                            "Compile profile of jit compilation of "};
+    for (int i = 0; i < 3; i++) {
+        size_t start = profile.find(stages[i]);
+        if (start == std::string::npos) {
+            printf("No profile starting with \"%s\":\n%s", stages[i], profile.c_str());
+            return -1;
+        }
+        size_t total = profile.find("    total:", start);
+        size_t next = profile.find("Compile profile of ", start + 1);
+        if (total == std::string::npos || (next != std::string::npos && total > next)) {
+            printf("The profile starting with \"%s\" has no total:\n%s", stages[i], profile.c_str());
+            return -1;
+        }
+    }
+    if (profile.find(" IR nodes\n") == std::string::npos) {
+        printf("No pass reported the size of its IR:\n%s", profile.c_str());
+        return -1;
+    }
+
+    // f[7](x, y) sums f[0] over x-7 to x+7 with trinomial weights,
+    // which add up to 3^7.
+    for (int y = 0; y < 16; y++) {
+        for (int x = 0; x < 16; x++) {
+            int correct = 2187 * (x + y);
+            if (im(x, y) != correct) {
+                printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), correct);
+                return -1;
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+// Two allocators that tag their blocks, so that we can tell if one
+// of them is handed the other's memory.
+int mallocs[2] = {0, 0}, frees[2] = {0, 0}, wrong_frees = 0;
+
+void *tagged_malloc(int which, size_t x) {
+    __sync_fetch_and_add(&mallocs[which], 1);
+    void *orig = malloc(x+64);
+    void *ptr = (void *)((((size_t)orig + 64) >> 5) << 5);
+    ((void **)ptr)[-1] = orig;
+    ((int *)ptr)[-3] = which;
+    return ptr;
+}
+
+void tagged_free(int which, void *ptr) {
+    __sync_fetch_and_add(&frees[which], 1);
+    if (((int *)ptr)[-3] != which) {
+        __sync_fetch_and_add(&wrong_frees, 1);
+    }
+    free(((void **)ptr)[-1]);
+}
+
+void *malloc_0(size_t x) {return tagged_malloc(0, x);}
+void *malloc_1(size_t x) {return tagged_malloc(1, x);}
+void free_0(void *ptr) {tagged_free(0, ptr);}
+void free_1(void *ptr) {tagged_free(1, ptr);}
+
+// Two Funcs built the same way, which would share a compiled module
+// if the jit cache were on.
+Func make_pipeline() {
+    Var x, y;
+    Func f, g;
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) + f(x+1, y);
+    f.compute_root();
+    return g;
+}
+
+int main(int argc, char **argv) {
+    Func g0 = make_pipeline(), g1 = make_pipeline();
+    g0.set_custom_allocator(malloc_0, free_0);
+    g1.set_custom_allocator(malloc_1, free_1);
+
+    Image<int> im0(1000, 200), im1(1000, 200);
+    for (int i = 0; i < 20; i++) {
+        AsyncRealization r0 = g0.realize_async(im0);
+        AsyncRealization r1 = g1.realize_async(im1);
+        r0.wait();
+        r1.wait();
+    }
+
+    if (wrong_frees) {
+        printf("%d blocks were freed by the wrong allocator\n", wrong_frees);
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (mallocs[i] == 0 || mallocs[i] != frees[i]) {
+            printf("Allocator %d: %d mallocs and %d frees\n", i, mallocs[i], frees[i]);
+            return -1;
+        }
+    }
+
+    for (int y = 0; y < 200; y++) {
+        for (int x = 0; x < 1000; x++) {
+            int correct = 2*x + 2*y + 1;
+            if (im0(x, y) != correct || im1(x, y) != correct) {
+                printf("im(%d, %d) = %d %d instead of %d\n", x, y, im0(x, y), im1(x, y), correct);
+                return -1;
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int mallocs = 0;
+
+void *my_malloc(size_t x) {
+    mallocs++;
+    void *orig = malloc(x+32);
+    void *ptr = (void *)((((size_t)orig + 32) >> 5) << 5);
+    ((void **)ptr)[-1] = orig;
+    return ptr;
+}
+
+void my_free(void *ptr) {
+    free(((void**)ptr)[-1]);
+}
+
+int main(int argc, char **argv) {
+    Var x, y;
+    Func f, g;
+
+    // Each row of f is too large to go on the stack, and is computed
+    // once per row of g.
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) + f(x+1, y);
+    f.compute_at(g, y);
+
+    g.set_custom_allocator(my_malloc, my_free);
+    Image<int> im = g.realize(10000, 20);
+
+    // The allocation of f should have been moved out of the loop over
+    // y, so there's only one of it.
+    if (mallocs != 1) {
+        printf("Expected 1 call to malloc instead of %d\n", mallocs);
+        return -1;
+    }
+
+    for (int y = 0; y < 20; y++) {
+        for (int x = 0; x < 10000; x++) {
+            if (im(x, y) != 2*x + 2*y + 1) {
+                printf("im(%d, %d) = %d\n", x, y, im(x, y));
+                return -1;
+            }
+        }
+    }
+
+    // Vectorized loops define vector lets, which can't be bounded, in
+    // the loop the allocation is hoisted out of.
+    {
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x, y) + f(x+1, y);
+        f.compute_at(g, y);
+        g.vectorize(x, 4);
+
+        Image<int> im = g.realize(100, 20);
+        for (int y = 0; y < 20; y++) {
+            for (int x = 0; x < 100; x++) {
+                if (im(x, y) != 2*x + 2*y + 1) {
+                    printf("im(%d, %d) = %d\n", x, y, im(x, y));
+                    return -1;
+                }
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
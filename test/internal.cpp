@@ -7,8 +7,14 @@
 #include "Bounds.h"
 #include "Lower.h"
 #include "IRMatch.h"
+#include "IREquality.h"
 #include "Deinterleave.h"
 #include "ModulusRemainder.h"
+#include "HoistAllocations.h"
+#include "ReuseAllocations.h"
+#include "JITCache.h"
+#include "CSE.h"
+#include "CompileProfiling.h"
 
 using namespace Halide;
 using namespace Halide::Internal;
@@ -21,6 +27,7 @@ int main(int argc, const char **argv) {
     #endif
     
     CodeGen_C::test();
+    expr_cache_test();
     simplify_test();
     bounds_test();
     lower_test();
@@ -28,5 +35,10 @@ int main(int argc, const char **argv) {
     expr_match_test();
     deinterleave_vector_test();
     modulus_remainder_test();
+    hoist_allocations_test();
+    reuse_allocations_test();
+    jit_cache_test();
+    cse_test();
+    compile_profiling_test();
     return 0;
 }
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+// Build, compile, and check the same pipeline, using a new Func each
+// time.
+void check_pipeline() {
+    Var x, y;
+    Func f, g;
+    f(x, y) = x * y + 3;
+    g(x, y) = f(x, y) + f(x+1, y) * 2;
+    f.compute_root();
+
+    Image<int> im = g.realize(32, 32);
+    for (int y = 0; y < 32; y++) {
+        for (int x = 0; x < 32; x++) {
+            int correct = (x * y + 3) + ((x + 1) * y + 3) * 2;
+            if (im(x, y) != correct) {
+                printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), correct);
+                exit(-1);
+            }
+        }
+    }
+}
+
+// Find the one file in the directory with the given extension, and
+// get its inode number. A pipeline that's stored again is written to
+// a new file and renamed into place, so it gets a new inode. Returns
+// false if there isn't exactly one such file.
+bool find_file(const std::string &dir, const std::string &ext, std::string *path, ino_t *inode) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) return false;
+    int found = 0;
+    while (dirent *e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name.size() > ext.size() && name.compare(name.size() - ext.size(), ext.size(), ext) == 0) {
+            *path = dir + "/" + name;
+            found++;
+        }
+    }
+    closedir(d);
+    struct stat st;
+    if (found != 1 || stat(path->c_str(), &st) != 0) return false;
+    *inode = st.st_ino;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/halide_jit_cache_XXXXXX";
+    if (!mkdtemp(dir)) {
+        printf("Could not make a directory to cache pipelines in\n");
+        return -1;
+    }
+
+    // Turn off the in-memory cache, so that the second compilation
+    // has to come from the directory.
+    setenv("HL_JIT_CACHE_SIZE", "0", 1);
+    setenv("HL_JIT_CACHE_DIR", dir, 1);
+
+    check_pipeline();
+
+    std::string dir_name = dir;
+    std::string bc, key;
+    ino_t bc_inode, key_inode;
+    if (!find_file(dir_name, ".bc", &bc, &bc_inode) ||
+        !find_file(dir_name, ".key", &key, &key_inode)) {
+        printf("The pipeline wasn't stored in %s\n", dir);
+        return -1;
+    }
+
+    // The second time, the pipeline should be loaded from the
+    // directory, and not stored again.
+    check_pipeline();
+
+    std::string bc2, key2;
+    ino_t bc2_inode, key2_inode;
+    if (!find_file(dir_name, ".bc", &bc2, &bc2_inode) ||
+        !find_file(dir_name, ".key", &key2, &key2_inode)) {
+        printf("The stored pipeline went missing from %s\n", dir);
+        return -1;
+    }
+    if (bc2 != bc || key2 != key || bc2_inode != bc_inode || key2_inode != key_inode) {
+        printf("The pipeline was compiled again instead of loaded from %s\n", dir);
+        return -1;
+    }
+
+    // Keep the function name on the first line of the key file, but
+    // make the key belong to some other pipeline. It should be
+    // ignored, and the pipeline compiled and stored afresh.
+    std::string function_name;
+    {
+        FILE *f = fopen(key.c_str(), "rb");
+        char line[1024];
+        if (!f || !fgets(line, sizeof(line), f)) {
+            printf("Could not read %s\n", key.c_str());
+            return -1;
+        }
+        fclose(f);
+        function_name = line;
+        f = fopen(key.c_str(), "wb");
+        fprintf(f, "%snot the key of this pipeline", function_name.c_str());
+        fclose(f);
+    }
+
+    check_pipeline();
+
+    if (!find_file(dir_name, ".key", &key2, &key2_inode) || key2_inode == key_inode) {
+        printf("A pipeline with a mismatched key was loaded from %s\n", dir);
+        return -1;
+    }
+    {
+        FILE *f = fopen(key2.c_str(), "rb");
+        char contents[64];
+        size_t n = f ? fread(contents, 1, sizeof(contents), f) : 0;
+        if (f) fclose(f);
+        const char *tampered = "not the key of this pipeline";
+        if (n <= function_name.size() ||
+            strncmp(contents + function_name.size(), tampered, strlen(tampered)) == 0) {
+            printf("The mismatched key in %s wasn't replaced\n", key2.c_str());
+            return -1;
+        }
+    }
+
+    std::string cmd = "rm -rf " + dir_name;
+    if (system(cmd.c_str()) != 0) {
+        printf("Could not remove %s\n", dir);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+// Realize a two stage pipeline over a 100x100 domain, and return the
+// peak memory it used.
+int64_t peak_memory(bool compute_root) {
+    Var x, y;
+    Func f("f"), g("g");
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) + f(x+1, y+1);
+    if (compute_root) {
+        f.compute_root();
+    } else {
+        f.compute_at(g, y);
+    }
+    g.realize(100, 100);
+
+    std::vector<AllocationStats> stats = g.memory_stats();
+    if (stats.size() != 2 || stats[0].name != "g" || stats[1].name != "f") {
+        printf("Expected stats for g and f\n");
+        exit(-1);
+    }
+    for (size_t i = 0; i < stats.size(); i++) {
+        if (stats[i].current_bytes != 0) {
+            printf("%s still has %lld bytes allocated\n", stats[i].name.c_str(),
+                   (long long)stats[i].current_bytes);
+            exit(-1);
+        }
+    }
+    if (stats[0].peak_bytes != stats[1].peak_bytes) {
+        printf("f is the only allocation, so should account for the whole peak\n");
+        exit(-1);
+    }
+    return stats[0].peak_bytes;
+}
+
+int main(int argc, char **argv) {
+    // Memory tracking is decided when the pipeline is compiled
+    setenv("HL_TRACK_MEMORY", "1", 1);
+
+    // Computed at root, f needs 101x101 ints
+    int64_t root = peak_memory(true);
+    if (root != 101*101*4) {
+        printf("Peak memory with f computed at root was %lld instead of %d\n",
+               (long long)root, 101*101*4);
+        return -1;
+    }
+
+    // Computed per scanline of g, f only needs two scanlines at a time
+    int64_t at = peak_memory(false);
+    if (at >= root) {
+        printf("Peak memory with f computed at g's scanlines (%lld) should be less than at root (%lld)\n",
+               (long long)at, (long long)root);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <Halide.h>
+
+#ifdef _WIN32
+extern "C" bool QueryPerformanceCounter(uint64_t *);
+extern "C" bool QueryPerformanceFrequency(uint64_t *);
+double currentTime() {
+    uint64_t t, freq;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&freq);
+    return (t * 1000.0) / freq;
+}
+#else
+#include <sys/time.h>
+double currentTime() {
+    timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000.0 + t.tv_usec / 1000.0f;
+}
+#endif
+
+using namespace Halide;
+
+// A parallel loop with many thousands of tiny tasks. The per-task
+// scheduling overhead of the thread pool dominates here, so this
+// measures how well task claiming scales as threads are added.
+#define W 16
+#define H 65536
+
+int main(int argc, char **argv) {
+    Var x, y;
+    Func fine, coarse;
+
+    Expr math = cast<float>(x+y);
+    for (int i = 0; i < 4; i++) math = sqrt(math + 1);
+    fine(x, y) = math;
+    coarse(x, y) = math;
+
+    // One task per row
+    fine.parallel(y);
+
+    // One task per 1024 rows
+    Var yo, yi;
+    coarse.split(y, yo, yi, 1024).parallel(yo);
+
+    Image<float> imf = fine.realize(W, H);
+    Image<float> imc = coarse.realize(W, H);
+
+    double t1, t2;
+
+    t1 = currentTime();
+    for (int i = 0; i < 10; i++) {
+        fine.realize(imf);
+    }
+    t2 = currentTime();
+    double fineTime = (t2 - t1) / 10;
+
+    t1 = currentTime();
+    for (int i = 0; i < 10; i++) {
+        coarse.realize(imc);
+    }
+    t2 = currentTime();
+    double coarseTime = (t2 - t1) / 10;
+
+    for (int y = 0; y < H; y++) {
+        for (int x = 0; x < W; x++) {
+            if (imf(x, y) != imc(x, y)) {
+                printf("imf(%d, %d) = %f\n", x, y, imf(x, y));
+                printf("imc(%d, %d) = %f\n", x, y, imc(x, y));
+                return -1;
+            }
+        }
+    }
+
+    printf("Times: %f %f\n", fineTime, coarseTime);
+    printf("Nanoseconds of overhead per task: %f\n", (fineTime - coarseTime) * 1e6 / H);
+    double slowdown = fineTime / coarseTime;
+    printf("Slowdown from fine-grained tasks: %f\n", slowdown);
+
+    if (slowdown > 2) {
+        fprintf(stderr, "WARNING: Per-task overhead in the thread pool is too high\n");
+        return 0;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    Var x, y;
+    Func f, g;
+
+    Param<int> k;
+    k.set(3);
+
+    f(x, y) = x*k + y;
+    g(x, y) = f(x, y) * 2;
+
+    // Workers claim 7 rows at a time. The extent isn't a multiple of
+    // the grain, so the last chunk is a partial one.
+    f.compute_root().parallel(y, 7);
+    // A grain larger than the whole loop
+    g.parallel(y, 1000);
+
+    Image<int> im = g.realize(16, 101);
+
+    for (int y = 0; y < 101; y++) {
+        for (int x = 0; x < 16; x++) {
+            if (im(x, y) != (x*3 + y)*2) {
+                printf("im(%d, %d) = %d\n", x, y, im(x, y));
+                return -1;
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
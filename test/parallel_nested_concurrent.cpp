@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+// Nested parallel loops, while the same pipeline also runs from
+// other threads. All of the realizations share one thread pool, so
+// the nested loops and the outside ones are in flight on it at once.
+int main(int argc, char **argv) {
+    Var x, y, z;
+    Func f;
+
+    f(x, y, z) = x*y + z*3 + 1;
+
+    f.parallel(y);
+    f.parallel(z);
+
+    const int N = 4;
+    Image<int> outside[N] = {Image<int>(256, 256, 1), Image<int>(256, 256, 1),
+                             Image<int>(256, 256, 1), Image<int>(256, 256, 1)};
+    Image<int> nested(64, 64, 64);
+
+    for (int rep = 0; rep < 10; rep++) {
+        AsyncRealization r[N];
+        for (int i = 0; i < N; i++) {
+            r[i] = f.realize_async(outside[i]);
+        }
+        f.realize(nested);
+        for (int i = 0; i < N; i++) {
+            r[i].wait();
+        }
+    }
+
+    for (int z = 0; z < 64; z++) {
+        for (int y = 0; y < 64; y++) {
+            for (int x = 0; x < 64; x++) {
+                if (nested(x, y, z) != x*y + z*3 + 1) {
+                    printf("nested(%d, %d, %d) = %d\n", x, y, z, nested(x, y, z));
+                    return -1;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < N; i++) {
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 256; x++) {
+                if (outside[i](x, y, 0) != x*y + 1) {
+                    printf("outside[%d](%d, %d) = %d\n", i, x, y, outside[i](x, y, 0));
+                    return -1;
+                }
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
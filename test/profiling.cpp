@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+// Realize a function, and return the profile it prints to stderr.
+std::string realize_and_capture(Func f, Buffer dst) {
+    fflush(stderr);
+    FILE *tmp = tmpfile();
+    int saved = dup(2);
+    dup2(fileno(tmp), 2);
+    f.realize(dst);
+    fflush(stderr);
+    dup2(saved, 2);
+    close(saved);
+
+    std::string result;
+    rewind(tmp);
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), tmp)) {
+        result += buf;
+    }
+    fclose(tmp);
+    return result;
+}
+
+// Check that a profile lists some phases, that the time spent in
+// them adds up to the total, and that the percentages add up to
+// roughly 100. When counting, also check that the cycles and
+// instructions are either missing from every phase (-1), or
+// plausible. Returns the total time, or -1 if the profile is bad.
+long long check_profile(const std::string &profile, bool counting) {
+    long long total = -1, sum = 0, percent = 0;
+    long long counter_sum[2] = {0, 0};
+    int missing[2] = {0, 0};
+    int phases = 0;
+
+    const char *line = profile.c_str();
+    while (*line) {
+        const char *end = strchr(line, '\n');
+        if (!end) end = line + strlen(line);
+        std::string l(line, end);
+        line = *end ? end + 1 : end;
+
+        if (l.find("Profile of ") == 0) {
+            if (total >= 0) {
+                printf("More than one profile:\n%s", profile.c_str());
+                return -1;
+            }
+            total = atoll(l.c_str() + l.rfind(':') + 1);
+        } else if (total >= 0 && l.find("    ") == 0 && l.find("Columns") == std::string::npos) {
+            size_t colon = l.rfind(':');
+            if (colon == std::string::npos) continue;
+            const char *p = l.c_str() + colon + 1;
+            char *next;
+            long long values[7];
+            int n = 0;
+            while (n < 7) {
+                values[n] = strtoll(p, &next, 10);
+                if (next == p) break;
+                p = next;
+                n++;
+            }
+            if (n != (counting ? 7 : 2) || values[0] < 0 || values[1] < 0) {
+                printf("Malformed phase in profile: %s\n", l.c_str());
+                return -1;
+            }
+            phases++;
+            sum += values[0];
+            percent += values[1];
+            for (int c = 0; counting && c < 2; c++) {
+                if (values[2 + c] == -1) {
+                    missing[c]++;
+                } else if (values[2 + c] < 0) {
+                    printf("Negative counter in profile: %s\n", l.c_str());
+                    return -1;
+                } else {
+                    counter_sum[c] += values[2 + c];
+                }
+            }
+        }
+    }
+
+    if (total < 0 || phases == 0) {
+        printf("No profile was printed:\n%s", profile.c_str());
+        return -1;
+    }
+    if (sum != total) {
+        printf("The phases add up to %lld ns instead of %lld ns\n", sum, total);
+        return -1;
+    }
+    if (total > 0 && (percent > 100 || percent < 100 - phases)) {
+        printf("The percentages add up to %lld\n", percent);
+        return -1;
+    }
+    for (int c = 0; counting && c < 2; c++) {
+        if (missing[c] != 0 && missing[c] != phases) {
+            printf("Counter %d is only missing from some phases\n", c);
+            return -1;
+        }
+        // Neither can plausibly pass 100 per nanosecond, which would
+        // take a 10 GHz cpu retiring 10 instructions per cycle.
+        if (missing[c] == 0 && (counter_sum[c] <= 0 || counter_sum[c] > total * 100)) {
+            printf("Implausible total for counter %d: %lld over %lld ns\n", c, counter_sum[c], total);
+            return -1;
+        }
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    // Profiling is decided when the pipeline is compiled
+    setenv("HL_PROFILE", "1", 1);
+    // Sample often, so that even a short run shows up
+    setenv("HL_PROFILE_SAMPLE_US", "10", 1);
+
+    Var x, y;
+    Func f, g, h;
+    RDom r(0, 10);
+
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) * 2;
+    g(x, y) += f(x + r, y);
+    h(x, y) = g(x, y) + g(x+1, y);
+
+    // Cover phases nested inside each other, and parallel loops
+    // inside a phase.
+    f.compute_at(g, y);
+    g.compute_root().parallel(y);
+    h.parallel(y);
+
+    long long sampled = 0;
+    for (int i = 0; i < 3; i++) {
+        Image<int> im(256, 256);
+        long long t = check_profile(realize_and_capture(h, im), false);
+        if (t < 0) return -1;
+        sampled += t;
+
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 256; x++) {
+                int g0 = (x + y) * 2 + 10*(x + y) + 45;
+                int g1 = (x + 1 + y) * 2 + 10*(x + 1 + y) + 45;
+                if (im(x, y) != g0 + g1) {
+                    printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), g0 + g1);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    if (sampled == 0) {
+        printf("No time was sampled in any run\n");
+        return -1;
+    }
+
+    // A chain of stages in which h reuses f's memory. Each stage
+    // must still get its own phases in the profile.
+    {
+        Func f, g, h, out;
+        f(x, y) = x + y;
+        g(x, y) = f(x, y) + f(x+1, y);
+        h(x, y) = g(x, y) * 2 + g(x, y+1);
+        out(x, y) = h(x, y) + 1;
+        f.compute_root();
+        g.compute_root();
+        h.compute_root();
+
+        Image<int> im(256, 256);
+        std::string profile = realize_and_capture(out, im);
+        if (check_profile(profile, false) < 0) return -1;
+        Func stages[] = {f, g, h};
+        for (int i = 0; i < 3; i++) {
+            if (profile.find("    " + stages[i].name() + " produce:") == std::string::npos) {
+                printf("No phase for %s in the profile:\n%s", stages[i].name().c_str(), profile.c_str());
+                return -1;
+            }
+        }
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 256; x++) {
+                int correct = 6*x + 6*y + 6;
+                if (im(x, y) != correct) {
+                    printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), correct);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    // Count hardware events instead of sampling. If the counters
+    // aren't available, only the time is measured.
+    setenv("HL_PROFILE", "2", 1);
+    Func k;
+    k(x, y) = g(x, y) * 3;
+    k.parallel(y);
+    Image<int> im(64, 64);
+    long long counted = check_profile(realize_and_capture(k, im), true);
+    if (counted < 0) return -1;
+    if (counted == 0) {
+        printf("No time was counted\n");
+        return -1;
+    }
+    for (int y = 0; y < 64; y++) {
+        for (int x = 0; x < 64; x++) {
+            int g0 = (x + y) * 2 + 10*(x + y) + 45;
+            if (im(x, y) != g0 * 3) {
+                printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), g0 * 3);
+                return -1;
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
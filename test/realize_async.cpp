@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int callbacks = 0;
+
+void on_done(void *user) {
+    __sync_fetch_and_add(&callbacks, 1);
+    __sync_fetch_and_add((int *)user, 1);
+}
+
+int main(int argc, char **argv) {
+    Var x, y;
+    Func f, g;
+
+    Param<int> k;
+    k.set(3);
+
+    f(x, y) = x*k + y;
+    f.parallel(y);
+
+    g(x, y) = x - y;
+
+    Image<int> im_f1(64, 64), im_f2(64, 64), im_g(64, 64);
+
+    int f_done = 0;
+    AsyncRealization r1 = f.realize_async(im_f1, on_done, &f_done);
+    AsyncRealization r2 = f.realize_async(im_f2, on_done, &f_done);
+    AsyncRealization r3 = g.realize_async(im_g);
+
+    r1.wait();
+    r2.wait();
+    r3.wait();
+
+    if (!r1.done() || !r2.done() || !r3.done()) {
+        printf("Realization not done after waiting on it\n");
+        return -1;
+    }
+
+    if (callbacks != 2 || f_done != 2) {
+        printf("Callbacks ran %d times\n", callbacks);
+        return -1;
+    }
+
+    for (int y = 0; y < 64; y++) {
+        for (int x = 0; x < 64; x++) {
+            if (im_f1(x, y) != x*3 + y || im_f2(x, y) != x*3 + y) {
+                printf("im_f(%d, %d) = %d %d\n", x, y, im_f1(x, y), im_f2(x, y));
+                return -1;
+            }
+            if (im_g(x, y) != x - y) {
+                printf("im_g(%d, %d) = %d\n", x, y, im_g(x, y));
+                return -1;
+            }
+        }
+    }
+
+    // Dropping the handle without waiting should block until the
+    // realization is done.
+    {
+        Image<int> im(64, 64);
+        g.realize_async(im);
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    Var x, y, xi, yi;
+    Func f, g;
+
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) + f(x+1, y+1);
+
+    // Allocate f once per tile, big enough to go on the heap, so that
+    // the runtime allocator caches the freed blocks.
+    g.tile(x, y, xi, yi, 100, 100);
+    f.compute_at(g, x);
+
+    // Nothing to release before compiling
+    g.release_cached_memory();
+
+    Image<int> out(1000, 1000);
+    for (int i = 0; i < 3; i++) {
+        g.realize(out);
+        g.release_cached_memory();
+    }
+
+    // The allocator still works once its cache is gone
+    g.realize(out);
+
+    for (int y = 0; y < 1000; y++) {
+        for (int x = 0; x < 1000; x++) {
+            if (out(x, y) != 2*x + 2*y + 2) {
+                printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), 2*x + 2*y + 2);
+                return -1;
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int mallocs = 0;
+
+void *my_malloc(size_t x) {
+    mallocs++;
+    void *orig = malloc(x+32);
+    void *ptr = (void *)((((size_t)orig + 32) >> 5) << 5);
+    ((void **)ptr)[-1] = orig;
+    return ptr;
+}
+
+void my_free(void *ptr) {
+    free(((void**)ptr)[-1]);
+}
+
+int main(int argc, char **argv) {
+    Var x, y;
+    Func f, g, h, k, out;
+
+    // A chain of stages, each only read by the next. Only two of
+    // them are alive at any one time, so h can use f's memory. k
+    // would fit in g's, but has a different type, so it gets its own.
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) + f(x+1, y);
+    h(x, y) = g(x, y) * 2 + g(x, y+1);
+    k(x, y) = cast<int16_t>(h(x, y) - h(x+1, y));
+    out(x, y) = k(x, y) + 1;
+
+    f.compute_root();
+    g.compute_root();
+    h.compute_root();
+    k.compute_root();
+
+    out.set_custom_allocator(my_malloc, my_free);
+    Image<int> im = out.realize(200, 200);
+
+    if (mallocs != 3) {
+        printf("Expected 3 allocations instead of %d\n", mallocs);
+        return -1;
+    }
+
+    for (int y = 0; y < 200; y++) {
+        for (int x = 0; x < 200; x++) {
+            // g(x, y) = 2x + 2y + 1, h(x, y) = 6x + 6y + 5
+            if (im(x, y) != -5) {
+                printf("im(%d, %d) = %d\n", x, y, im(x, y));
+                return -1;
+            }
+        }
+    }
+
+    // A buffer that would reuse the memory of one of a different
+    // type, both of which are read by the output.
+    {
+        Func f, g, h, out;
+        f(x, y) = x + y;
+        g(x, y) = cast<float>(f(x, y) + f(x+1, y));
+        h(x, y) = cast<int16_t>(g(x, y) * 2);
+        out(x, y) = g(x, y) + h(x, y);
+
+        f.compute_root();
+        g.compute_root();
+        h.compute_root();
+
+        Image<float> im = out.realize(200, 200);
+        for (int y = 0; y < 200; y++) {
+            for (int x = 0; x < 200; x++) {
+                float correct = (2*x + 2*y + 1) * 3;
+                if (im(x, y) != correct) {
+                    printf("im(%d, %d) = %f instead of %f\n", x, y, im(x, y), correct);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int mallocs = 0;
+
+void *my_malloc(size_t x) {
+    mallocs++;
+    void *orig = malloc(x+32);
+    void *ptr = (void *)((((size_t)orig + 32) >> 5) << 5);
+    ((void **)ptr)[-1] = orig;
+    return ptr;
+}
+
+void my_free(void *ptr) {
+    free(((void**)ptr)[-1]);
+}
+
+int main(int argc, char **argv) {
+    ImageParam input(Int(32), 2);
+    Image<int> in(210, 110);
+    for (int y = 0; y < 110; y++) {
+        for (int x = 0; x < 210; x++) {
+            in(x, y) = x + y*3;
+        }
+    }
+    input.set(in);
+
+    Var x, y;
+    Func f, g, h;
+    f(x, y) = input(x, y) * 2;
+    g(x, y) = f(x, y) + f(x+10, y+10);
+    h(x, y) = g(x, y) - g(x, y+1);
+    // Both of these are too large for the stack
+    f.compute_root();
+    g.compute_root();
+    h.set_custom_allocator(my_malloc, my_free);
+
+    size_t size = h.scratch_size(200, 99);
+    // f is 210x110 ints, and g is 200x100 ints
+    if (size < (210*110 + 200*100)*4) {
+        printf("Scratch size is too small: %d\n", (int)size);
+        return -1;
+    }
+
+    void *arena = malloc(size);
+    Image<int> out(200, 99);
+
+    // Run it a few times with the arena. Nothing should hit the heap.
+    for (int i = 0; i < 3; i++) {
+        h.realize(out, arena, size);
+    }
+    if (mallocs != 0) {
+        printf("Realizing with a scratch arena called malloc %d times\n", mallocs);
+        return -1;
+    }
+
+    for (int y = 0; y < 99; y++) {
+        for (int x = 0; x < 200; x++) {
+            if (out(x, y) != -12) {
+                printf("out(%d, %d) = %d\n", x, y, out(x, y));
+                return -1;
+            }
+        }
+    }
+
+    // An arena that's too small falls back to the heap
+    h.realize(out, arena, 1024);
+    if (mallocs == 0) {
+        printf("Expected a too-small arena to fall back to malloc\n");
+        return -1;
+    }
+    if (out(17, 23) != -12) {
+        printf("out(17, 23) = %d\n", out(17, 23));
+        return -1;
+    }
+
+    // Without the arena everything goes through malloc again
+    mallocs = 0;
+    h.realize(out);
+    if (mallocs != 2) {
+        printf("Realizing without an arena called malloc %d times\n", mallocs);
+        return -1;
+    }
+
+    free(arena);
+
+    // Params of types that can't be turned into constants don't stop
+    // the scratch size being computed, as long as sizes don't depend
+    // on them.
+    {
+        Param<double> scale;
+        scale.set(0.5);
+        Func f, g;
+        f(x, y) = cast<double>(x + y) * scale;
+        g(x, y) = f(x, y) + f(x+1, y);
+        f.compute_root();
+        size = g.scratch_size(100, 100);
+        if (size < 101*100*8) {
+            printf("Scratch size with a double param is too small: %d\n", (int)size);
+            return -1;
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
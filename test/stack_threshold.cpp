@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int mallocs = 0;
+
+void *my_malloc(size_t x) {
+    __sync_fetch_and_add(&mallocs, 1);
+    void *orig = malloc(x+32);
+    void *ptr = (void *)((((size_t)orig + 32) >> 5) << 5);
+    ((void **)ptr)[-1] = orig;
+    return ptr;
+}
+
+void my_free(void *ptr) {
+    free(((void**)ptr)[-1]);
+}
+
+bool check(Image<int> im) {
+    for (int y = 0; y < im.height(); y++) {
+        for (int x = 0; x < im.width(); x++) {
+            if (im(x, y) != 2*x + 2*y + 1) {
+                printf("im(%d, %d) = %d\n", x, y, im(x, y));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Var x, y;
+
+    {
+        // Each row of f is about 40k, computed once per row of g, in
+        // parallel.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x, y) + f(x+1, y);
+        f.compute_at(g, y);
+        g.parallel(y);
+        g.set_custom_allocator(my_malloc, my_free);
+        g.set_stack_allocation_threshold(64*1024);
+
+        Image<int> im = g.realize(10000, 16);
+        if (mallocs != 0) {
+            printf("With a large stack threshold, malloc was called %d times\n", mallocs);
+            return -1;
+        }
+        if (!check(im)) return -1;
+    }
+
+    {
+        // Now force everything onto the heap, even small things.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x, y) + f(x+1, y);
+        f.compute_at(g, y);
+        g.set_custom_allocator(my_malloc, my_free);
+        g.set_stack_allocation_threshold(0);
+
+        Image<int> im = g.realize(100, 16);
+        if (mallocs == 0) {
+            printf("With a stack threshold of zero, malloc was not called\n");
+            return -1;
+        }
+        if (!check(im)) return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
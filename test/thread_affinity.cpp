@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <Halide.h>
+
+using namespace Halide;
+
+// Check that with compact or scatter affinity, every worker thread of
+// the runtime's pool is pinned to a single cpu the process may run on,
+// and that the pipeline still computes the right thing.
+
+#ifdef __linux__
+pthread_t main_thread;
+cpu_set_t allowed;
+int unpinned = 0, outside = 0, tasks = 0;
+
+void my_do_task(void (*f)(int, uint8_t *), int idx, uint8_t *closure) {
+    if (!pthread_equal(pthread_self(), main_thread)) {
+        cpu_set_t mine;
+        CPU_ZERO(&mine);
+        sched_getaffinity(0, sizeof(mine), &mine);
+        if (CPU_COUNT(&mine) != 1) {
+            __sync_fetch_and_add(&unpinned, 1);
+        } else {
+            for (int c = 0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &mine) && !CPU_ISSET(c, &allowed)) {
+                    __sync_fetch_and_add(&outside, 1);
+                }
+            }
+        }
+    }
+    __sync_fetch_and_add(&tasks, 1);
+    f(idx, closure);
+}
+#endif
+
+int main(int argc, char **argv) {
+    #ifndef __linux__
+    printf("Thread affinity is only supported on linux\n");
+    printf("Success!\n");
+    return 0;
+    #else
+    main_thread = pthread_self();
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    Var x, y;
+    Func f;
+    f(x, y) = x*y + 1;
+    f.parallel(y);
+    f.set_custom_do_task(my_do_task);
+    f.set_num_threads(4);
+
+    ThreadAffinity modes[] = {CompactAffinity, ScatterAffinity};
+    for (int m = 0; m < 2; m++) {
+        f.set_thread_affinity(modes[m]);
+        tasks = 0;
+        Image<int> im = f.realize(64, 1024);
+
+        for (int y = 0; y < 1024; y++) {
+            for (int x = 0; x < 64; x++) {
+                if (im(x, y) != x*y + 1) {
+                    printf("im(%d, %d) = %d\n", x, y, im(x, y));
+                    return -1;
+                }
+            }
+        }
+
+        if (tasks != 1024) {
+            printf("%d tasks ran instead of 1024\n", tasks);
+            return -1;
+        }
+
+        if (unpinned || outside) {
+            printf("Affinity mode %d: %d tasks ran on unpinned workers, and %d on workers pinned to forbidden cpus\n",
+                   (int)modes[m], unpinned, outside);
+            return -1;
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+    #endif
+}
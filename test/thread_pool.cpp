@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+int counts[1000];
+
+void count(int idx, uint8_t *closure) {
+    __sync_fetch_and_add(counts + idx, 1);
+}
+
+int main(int argc, char **argv) {
+    // Run a loop directly on a pool
+    ThreadPool batch(3, 10);
+    if (batch.size() != 3 || batch.priority() != 10) {
+        printf("Pool has the wrong size or priority: %d %d\n", batch.size(), batch.priority());
+        return -1;
+    }
+    batch.do_par_for(count, 0, 1000, 7, NULL);
+    for (int i = 0; i < 1000; i++) {
+        if (counts[i] != 1) {
+            printf("Task %d ran %d times\n", i, counts[i]);
+            return -1;
+        }
+    }
+
+    // Give two pipelines their own pools
+    ThreadPool latency(2);
+
+    Var x, y;
+    Func f, g;
+    f(x, y) = x*y + 1;
+    g(x, y) = f(x, y) + f(x+1, y);
+    f.compute_root().parallel(y);
+    g.parallel(y, 4);
+
+    Func h;
+    h(x, y) = x - y;
+    h.parallel(y);
+
+    g.set_thread_pool(batch);
+    h.set_thread_pool(latency);
+
+    Image<int> im_g = g.realize(32, 32);
+    Image<int> im_h = h.realize(32, 32);
+
+    // Go back to the runtime's pool
+    h.set_thread_pool(ThreadPool());
+    Image<int> im_h2 = h.realize(32, 32);
+
+    for (int y = 0; y < 32; y++) {
+        for (int x = 0; x < 32; x++) {
+            if (im_g(x, y) != x*y + 1 + (x+1)*y + 1) {
+                printf("im_g(%d, %d) = %d\n", x, y, im_g(x, y));
+                return -1;
+            }
+            if (im_h(x, y) != x - y || im_h2(x, y) != x - y) {
+                printf("im_h(%d, %d) = %d %d\n", x, y, im_h(x, y), im_h2(x, y));
+                return -1;
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+// Record which threads run the tasks of the parallel loop
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t seen[1024];
+int num_seen = 0;
+
+void my_do_task(void (*f)(int, uint8_t *), int idx, uint8_t *closure) {
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&mutex);
+    bool found = false;
+    for (int i = 0; i < num_seen; i++) {
+        if (pthread_equal(seen[i], self)) found = true;
+    }
+    if (!found && num_seen < 1024) seen[num_seen++] = self;
+    pthread_mutex_unlock(&mutex);
+    f(idx, closure);
+}
+
+bool check(Image<float> im) {
+    for (int y = 0; y < im.height(); y++) {
+        for (int x = 0; x < im.width(); x++) {
+            float correct = sqrtf(x + y);
+            if (fabs(im(x, y) - correct) > 0.001f) {
+                printf("im(%d, %d) = %f instead of %f\n", x, y, im(x, y), correct);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Var x, y;
+    Func f;
+    f(x, y) = sqrt(cast<float>(x + y));
+    f.parallel(y);
+    f.set_custom_do_task(my_do_task);
+
+    Image<float> im(256, 256);
+
+    // A pool of three threads, counting this one
+    f.set_num_threads(3);
+    f.set_thread_spin_us(0);
+    f.realize(im);
+    if (!check(im)) return -1;
+    if (num_seen < 1 || num_seen > 3) {
+        printf("Tasks ran on %d threads with a pool of 3\n", num_seen);
+        return -1;
+    }
+
+    // Just this thread
+    num_seen = 0;
+    f.set_num_threads(1);
+    f.set_thread_affinity(CompactAffinity);
+    f.realize(im);
+    if (!check(im)) return -1;
+    if (num_seen != 1 || !pthread_equal(seen[0], pthread_self())) {
+        printf("Tasks ran on %d threads with a pool of 1\n", num_seen);
+        return -1;
+    }
+
+    // Resizing while realizations are in flight must not disturb
+    // them. It takes effect once they're done.
+    Image<float> im2(256, 256);
+    f.set_num_threads(0);
+    f.set_thread_affinity(NoAffinity);
+    f.set_thread_spin_us(50);
+    AsyncRealization r = f.realize_async(im2);
+    f.set_num_threads(2);
+    f.realize(im);
+    r.wait();
+    if (!check(im) || !check(im2)) return -1;
+
+    num_seen = 0;
+    f.realize(im);
+    if (!check(im)) return -1;
+    if (num_seen < 1 || num_seen > 2) {
+        printf("Tasks ran on %d threads with a pool of 2\n", num_seen);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <Halide.h>
+
+using namespace Halide;
+
+// Decode a trace into the chrome timeline format with decode_trace,
+// and check that the spans on each thread nest properly.
+
+struct Span {
+    double start, end;
+    bool operator<(const Span &other) const {
+        // Outer spans before the spans that start with them
+        if (start != other.start) return start < other.start;
+        return end > other.end;
+    }
+};
+
+int main(int argc, char **argv) {
+    setenv("HL_TRACE", "2", 1);
+    setenv("HL_TRACE_FILE", "trace_to_chrome.trace", 1);
+
+    Var x, y;
+    Func f, g;
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) + f(x+1, y);
+    f.compute_root().parallel(y);
+    g.parallel(y);
+
+    const int runs = 3;
+    for (int i = 0; i < runs; i++) {
+        g.realize(16, 16);
+    }
+
+    // decode_trace is built into the same directory as the tests
+    std::string dir = argv[0];
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : dir.substr(0, slash);
+    std::string cmd = dir + "/decode_trace -chrome trace_to_chrome." + g.name() +
+        ".trace > trace_to_chrome.json 2> trace_to_chrome.err";
+    if (system(cmd.c_str()) != 0) {
+        printf("%s failed\n", cmd.c_str());
+        return -1;
+    }
+
+    FILE *err = fopen("trace_to_chrome.err", "r");
+    char line[1024];
+    if (err && fgets(line, sizeof(line), err)) {
+        printf("decode_trace complained: %s", line);
+        return -1;
+    }
+    if (err) fclose(err);
+
+    FILE *file = fopen("trace_to_chrome.json", "r");
+    if (!file) {
+        printf("No timeline\n");
+        return -1;
+    }
+
+    std::map<int, std::vector<Span> > spans;
+    int tasks = 0, pipelines = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char name[256], cat[256];
+        double ts, dur;
+        int tid;
+        if (sscanf(line, "{\"name\": \"%255[^\"]\", \"cat\": \"%255[^\"]\", \"ph\": \"X\", "
+                   "\"ts\": %lf, \"dur\": %lf, \"pid\": 0, \"tid\": %d}",
+                   name, cat, &ts, &dur, &tid) != 5) {
+            continue;
+        }
+        if (dur < 0) {
+            printf("Span %s on thread %d ends before it starts\n", name, tid);
+            return -1;
+        }
+        if (strcmp(cat, "task") == 0) tasks++;
+        if (strcmp(cat, "pipeline") == 0) pipelines++;
+        Span span = {ts, ts + dur};
+        spans[tid].push_back(span);
+    }
+    fclose(file);
+
+    // Each run has one iteration of the loop over y of each function
+    // per row
+    if (pipelines != runs || tasks != runs * 2 * 16) {
+        printf("%d pipeline spans and %d task spans\n", pipelines, tasks);
+        return -1;
+    }
+
+    // The times are printed in microseconds to three decimal places
+    const double slop = 0.002;
+    for (std::map<int, std::vector<Span> >::iterator iter = spans.begin();
+         iter != spans.end(); ++iter) {
+        std::vector<Span> &s = iter->second;
+        std::sort(s.begin(), s.end());
+        std::vector<Span> open;
+        for (size_t i = 0; i < s.size(); i++) {
+            while (!open.empty() && open.back().end <= s[i].start + slop) {
+                open.pop_back();
+            }
+            if (!open.empty() && s[i].end > open.back().end + slop) {
+                printf("On thread %d, the span from %f to %f overlaps the one from %f to %f\n",
+                       iter->first, s[i].start, s[i].end, open.back().start, open.back().end);
+                return -1;
+            }
+            open.push_back(s[i]);
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Halide.h>
+
+using namespace Halide;
+
+// Open the trace of a pipeline, and check its magic number
+FILE *open_trace(Func f) {
+    std::string filename = "trace_to_file." + f.name() + ".trace";
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        printf("No trace file %s\n", filename.c_str());
+        return NULL;
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, HALIDE_TRACE_MAGIC, 8)) {
+        printf("Bad magic number in %s\n", filename.c_str());
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+int main(int argc, char **argv) {
+    // Both are read when the pipeline is compiled, and HL_TRACE_FILE
+    // again when it runs.
+    setenv("HL_TRACE", "3", 1);
+    setenv("HL_TRACE_FILE", "trace_to_file.trace", 1);
+
+    Var x, y;
+    Func f, g;
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) + f(x+1, y);
+    f.compute_root();
+    g.parallel(y);
+
+    Image<int> im = g.realize(16, 16);
+
+    // Trace another pipeline too. It goes to a file of its own, so it
+    // must not disturb the trace of g. One of its functions has more
+    // dimensions than there's room for in a record, so its provides
+    // should keep just the first four coordinates.
+    Var z, w, v;
+    Func h5, h;
+    h5(x, y, z, w, v) = x + y + z + w + v;
+    h(x, y) = h5(x, y, 0, 0, 0) + h5(x, y, 1, 1, 1);
+    h5.compute_root();
+    h.realize(2, 2);
+    FILE *h_file = open_trace(h);
+    if (!h_file) return -1;
+    int h5_provides = 0;
+    halide_trace_record_t hr;
+    while (fread(&hr, sizeof(hr), 1, h_file) == 1) {
+        if (hr.event == HALIDE_TRACE_FUNC_NAME) {
+            char name[sizeof(hr)];
+            if (fread(name, sizeof(hr), 1, h_file) != 1) break;
+        } else if (hr.dimensions > 4) {
+            printf("An event claims %d dimensions\n", hr.dimensions);
+            return -1;
+        } else if (hr.event == HALIDE_TRACE_PROVIDE && hr.dimensions == 4) {
+            h5_provides++;
+        }
+    }
+    fclose(h_file);
+    if (h5_provides != 32) {
+        printf("h5 was traced %d times instead of 32\n", h5_provides);
+        return -1;
+    }
+
+    // Check every value of f and g was traced exactly once
+    FILE *file = open_trace(g);
+    if (!file) return -1;
+
+    int f_id = -1, g_id = -1;
+    int f_provides[17][16], g_provides[16][16];
+    memset(f_provides, 0, sizeof(f_provides));
+    memset(g_provides, 0, sizeof(g_provides));
+    int tasks_begun = 0, tasks_ended = 0;
+    halide_trace_record_t r;
+    while (fread(&r, sizeof(r), 1, file) == 1) {
+        if (r.event == HALIDE_TRACE_FUNC_NAME) {
+            char name[sizeof(r)+1];
+            if (r.coords[0] > (int)sizeof(r) || fread(name, sizeof(r), 1, file) != 1) {
+                printf("Bad function name\n");
+                return -1;
+            }
+            name[r.coords[0]] = 0;
+            if (f.name() == name) f_id = r.func;
+            if (g.name() == name) g_id = r.func;
+        } else if (r.event == HALIDE_TRACE_PROVIDE) {
+            int px = r.coords[0], py = r.coords[1];
+            if (r.dimensions != 2 || px < 0 || py < 0 || px > 16 || py > 15) {
+                printf("Bad provide at %d %d\n", px, py);
+                return -1;
+            }
+            if (r.func == f_id) f_provides[px][py]++;
+            else if (r.func == g_id && px < 16) g_provides[px][py]++;
+            else {
+                printf("Provide to unknown function %d\n", r.func);
+                return -1;
+            }
+        } else if (r.event == HALIDE_TRACE_BEGIN_TASK) {
+            tasks_begun++;
+        } else if (r.event == HALIDE_TRACE_END_TASK) {
+            tasks_ended++;
+        }
+    }
+    fclose(file);
+
+    // Each iteration of the parallel loop over y is a task
+    if (tasks_begun != 16 || tasks_ended != 16) {
+        printf("%d tasks begun and %d ended\n", tasks_begun, tasks_ended);
+        return -1;
+    }
+
+    for (int y = 0; y < 16; y++) {
+        for (int x = 0; x < 17; x++) {
+            if (f_provides[x][y] != 1 || (x < 16 && g_provides[x][y] != 1)) {
+                printf("f(%d, %d) was traced %d times, and g(%d, %d) %d times\n",
+                       x, y, f_provides[x][y], x, y, x < 16 ? g_provides[x][y] : 1);
+                return -1;
+            }
+            if (x < 16 && im(x, y) != 2*(x + y) + 1) {
+                printf("im(%d, %d) = %d\n", x, y, im(x, y));
+                return -1;
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}